@@ -547,7 +547,9 @@ cl::opt<bool, true> betterC(
     "betterC", cl::ZeroOrMore, cl::location(global.params.betterC),
     cl::desc("Omit generating some runtime information and helper functions"));
 
-// `-cov[=<n>|ctfe]` parser.
+CoverageIncrement coverageIncrement = CoverageIncrement::atomic;
+
+// `-cov[=<n>|ctfe|bitmap|sharded]` parser.
 struct CoverageParser : public cl::parser<DummyDataType> {
   explicit CoverageParser(cl::Option &O) : cl::parser<DummyDataType>(O) {}
 
@@ -564,6 +566,16 @@ struct CoverageParser : public cl::parser<DummyDataType> {
       return false;
     }
 
+    if (Arg == "bitmap") {
+      coverageIncrement = CoverageIncrement::bitmap;
+      return false;
+    }
+
+    if (Arg == "sharded") {
+      coverageIncrement = CoverageIncrement::sharded;
+      return false;
+    }
+
     unsigned char percent = 0;
     if (Arg.getAsInteger(0, percent)) {
       return O.error("'" + Arg +
@@ -583,7 +595,10 @@ static cl::opt<DummyDataType, false, CoverageParser> coverageAnalysis(
     "cov", cl::ZeroOrMore, cl::ValueOptional,
     cl::desc("Compile-in code coverage analysis and .lst file generation\n"
              "Use -cov=<n> for n% minimum required coverage\n"
-             "Use -cov=ctfe to include code executed during CTFE"));
+             "Use -cov=ctfe to include code executed during CTFE\n"
+             "Use -cov=bitmap to only record whether lines were executed\n"
+             "Use -cov=sharded to count in thread-local counters, merged "
+             "at thread exit"));
 
 // Compilation time tracing options
 cl::opt<bool> fTimeTrace(
@@ -607,6 +622,11 @@ cl::opt<LTOKind> ltoMode(
         clEnumValN(LTO_Thin, "thin",
                    "Parallel importing and codegen (faster than 'full')")));
 
+cl::opt<bool> wholeProgramVtables(
+    "fwhole-program-vtables", cl::ZeroOrMore,
+    cl::desc("Emit type metadata for vtables and virtual calls, enabling "
+             "whole-program devirtualization during LTO (requires -flto)"));
+
 cl::opt<std::string>
     saveOptimizationRecord("fsave-optimization-record",
                            cl::value_desc("filename"),
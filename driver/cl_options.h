@@ -98,6 +98,14 @@ extern std::vector<std::string> debugArgs;
 void createClashingOptions();
 void hideLLVMOptions();
 
+// How -cov updates the per-line execution counts
+enum class CoverageIncrement {
+  atomic,  // atomic add to the shared counters (default)
+  bitmap,  // plain store of an "executed" flag (-cov=bitmap)
+  sharded, // thread-local counters, merged at thread exit (-cov=sharded)
+};
+extern CoverageIncrement coverageIncrement;
+
 // Compilation time tracing options
 extern cl::opt<bool> fTimeTrace;
 extern cl::opt<std::string> fTimeTraceFile;
@@ -112,6 +120,7 @@ enum LTOKind {
 extern cl::opt<LTOKind> ltoMode;
 inline bool isUsingLTO() { return ltoMode != LTO_None; }
 inline bool isUsingThinLTO() { return ltoMode == LTO_Thin; }
+extern cl::opt<bool> wholeProgramVtables;
 
 extern cl::opt<std::string> saveOptimizationRecord;
 #if LDC_LLVM_SUPPORTED_TARGET_SPIRV || LDC_LLVM_SUPPORTED_TARGET_NVPTX
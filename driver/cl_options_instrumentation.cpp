@@ -19,6 +19,9 @@
 #include "dmd/globals.h"
 #include "gen/to_string.h"
 #include "llvm/ADT/Triple.h"
+#include "llvm/ProfileData/InstrProfReader.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 namespace {
 namespace cl = llvm::cl;
@@ -37,6 +40,16 @@ cl::opt<std::string> IRPGOInstrUseFile(
     cl::desc("Use instrumentation data for profile-guided optimization"),
     cl::ValueRequired);
 
+/// Option for generating context-sensitive IR-based PGO instrumentation (LLVM
+/// pass), used together with -fprofile-use
+cl::opt<std::string> CSPGOInstrGenFile(
+    "fcs-profile-generate", cl::value_desc("filename"),
+    cl::desc("Generate instrumented code to collect a context-sensitive "
+             "runtime profile (after inlining) into default.profraw "
+             "(overriden by '=<filename>' or LLVM_PROFILE_FILE env var), "
+             "requires -fprofile-use"),
+    cl::ZeroOrMore, cl::ValueOptional);
+
 /// Option for generating frontend-based PGO instrumentation
 cl::opt<std::string> ASTPGOInstrGenFile(
     "fprofile-instr-generate", cl::value_desc("filename"),
@@ -51,22 +64,131 @@ cl::opt<std::string> ASTPGOInstrUseFile(
     cl::desc("Use instrumentation data for profile-guided optimization"),
     cl::ValueRequired);
 
+/// Option for sample-based PGO (AutoFDO), e.g., converted from `perf` data
+cl::opt<std::string> SamplePGOUseFile(
+    "fprofile-sample-use", cl::ZeroOrMore, cl::value_desc("filename"),
+    cl::desc("Use sampling profile data (e.g., converted from Linux perf "
+             "data) for profile-guided optimization"),
+    cl::ValueRequired);
+
 cl::opt<int> fXRayInstructionThreshold(
     "fxray-instruction-threshold", cl::value_desc("value"),
     cl::desc("Sets the minimum function size to instrument with XRay"),
     cl::init(200), cl::ZeroOrMore, cl::ValueRequired);
 
+cl::list<std::string> fXRayAlwaysInstrument(
+    "fxray-always-instrument", cl::value_desc("filename"),
+    cl::desc("Always instrument the functions matching the patterns in this "
+             "file with XRay (`fun:<qualified D name glob>` or "
+             "`src:<source file glob>` lines)"),
+    cl::ZeroOrMore, cl::ValueRequired);
+
+cl::list<std::string> fXRayNeverInstrument(
+    "fxray-never-instrument", cl::value_desc("filename"),
+    cl::desc("Never instrument the functions matching the patterns in this "
+             "file with XRay (`fun:<qualified D name glob>` or "
+             "`src:<source file glob>` lines)"),
+    cl::ZeroOrMore, cl::ValueRequired);
+
+/// The patterns of an XRay always/never-instrument file.
+struct XRayFilterPatterns {
+  std::vector<llvm::GlobPattern> functions;
+  std::vector<llvm::GlobPattern> sourceFiles;
+
+  bool matches(llvm::StringRef qualifiedName, llvm::StringRef srcFile) const {
+    for (const auto &p : functions) {
+      if (p.match(qualifiedName))
+        return true;
+    }
+    for (const auto &p : sourceFiles) {
+      if (p.match(srcFile))
+        return true;
+    }
+    return false;
+  }
+};
+
+XRayFilterPatterns xrayAlwaysPatterns;
+XRayFilterPatterns xrayNeverPatterns;
+
+void loadXRayFilterFiles(const cl::list<std::string> &files,
+                         XRayFilterPatterns &patterns) {
+  for (const auto &filename : files) {
+    auto bufferOrErr = llvm::MemoryBuffer::getFile(filename);
+    if (!bufferOrErr) {
+      error(Loc(), "cannot read XRay filter file `%s`: %s", filename.c_str(),
+            bufferOrErr.getError().message().c_str());
+      continue;
+    }
+
+    llvm::SmallVector<llvm::StringRef, 64> lines;
+    bufferOrErr.get()->getBuffer().split(lines, '\n');
+    for (size_t i = 0; i < lines.size(); ++i) {
+      const auto line = lines[i].trim();
+      if (line.empty() || line.startswith("#"))
+        continue;
+
+      std::vector<llvm::GlobPattern> *list = nullptr;
+      llvm::StringRef pattern;
+      if (line.startswith("fun:")) {
+        list = &patterns.functions;
+        pattern = line.drop_front(4);
+      } else if (line.startswith("src:")) {
+        list = &patterns.sourceFiles;
+        pattern = line.drop_front(4);
+      } else {
+        error(Loc(), "%s:%u: expected `fun:<pattern>` or `src:<pattern>`",
+              filename.c_str(), static_cast<unsigned>(i + 1));
+        continue;
+      }
+
+      auto globOrErr = llvm::GlobPattern::create(pattern.trim());
+      if (auto E = globOrErr.takeError()) {
+        error(Loc(), "%s:%u: invalid pattern: %s", filename.c_str(),
+              static_cast<unsigned>(i + 1),
+              llvm::toString(std::move(E)).c_str());
+        continue;
+      }
+      list->push_back(std::move(*globOrErr));
+    }
+  }
+}
+
 } // anonymous namespace
 
 namespace opts {
 
 PGOKind pgoMode = PGO_None;
+bool csPGOInstrGen = false;
+const char *csPGOInstrGenFile = nullptr;
 
 cl::opt<bool>
     instrumentFunctions("finstrument-functions", cl::ZeroOrMore,
                         cl::desc("Instrument function entry and exit with "
                                  "GCC-compatible profiling calls"));
 
+cl::opt<unsigned> instrumentFunctionsSample(
+    "finstrument-functions-sample", cl::ZeroOrMore, cl::value_desc("N"),
+    cl::desc("With -finstrument-functions, only call the profiling hooks on "
+             "every N-th call per thread (0: never), and on every call while "
+             "the global `_d_instrument_functions_enabled` is non-zero"),
+    cl::init(1));
+
+cl::opt<FunctionTraceMode> functionTraceMode(
+    "finstrument", cl::ZeroOrMore, cl::desc("Function tracing mode:"),
+    cl::values(clEnumValN(FunctionTraceMode::traceBuffer, "trace-buffer",
+                          "Record function entry/exit timestamps in "
+                          "per-thread buffers, written asynchronously to a "
+                          "Chrome trace file (trace.json)")),
+    cl::init(FunctionTraceMode::none));
+
+cl::opt<unsigned> traceInstructionThreshold(
+    "finstrument-instruction-threshold", cl::ZeroOrMore,
+    cl::value_desc("value"),
+    cl::desc("Sets the minimum size (in IR instructions) of leaf functions "
+             "to trace with -finstrument=trace-buffer"),
+    cl::init(200));
+
 // DMD-style profiling (`dmd -profile`)
 static cl::opt<bool> dmdFunctionTrace(
     "fdmd-trace-functions", cl::ZeroOrMore,
@@ -76,6 +198,18 @@ cl::opt<bool> fXRayInstrument(
     "fxray-instrument", cl::ZeroOrMore,
     cl::desc("Generate XRay instrumentation sleds on function entry and exit"));
 
+cl::opt<bool> debugInfoForProfiling(
+    "fdebug-info-for-profiling", cl::ZeroOrMore,
+    cl::desc("Emit extra debug info (discriminators) to make sampling-based "
+             "profiling more accurate"));
+
+cl::opt<bool> profileFunctionLayout(
+    "fprofile-function-layout", cl::ZeroOrMore,
+    cl::desc("Use the PGO profile to separate hot and cold code: mark "
+             "never-executed functions as cold, split cold code out of "
+             "functions (LLVM 9+) and have lld/gold place hot functions "
+             "together"));
+
 llvm::StringRef getXRayInstructionThresholdString() {
   // The instruction threshold is constant during one compiler invoke, so we
   // can cache the int->string conversion result.
@@ -84,6 +218,37 @@ llvm::StringRef getXRayInstructionThresholdString() {
   return thresholdString;
 }
 
+XRayFilterResult matchXRayFilterFiles(llvm::StringRef qualifiedName,
+                                      llvm::StringRef srcFile) {
+  if (xrayNeverPatterns.matches(qualifiedName, srcFile))
+    return XRayFilterResult::never;
+  if (xrayAlwaysPatterns.matches(qualifiedName, srcFile))
+    return XRayFilterResult::always;
+  return XRayFilterResult::none;
+}
+
+bool isUsingCSPGOProfile() {
+#if LDC_LLVM_VER >= 900
+  if (!isUsingIRBasedPGOProfile())
+    return false;
+
+  // Only read the profile header once.
+  static const bool result = [] {
+    auto readerOrErr =
+        llvm::IndexedInstrProfReader::create(global.params.datafileInstrProf);
+    if (auto E = readerOrErr.takeError()) {
+      // Errors are reported when the profile is actually used.
+      llvm::consumeError(std::move(E));
+      return false;
+    }
+    return readerOrErr.get()->hasCSIRLevelProfile();
+  }();
+  return result;
+#else
+  return false;
+#endif
+}
+
 void initializeInstrumentationOptionsFromCmdline(const llvm::Triple &triple) {
   if (ASTPGOInstrGenFile.getNumOccurrences() > 0) {
     pgoMode = PGO_ASTBasedInstr;
@@ -106,10 +271,52 @@ void initializeInstrumentationOptionsFromCmdline(const llvm::Triple &triple) {
   } else if (!IRPGOInstrUseFile.empty()) {
     pgoMode = PGO_IRBasedUse;
     global.params.datafileInstrProf = fromPathString(IRPGOInstrUseFile).ptr;
+  } else if (!SamplePGOUseFile.empty()) {
+    pgoMode = PGO_SampleBasedUse;
+    global.params.datafileInstrProf = fromPathString(SamplePGOUseFile).ptr;
+    // The samples are attributed to source locations, so we need them even
+    // without -g.
+    global.params.outputSourceLocations = true;
+  }
+
+  if (CSPGOInstrGenFile.getNumOccurrences() > 0) {
+#if LDC_LLVM_VER < 900
+    error(Loc(), "-fcs-profile-generate requires LLVM 9+");
+#else
+    if (pgoMode != PGO_IRBasedUse) {
+      error(Loc(), "-fcs-profile-generate requires -fprofile-use");
+    }
+#endif
+    csPGOInstrGen = true;
+    if (CSPGOInstrGenFile.empty()) {
+      csPGOInstrGenFile = "default_%m.profraw";
+    } else {
+      csPGOInstrGenFile = fromPathString(CSPGOInstrGenFile).ptr;
+    }
+  }
+
+  if (profileFunctionLayout && !isUsingPGOProfile()) {
+    warning(Loc(), "-fprofile-function-layout has no effect without a PGO "
+                   "profile (-fprofile-instr-use, -fprofile-use or "
+                   "-fprofile-sample-use)");
   }
 
   if (dmdFunctionTrace)
     global.params.trace = true;
+
+  if (!fXRayAlwaysInstrument.empty() || !fXRayNeverInstrument.empty()) {
+    if (!fXRayInstrument) {
+      warning(Loc(), "-fxray-always-instrument/-fxray-never-instrument have "
+                     "no effect without -fxray-instrument");
+    }
+    loadXRayFilterFiles(fXRayAlwaysInstrument, xrayAlwaysPatterns);
+    loadXRayFilterFiles(fXRayNeverInstrument, xrayNeverPatterns);
+  }
+
+  if (functionTraceMode == FunctionTraceMode::traceBuffer &&
+      triple.isOSWindows()) {
+    error(Loc(), "-finstrument=trace-buffer is not supported on Windows");
+  }
 }
 
 } // namespace opts
@@ -25,10 +25,25 @@ namespace opts {
 namespace cl = llvm::cl;
 
 extern cl::opt<bool> instrumentFunctions;
+extern cl::opt<unsigned> instrumentFunctionsSample;
+
+enum class FunctionTraceMode { none, traceBuffer };
+extern cl::opt<FunctionTraceMode> functionTraceMode;
+extern cl::opt<unsigned> traceInstructionThreshold;
 
 extern cl::opt<bool> fXRayInstrument;
 llvm::StringRef getXRayInstructionThresholdString();
 
+enum class XRayFilterResult { none, always, never };
+/// Matches a function against the -fxray-always/never-instrument files, by
+/// its fully qualified D name and its source file. Never-instrument patterns
+/// take precedence.
+XRayFilterResult matchXRayFilterFiles(llvm::StringRef qualifiedName,
+                                      llvm::StringRef srcFile);
+
+extern cl::opt<bool> debugInfoForProfiling;
+extern cl::opt<bool> profileFunctionLayout;
+
 /// This initializes the instrumentation options, and checks the validity of the
 /// commandline flags. targetTriple should be initialized before calling this.
 /// It should be called only once.
@@ -40,13 +55,21 @@ enum PGOKind {
   PGO_ASTBasedUse,
   PGO_IRBasedInstr,
   PGO_IRBasedUse,
+  PGO_SampleBasedUse,
 };
 extern PGOKind pgoMode;
+/// Context-sensitive IR-based PGO instrumentation (-fcs-profile-generate),
+/// after inlining and on top of an IR-based PGO profile (-fprofile-use).
+extern bool csPGOInstrGen;
+/// The output file of the context-sensitive instrumentation.
+extern const char *csPGOInstrGenFile;
 inline bool isInstrumentingForPGO() {
-  return pgoMode == PGO_ASTBasedInstr || pgoMode == PGO_IRBasedInstr;
+  return pgoMode == PGO_ASTBasedInstr || pgoMode == PGO_IRBasedInstr ||
+         csPGOInstrGen;
 }
 inline bool isUsingPGOProfile() {
-  return pgoMode == PGO_ASTBasedUse || pgoMode == PGO_IRBasedUse;
+  return pgoMode == PGO_ASTBasedUse || pgoMode == PGO_IRBasedUse ||
+         pgoMode == PGO_SampleBasedUse;
 }
 inline bool isInstrumentingForASTBasedPGO() {
   return pgoMode == PGO_ASTBasedInstr;
@@ -56,5 +79,12 @@ inline bool isInstrumentingForIRBasedPGO() {
   return pgoMode == PGO_IRBasedInstr;
 }
 inline bool isUsingIRBasedPGOProfile() { return pgoMode == PGO_IRBasedUse; }
+inline bool isInstrumentingForCSPGO() { return csPGOInstrGen; }
+/// Returns true if the IR-based PGO profile contains context-sensitive data,
+/// i.e., has been merged with the -fcs-profile-generate results.
+bool isUsingCSPGOProfile();
+inline bool isUsingSampleBasedPGOProfile() {
+  return pgoMode == PGO_SampleBasedUse;
+}
 
 } // namespace opts
@@ -37,6 +37,11 @@ static llvm::cl::opt<std::string>
                               "LLVMgold.so (Unixes) or libLTO.dylib (Darwin))"),
                llvm::cl::value_desc("file"));
 
+static llvm::cl::opt<bool> reportDevirtualization(
+    "fwhole-program-vtables-report", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Have the LTO linker plugin report the virtual calls "
+                   "devirtualized via -fwhole-program-vtables"));
+
 static llvm::cl::opt<bool> linkNoCpp(
     "link-no-cpp", llvm::cl::ZeroOrMore, llvm::cl::Hidden,
     llvm::cl::desc("Disable automatic linking with the C++ standard library."));
@@ -74,7 +79,9 @@ private:
   void addLTOGoldPluginFlags(bool requirePlugin);
   void addDarwinLTOFlags();
   void addLTOLinkFlags();
+  void addSymbolOrderingFlags(llvm::StringRef outputPath);
   bool isLldDefaultLinker();
+  bool isUsingLld();
 
   virtual void addLdFlag(const llvm::Twine &flag) {
     args.push_back(("-Wl," + flag).str());
@@ -146,6 +153,31 @@ void ArgsBuilder::addLTOGoldPluginFlags(bool requirePlugin) {
     addLdFlag("-plugin-opt=-function-sections");
   if (TO.DataSections)
     addLdFlag("-plugin-opt=-data-sections");
+
+#if LDC_LLVM_VER >= 900
+  // Hot/cold splitting is skipped in the pre-link optimization for LTO.
+  if (opts::profileFunctionLayout && opts::isUsingPGOProfile())
+    addLdFlag("-plugin-opt=-hot-cold-split");
+
+  // Context-sensitive PGO happens after inlining, i.e., in the LTO backend.
+  if (opts::isInstrumentingForCSPGO()) {
+    addLdFlag("-plugin-opt=cs-profile-generate");
+    addLdFlag(llvm::Twine("-plugin-opt=cs-profile-path=") +
+              opts::csPGOInstrGenFile);
+  } else if (opts::isUsingCSPGOProfile()) {
+    addLdFlag(llvm::Twine("-plugin-opt=cs-profile-path=") +
+              global.params.datafileInstrProf);
+  }
+#endif
+
+  if (opts::wholeProgramVtables) {
+#if LDC_LLVM_VER >= 1100
+    // D classes have public LTO visibility; assert that all vtables are known.
+    addLdFlag("-plugin-opt=-whole-program-visibility");
+#endif
+    if (reportDevirtualization)
+      addLdFlag("-plugin-opt=-pass-remarks=wholeprogramdevirt");
+  }
 }
 
 // Returns an empty string when libLTO.dylib was not specified nor found.
@@ -171,6 +203,14 @@ void ArgsBuilder::addDarwinLTOFlags() {
   if (!dylibPath.empty()) {
     addLdFlag("-lto_library", dylibPath);
   }
+
+  if (opts::wholeProgramVtables) {
+#if LDC_LLVM_VER >= 1100
+    addLdFlag("-mllvm", "-whole-program-visibility");
+#endif
+    if (reportDevirtualization)
+      addLdFlag("-mllvm", "-pass-remarks=wholeprogramdevirt");
+  }
 }
 
 /// Adds the required linker flags for LTO builds to args.
@@ -182,14 +222,52 @@ void ArgsBuilder::addLTOLinkFlags() {
       global.params.targetTriple->isOSDragonFly()) {
     // LLD supports LLVM LTO natively, do not add the plugin itself.
     // Otherwise, assume that ld.gold or ld.bfd is used with plugin support.
-    bool isLld = opts::linker == "lld" || useInternalLLDForLinking() ||
-                 (opts::linker.empty() && isLldDefaultLinker());
-    addLTOGoldPluginFlags(!isLld);
+    addLTOGoldPluginFlags(!isUsingLld());
   } else if (global.params.targetTriple->isOSDarwin()) {
     addDarwinLTOFlags();
   }
 }
 
+bool ArgsBuilder::isUsingLld() {
+  return opts::linker == "lld" || useInternalLLDForLinking() ||
+         (opts::linker.empty() && isLldDefaultLinker());
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Makes the linker place the functions the PGO profile shows to be hot
+// together, hottest first.
+void ArgsBuilder::addSymbolOrderingFlags(llvm::StringRef outputPath) {
+  const auto &triple = *global.params.targetTriple;
+  if (triple.isOSDarwin()) {
+    const auto path = writeSymbolOrderingFile(outputPath, false);
+    if (!path.empty())
+      addLdFlag("-order_file", path);
+    return;
+  }
+
+  const bool isLld = isUsingLld();
+  if (!isLld && opts::linker != "gold") {
+    warning(Loc(), "-fprofile-function-layout: hot functions are only placed "
+                   "together when linking with lld or gold");
+    return;
+  }
+
+  const auto path = writeSymbolOrderingFile(outputPath, !isLld);
+  if (path.empty())
+    return;
+  if (isLld) {
+    addLdFlag("--symbol-ordering-file", path);
+    // The file lists the hot functions of all compiled modules, some of which
+    // may have been inlined or stripped.
+    addLdFlag("--no-warn-symbol-ordering");
+  } else {
+    addLdFlag("--section-ordering-file", path);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
 bool ArgsBuilder::isLldDefaultLinker() {
   auto triple = global.params.targetTriple;
   if (triple->isOSFreeBSD()) {
@@ -515,6 +593,9 @@ void ArgsBuilder::build(llvm::StringRef outputPath,
   if (opts::isUsingLTO())
     addLTOLinkFlags();
 
+  if (opts::profileFunctionLayout)
+    addSymbolOrderingFlags(outputPath);
+
   addLinker();
   addUserSwitches();
 
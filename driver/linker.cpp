@@ -15,10 +15,16 @@
 #include "driver/tool.h"
 #include "gen/llvm.h"
 #include "gen/logger.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/IR/Mangler.h"
 #include "llvm/IRReader/IRReader.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/Linker/Linker.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
 #include <sstream>
 
 namespace cl = llvm::cl;
@@ -278,6 +284,129 @@ void insertBitcodeFiles(llvm::Module &M, llvm::LLVMContext &Ctx,
 
 //////////////////////////////////////////////////////////////////////////////
 
+// hot functions (entry count, symbol name) of all modules compiled by this
+// invocation
+static std::vector<std::pair<uint64_t, std::string>> gHotFunctions;
+// object files compiled by this invocation
+static llvm::StringSet<> gCompiledObjects;
+
+// The hot functions of an object file compiled without linking (-c) are
+// written to this file next to it, for a separate link step.
+static std::string getHotFunctionsPath(llvm::StringRef objectPath) {
+  return (objectPath + ".hot-functions").str();
+}
+
+void recordHotFunctions(llvm::Module &M, llvm::StringRef objectPath) {
+  gCompiledObjects.insert(objectPath);
+
+  std::vector<std::pair<uint64_t, std::string>> hotFunctions;
+  if (M.getProfileSummary(
+#if LDC_LLVM_VER >= 900
+          /*is context sensitive profile=*/false
+#endif
+          )) {
+    llvm::ProfileSummaryInfo PSI(M);
+    llvm::Mangler mangler;
+    for (auto &F : M) {
+      if (F.isDeclaration() || !PSI.isFunctionEntryHot(&F))
+        continue;
+      const auto entryCount = F.getEntryCount();
+#if LDC_LLVM_VER >= 1100
+      const uint64_t count = entryCount->getCount();
+#elif LDC_LLVM_VER >= 700
+      const uint64_t count = entryCount.getCount();
+#else
+      const uint64_t count = *entryCount;
+#endif
+      llvm::SmallString<128> name;
+      mangler.getNameWithPrefix(name, &F, /*CannotUsePrivateLabel=*/false);
+      hotFunctions.emplace_back(count, std::string(name.str()));
+    }
+  }
+
+  if (!global.params.link && !global.params.lib) {
+    const auto path = getHotFunctionsPath(objectPath);
+    if (hotFunctions.empty()) {
+      // don't leave a stale file of a previous compilation behind
+      llvm::sys::fs::remove(path);
+    } else {
+      std::error_code errinfo;
+      llvm::raw_fd_ostream os(path, errinfo, llvm::sys::fs::F_None);
+      if (errinfo) {
+        error(Loc(), "cannot write hot functions file '%s': %s", path.c_str(),
+              errinfo.message().c_str());
+        fatal();
+      }
+      for (const auto &f : hotFunctions)
+        os << f.first << ' ' << f.second << '\n';
+    }
+  }
+
+  gHotFunctions.insert(gHotFunctions.end(), hotFunctions.begin(),
+                       hotFunctions.end());
+}
+
+// Adds the hot functions of the object files compiled by separate invocations.
+static void loadHotFunctions() {
+  for (const char *objfile : global.params.objfiles) {
+    if (gCompiledObjects.count(objfile))
+      continue;
+    auto buffer = llvm::MemoryBuffer::getFile(getHotFunctionsPath(objfile));
+    if (!buffer)
+      continue;
+    llvm::SmallVector<llvm::StringRef, 64> lines;
+    (*buffer)->getBuffer().split(lines, '\n', -1, /*KeepEmpty=*/false);
+    for (auto line : lines) {
+      const auto countAndName = line.split(' ');
+      uint64_t count;
+      if (countAndName.first.getAsInteger(10, count) ||
+          countAndName.second.empty())
+        continue;
+      gHotFunctions.emplace_back(count, countAndName.second.str());
+    }
+  }
+}
+
+std::string writeSymbolOrderingFile(llvm::StringRef outputPath,
+                                    bool sectionNames) {
+  loadHotFunctions();
+  if (gHotFunctions.empty())
+    return {};
+
+  // hottest first, ties broken by name for reproducible output
+  std::sort(gHotFunctions.begin(), gHotFunctions.end(),
+            [](const std::pair<uint64_t, std::string> &a,
+               const std::pair<uint64_t, std::string> &b) {
+              return a.first != b.first ? a.first > b.first
+                                        : a.second < b.second;
+            });
+
+  std::string path = (outputPath + ".symbol-order").str();
+  std::error_code errinfo;
+  llvm::raw_fd_ostream os(path, errinfo, llvm::sys::fs::F_None);
+  if (errinfo) {
+    error(Loc(), "cannot write symbol ordering file '%s': %s", path.c_str(),
+          errinfo.message().c_str());
+    fatal();
+  }
+  // linkonce functions may be hot in several modules, keep the hottest entry
+  llvm::StringSet<> written;
+  for (const auto &f : gHotFunctions) {
+    if (!written.insert(f.second).second)
+      continue;
+    if (sectionNames) {
+      // With profile data, LLVM places hot functions in `.text.hot.` sections.
+      os << ".text.hot." << f.second << '\n';
+      os << ".text." << f.second << '\n';
+    } else {
+      os << f.second << '\n';
+    }
+  }
+  return path;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
 // path to the produced executable/shared library
 static std::string gExePath;
 
@@ -60,6 +60,24 @@ llvm::StringRef getMscrtLibName(const bool *useInternalToolchain = nullptr);
 void insertBitcodeFiles(llvm::Module &M, llvm::LLVMContext &Ctx,
                         Array<const char *> &bitcodeFiles);
 
+/**
+ * Records the functions of an optimized module that the PGO profile shows to
+ * be hot, for placing them together when linking (-fprofile-function-layout).
+ * Without linking (-c), they are also written to a file next to the object
+ * file, which is read when linking the object file.
+ */
+void recordHotFunctions(llvm::Module &M, llvm::StringRef objectPath);
+
+/**
+ * Writes the recorded hot functions and those of the separately compiled
+ * object files being linked, hottest first, to a symbol ordering file for the
+ * linker. If `sectionNames` is true, the function sections are listed instead
+ * of the symbols (gold). Returns the path of the written file, or an
+ * empty string if there are no hot functions.
+ */
+std::string writeSymbolOrderingFile(llvm::StringRef outputPath,
+                                    bool sectionNames);
+
 /**
  * Link an executable only from object files.
  * @return 0 on success.
@@ -525,6 +525,10 @@ void parseCommandLine(Strings &sourceFiles) {
     error(Loc(), "-soname can be used only when building a shared library");
   }
 
+  if (opts::wholeProgramVtables && !opts::isUsingLTO()) {
+    error(Loc(), "-fwhole-program-vtables requires -flto");
+  }
+
   global.params.hdrStripPlainFunctions = !opts::hdrKeepAllBodies;
   global.params.disableRedZone = opts::disableRedZone();
 }
@@ -12,6 +12,8 @@
 #include "dmd/errors.h"
 #include "driver/cl_options.h"
 #include "driver/cache.h"
+#include "driver/cl_options_instrumentation.h"
+#include "driver/linker.h"
 #include "driver/targetmachine.h"
 #include "driver/timetrace.h"
 #include "driver/tool.h"
@@ -350,6 +352,9 @@ void writeModule(llvm::Module *m, const char *filename) {
     }
   }
 
+  if (opts::profileFunctionLayout)
+    recordHotFunctions(*m, filename);
+
   // write LLVM bitcode
   const bool emitBitcodeAsObjectFile =
       doLTO && outputObj && !global.params.output_bc;
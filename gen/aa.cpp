@@ -23,6 +23,13 @@
 #include "gen/tollvm.h"
 #include "ir/irfunction.h"
 #include "ir/irmodule.h"
+#include "llvm/Support/CommandLine.h"
+
+static llvm::cl::opt<bool> aaFastPath(
+    "faa-fastpath", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Inline the hashing and bucket probing of associative array "
+                   "lookups with integral or string keys, calling druntime "
+                   "only if the key isn't found (experimental)"));
 
 // returns the keytype typeinfo
 static LLConstant *to_keyti(const Loc &loc, DValue *aa, LLType *targetType) {
@@ -35,6 +42,368 @@ static LLConstant *to_keyti(const Loc &loc, DValue *aa, LLType *targetType) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+namespace {
+// The inline lookups depend on the layout of druntime's `rt.aaA.Impl`:
+//
+// struct Impl {
+//   Bucket[] buckets; // struct Bucket { size_t hash; void* entry; }
+//   uint used;
+//   uint deleted;
+//   TypeInfo_Struct entryTI;
+//   uint firstUsed;
+//   immutable uint keysz;
+//   immutable uint valsz;
+//   immutable uint valoff;
+//   Flags flags;
+// }
+//
+// Each entry starts with the key, followed by the value at offset `valoff`.
+enum AAImplField {
+  AAImpl_dim = 0,
+  AAImpl_buckets = 1,
+  AAImpl_used = 2,
+  AAImpl_deleted = 3,
+  AAImpl_valoff = 8,
+};
+
+// Bucket hashes with special meaning.
+enum : uint64_t { HASH_EMPTY = 0, HASH_DELETED = 1 };
+
+LLStructType *getAABucketType() {
+  return LLStructType::get(gIR->context(), {DtoSize_t(), getVoidPtrType()});
+}
+
+LLStructType *getAAImplType() {
+  LLType *i32 = LLType::getInt32Ty(gIR->context());
+  LLType *elems[] = {DtoSize_t(),
+                     getPtrToType(getAABucketType()),
+                     i32,
+                     i32,
+                     getVoidPtrType(),
+                     i32,
+                     i32,
+                     i32,
+                     i32,
+                     LLType::getInt8Ty(gIR->context())};
+  return LLStructType::get(gIR->context(), elems);
+}
+
+enum class AAKeyKind { None, Integral, String };
+
+AAKeyKind getInlineAAKeyKind(Type *keyType) {
+  if (!aaFastPath)
+    return AAKeyKind::None;
+
+  Type *t = keyType->toBasetype();
+  switch (t->ty) {
+  case Tint8:
+  case Tuns8:
+  case Tint16:
+  case Tuns16:
+  case Tint32:
+  case Tuns32:
+  case Tchar:
+  case Twchar:
+  case Tdchar:
+  case Tbool:
+    return AAKeyKind::Integral;
+  case Tarray:
+    // The inline MurmurHash3 reads 32-bit little-endian blocks.
+    if (t->nextOf()->toBasetype()->ty == Tchar &&
+        gDataLayout->isLittleEndian()) {
+      return AAKeyKind::String;
+    }
+    return AAKeyKind::None;
+  default:
+    return AAKeyKind::None;
+  }
+}
+
+LLValue *rotl32(IRBuilder<> &b, LLValue *v, unsigned n) {
+  return b.CreateOr(b.CreateShl(v, n), b.CreateLShr(v, 32 - n));
+}
+
+// Returns a module-local copy of druntime's `core.internal.hash.bytesHash`
+// (32-bit MurmurHash3 with seed 0), i.e., `TypeInfo_Aa.getHash()`:
+// uint ldc.aa.bytesHash(const(ubyte)* data, size_t len)
+LLFunction *getAABytesHashFunction() {
+  const char *name = "ldc.aa.bytesHash";
+  if (auto existing = gIR->module.getFunction(name))
+    return existing;
+
+  llvm::LLVMContext &ctx = gIR->context();
+  LLType *i8 = LLType::getInt8Ty(ctx);
+  LLType *i32 = LLType::getInt32Ty(ctx);
+  LLType *sizeTy = DtoSize_t();
+  auto fnType = LLFunctionType::get(i32, {getVoidPtrType(), sizeTy}, false);
+  auto fn = LLFunction::Create(fnType, LLGlobalValue::LinkOnceODRLinkage, name,
+                               &gIR->module);
+  setLinkage({LLGlobalValue::LinkOnceODRLinkage, needsCOMDAT()}, fn);
+  fn->setVisibility(LLGlobalValue::HiddenVisibility);
+  fn->addFnAttr(LLAttribute::NoUnwind);
+  fn->addFnAttr(LLAttribute::ReadOnly);
+
+  auto args = fn->arg_begin();
+  LLValue *data = &*args++;
+  LLValue *len = &*args;
+
+  auto c1 = LLConstantInt::get(i32, 0xcc9e2d51);
+  auto c2 = LLConstantInt::get(i32, 0x1b873593);
+  auto c3 = LLConstantInt::get(i32, 0xe6546b64);
+  const auto mixBlock = [&](IRBuilder<> &b, LLValue *k) {
+    k = b.CreateMul(k, c1);
+    k = rotl32(b, k, 15);
+    return b.CreateMul(k, c2);
+  };
+
+  auto entrybb = llvm::BasicBlock::Create(ctx, "entry", fn);
+  auto loopbb = llvm::BasicBlock::Create(ctx, "blocks", fn);
+  auto bodybb = llvm::BasicBlock::Create(ctx, "blocks.body", fn);
+  auto tailbb = llvm::BasicBlock::Create(ctx, "tail", fn);
+  auto tail3bb = llvm::BasicBlock::Create(ctx, "tail.3", fn);
+  auto tail2bb = llvm::BasicBlock::Create(ctx, "tail.2", fn);
+  auto tail1bb = llvm::BasicBlock::Create(ctx, "tail.1", fn);
+  auto finalbb = llvm::BasicBlock::Create(ctx, "final", fn);
+  IRBuilder<> b(entrybb);
+
+  LLValue *nblocks = b.CreateLShr(len, 2, "nblocks");
+  b.CreateBr(loopbb);
+
+  // body: mix all 4-byte blocks
+  b.SetInsertPoint(loopbb);
+  auto i = b.CreatePHI(sizeTy, 2, "i");
+  auto h = b.CreatePHI(i32, 2, "h");
+  i->addIncoming(llvm::ConstantInt::get(sizeTy, 0), entrybb);
+  h->addIncoming(llvm::ConstantInt::get(i32, 0), entrybb);
+  b.CreateCondBr(b.CreateICmpULT(i, nblocks), bodybb, tailbb);
+
+  b.SetInsertPoint(bodybb);
+  LLValue *blockPtr = b.CreateBitCast(
+      b.CreateGEP(i8, data, b.CreateShl(i, 2)), getPtrToType(i32));
+  LLValue *k = b.CreateAlignedLoad(i32, blockPtr, LLMaybeAlign(1));
+  LLValue *nextH = b.CreateXor(h, mixBlock(b, k));
+  nextH = rotl32(b, nextH, 13);
+  nextH = b.CreateAdd(b.CreateMul(nextH, LLConstantInt::get(i32, 5)), c3);
+  i->addIncoming(b.CreateAdd(i, llvm::ConstantInt::get(sizeTy, 1)), bodybb);
+  h->addIncoming(nextH, bodybb);
+  b.CreateBr(loopbb);
+
+  // tail: the remaining 1-3 bytes
+  b.SetInsertPoint(tailbb);
+  LLValue *tail = b.CreateGEP(i8, data, b.CreateShl(nblocks, 2));
+  LLValue *rem = b.CreateTrunc(b.CreateAnd(len, 3), i32);
+  auto sw = b.CreateSwitch(rem, finalbb, 3);
+  sw->addCase(LLConstantInt::get(ctx, llvm::APInt(32, 3)), tail3bb);
+  sw->addCase(LLConstantInt::get(ctx, llvm::APInt(32, 2)), tail2bb);
+  sw->addCase(LLConstantInt::get(ctx, llvm::APInt(32, 1)), tail1bb);
+  const auto loadTailByte = [&](unsigned index) {
+    LLValue *byte = b.CreateLoad(i8, b.CreateConstGEP1_32(i8, tail, index));
+    return b.CreateShl(b.CreateZExt(byte, i32), 8 * index);
+  };
+
+  b.SetInsertPoint(tail3bb);
+  LLValue *k3 = loadTailByte(2);
+  b.CreateBr(tail2bb);
+
+  b.SetInsertPoint(tail2bb);
+  auto k2 = b.CreatePHI(i32, 2);
+  k2->addIncoming(LLConstantInt::get(i32, 0), tailbb);
+  k2->addIncoming(k3, tail3bb);
+  LLValue *k2Next = b.CreateXor(k2, loadTailByte(1));
+  b.CreateBr(tail1bb);
+
+  b.SetInsertPoint(tail1bb);
+  auto k1 = b.CreatePHI(i32, 2);
+  k1->addIncoming(LLConstantInt::get(i32, 0), tailbb);
+  k1->addIncoming(k2Next, tail2bb);
+  LLValue *hTail =
+      b.CreateXor(h, mixBlock(b, b.CreateXor(k1, loadTailByte(0))));
+  b.CreateBr(finalbb);
+
+  // finalization
+  b.SetInsertPoint(finalbb);
+  auto hFinal = b.CreatePHI(i32, 2);
+  hFinal->addIncoming(h, tailbb);
+  hFinal->addIncoming(hTail, tail1bb);
+  LLValue *r = b.CreateXor(hFinal, b.CreateTrunc(len, i32));
+  r = b.CreateXor(r, b.CreateLShr(r, 16));
+  r = b.CreateMul(r, LLConstantInt::get(i32, 0x85ebca6b));
+  r = b.CreateXor(r, b.CreateLShr(r, 13));
+  r = b.CreateMul(r, LLConstantInt::get(i32, 0xc2b2ae35));
+  r = b.CreateXor(r, b.CreateLShr(r, 16));
+  b.CreateRet(r);
+
+  return fn;
+}
+
+// Computes the bucket hash of the key, i.e., druntime's
+// `mix(keyti.getHash(pkey)) | HASH_FILLED_MARK`.
+LLValue *emitAAKeyHash(AAKeyKind kind, Type *keyType, LLValue *pkey) {
+  LLIntegerType *sizeTy = DtoSize_t();
+
+  LLValue *hash;
+  if (kind == AAKeyKind::Integral) {
+    LLValue *key = DtoLoad(DtoBitCast(pkey, DtoPtrToType(keyType)));
+    hash = keyType->isunsigned() || keyType->toBasetype()->ty == Tbool
+               ? gIR->ir->CreateZExt(key, sizeTy)
+               : gIR->ir->CreateSExt(key, sizeTy);
+  } else {
+    LLValue *slice = DtoLoad(pkey);
+    LLValue *len = DtoExtractValue(slice, 0, ".key.length");
+    LLValue *ptr =
+        DtoBitCast(DtoExtractValue(slice, 1, ".key.ptr"), getVoidPtrType());
+    hash = gIR->ir->CreateZExt(
+        gIR->ir->CreateCall(getAABytesHashFunction(), {ptr, len}), sizeTy);
+  }
+
+  // final mix function of MurmurHash2
+  hash = gIR->ir->CreateXor(hash, gIR->ir->CreateLShr(hash, 13));
+  hash = gIR->ir->CreateMul(hash, LLConstantInt::get(sizeTy, 0x5bd1e995));
+  hash = gIR->ir->CreateXor(hash, gIR->ir->CreateLShr(hash, 15));
+  const unsigned bits = sizeTy->getBitWidth();
+  return gIR->ir->CreateOr(
+      hash, LLConstantInt::get(sizeTy, uint64_t(1) << (bits - 1)), ".aa.hash");
+}
+
+// Compares the key with the key stored at the start of a bucket entry.
+LLValue *emitAAKeyEquals(AAKeyKind kind, Type *keyType, LLValue *pkey,
+                         LLValue *entry) {
+  LLType *keyPtrType = pkey->getType();
+  LLValue *entryKey = DtoBitCast(entry, keyPtrType);
+
+  if (kind == AAKeyKind::Integral) {
+    return gIR->ir->CreateICmpEQ(DtoLoad(pkey), DtoLoad(entryKey));
+  }
+
+  LLValue *l = DtoLoad(pkey);
+  LLValue *r = DtoLoad(entryKey);
+  LLValue *length = DtoExtractValue(l, 0);
+  LLValue *lengthsEqual = gIR->ir->CreateICmpEQ(length, DtoExtractValue(r, 0),
+                                                ".aa.key.lengthsEqual");
+
+  llvm::BasicBlock *cmpbb = gIR->scopebb();
+  llvm::BasicBlock *memcmpbb = gIR->insertBB("aa.key.memcmp");
+  llvm::BasicBlock *endbb = gIR->insertBBAfter(memcmpbb, "aa.key.end");
+  gIR->ir->CreateCondBr(lengthsEqual, memcmpbb, endbb);
+
+  gIR->ir->SetInsertPoint(memcmpbb);
+  LLFunction *memcmpFn = getRuntimeFunction(Loc(), gIR->module, "memcmp");
+  LLValue *memcmpResult = gIR->ir->CreateCall(
+      memcmpFn, {DtoBitCast(DtoExtractValue(l, 1), getVoidPtrType()),
+                 DtoBitCast(DtoExtractValue(r, 1), getVoidPtrType()), length});
+  LLValue *contentsEqual = gIR->ir->CreateICmpEQ(memcmpResult, DtoConstInt(0));
+  gIR->ir->CreateBr(endbb);
+
+  gIR->ir->SetInsertPoint(endbb);
+  auto equal = gIR->ir->CreatePHI(lengthsEqual->getType(), 2, ".aa.key.equal");
+  equal->addIncoming(lengthsEqual, cmpbb);
+  equal->addIncoming(contentsEqual, memcmpbb);
+  return equal;
+}
+
+struct AAProbe {
+  // Reached if the key was found; `bucket` and `entry` are valid there.
+  llvm::BasicBlock *foundbb;
+  // Reached if an empty bucket was found before the key.
+  llvm::BasicBlock *missbb;
+  LLValue *bucket;
+  LLValue *entry;
+};
+
+// Emits druntime's `Impl.findSlotLookup()` for the non-null AA `impl`. Leaves
+// the IRBuilder without insertion point.
+AAProbe emitAAProbe(AAKeyKind kind, Type *keyType, LLValue *impl,
+                    LLValue *pkey) {
+
+  LLValue *hash = emitAAKeyHash(kind, keyType, pkey);
+  LLValue *dim = DtoLoad(DtoGEP(impl, 0u, AAImpl_dim), ".aa.dim");
+  LLValue *buckets = DtoLoad(DtoGEP(impl, 0u, AAImpl_buckets), ".aa.buckets");
+  LLValue *mask = gIR->ir->CreateSub(dim, DtoConstSize_t(1), ".aa.mask");
+
+  llvm::BasicBlock *entrybb = gIR->scopebb();
+  llvm::BasicBlock *loopbb = gIR->insertBB("aa.probe");
+  llvm::BasicBlock *cmpbb = gIR->insertBBAfter(loopbb, "aa.probe.cmpkey");
+  llvm::BasicBlock *emptybb = gIR->insertBBAfter(cmpbb, "aa.probe.empty");
+  llvm::BasicBlock *nextbb = gIR->insertBBAfter(emptybb, "aa.probe.next");
+  llvm::BasicBlock *foundbb = gIR->insertBBAfter(nextbb, "aa.probe.found");
+  llvm::BasicBlock *missbb = gIR->insertBBAfter(foundbb, "aa.probe.miss");
+  gIR->ir->CreateBr(loopbb);
+
+  // quadratic probing: i = (i + j) & mask, ++j
+  gIR->ir->SetInsertPoint(loopbb);
+  auto i = gIR->ir->CreatePHI(DtoSize_t(), 2, ".aa.i");
+  auto j = gIR->ir->CreatePHI(DtoSize_t(), 2, ".aa.j");
+  i->addIncoming(gIR->ir->CreateAnd(hash, mask), entrybb);
+  j->addIncoming(DtoConstSize_t(1), entrybb);
+  LLValue *bucket = DtoGEP1(buckets, i, ".aa.bucket");
+  LLValue *bucketHash = DtoLoad(DtoGEP(bucket, 0u, 0));
+  gIR->ir->CreateCondBr(gIR->ir->CreateICmpEQ(bucketHash, hash), cmpbb,
+                        emptybb);
+
+  gIR->ir->SetInsertPoint(cmpbb);
+  LLValue *entry = DtoLoad(DtoGEP(bucket, 0u, 1), ".aa.entry");
+  gIR->ir->CreateCondBr(emitAAKeyEquals(kind, keyType, pkey, entry), foundbb,
+                        nextbb);
+
+  gIR->ir->SetInsertPoint(emptybb);
+  gIR->ir->CreateCondBr(
+      gIR->ir->CreateICmpEQ(bucketHash, DtoConstSize_t(HASH_EMPTY)), missbb,
+      nextbb);
+
+  gIR->ir->SetInsertPoint(nextbb);
+  i->addIncoming(gIR->ir->CreateAnd(gIR->ir->CreateAdd(i, j), mask), nextbb);
+  j->addIncoming(gIR->ir->CreateAdd(j, DtoConstSize_t(1)), nextbb);
+  gIR->ir->CreateBr(loopbb);
+
+  gIR->ir->ClearInsertionPoint();
+  return {foundbb, missbb, bucket, entry};
+}
+
+// Emits an inline lookup of the key, returning a pointer to the value or
+// the result of `emitFallback()` if the key wasn't found by the inline probe
+// (or if the AA is null and `nullIsMiss` is false).
+LLValue *DtoAAInlineLookup(AAKeyKind kind, Type *keyType, LLValue *aaval,
+                           LLValue *pkey, bool nullIsMiss,
+                           llvm::function_ref<LLValue *()> emitFallback) {
+  LLType *voidPtrTy = getVoidPtrType();
+
+  LLValue *impl = DtoBitCast(aaval, getPtrToType(getAAImplType()), ".aa.impl");
+  llvm::BasicBlock *nullbb = gIR->scopebb();
+  llvm::BasicBlock *probebb = gIR->insertBB("aa.lookup");
+  llvm::BasicBlock *fallbackbb = gIR->insertBBAfter(probebb, "aa.fallback");
+  llvm::BasicBlock *endbb = gIR->insertBBAfter(fallbackbb, "aa.lookup.end");
+  gIR->ir->CreateCondBr(gIR->ir->CreateIsNull(impl),
+                        nullIsMiss ? endbb : fallbackbb, probebb);
+
+  gIR->ir->SetInsertPoint(probebb);
+  AAProbe probe = emitAAProbe(kind, keyType, impl, pkey);
+
+  gIR->ir->SetInsertPoint(probe.foundbb);
+  LLValue *valoff = gIR->ir->CreateZExt(
+      DtoLoad(DtoGEP(impl, 0u, AAImpl_valoff), ".aa.valoff"), DtoSize_t());
+  LLValue *value = DtoGEP1(probe.entry, valoff, ".aa.value");
+  gIR->ir->CreateBr(endbb);
+
+  gIR->ir->SetInsertPoint(probe.missbb);
+  gIR->ir->CreateBr(fallbackbb);
+
+  gIR->ir->SetInsertPoint(fallbackbb);
+  LLValue *fallbackValue = DtoBitCast(emitFallback(), voidPtrTy);
+  llvm::BasicBlock *fallbackEndbb = gIR->scopebb();
+  gIR->ir->CreateBr(endbb);
+
+  gIR->ir->SetInsertPoint(endbb);
+  auto result = gIR->ir->CreatePHI(voidPtrTy, 3, ".aa.result");
+  if (nullIsMiss)
+    result->addIncoming(getNullPtr(voidPtrTy), nullbb);
+  result->addIncoming(value, probe.foundbb);
+  result->addIncoming(fallbackValue, fallbackEndbb);
+  return result;
+}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 DLValue *DtoAAIndex(const Loc &loc, Type *type, DValue *aa, DValue *key,
                     bool lvalue) {
   // D2:
@@ -54,21 +423,34 @@ DLValue *DtoAAIndex(const Loc &loc, Type *type, DValue *aa, DValue *key,
   aaval = DtoBitCast(aaval, funcTy->getParamType(0));
 
   // pkey param
-  LLValue *pkey = makeLValue(loc, key);
-  pkey = DtoBitCast(pkey, funcTy->getParamType(lvalue ? 3 : 2));
+  LLValue *keyPtr = makeLValue(loc, key);
+  LLValue *pkey = DtoBitCast(keyPtr, funcTy->getParamType(lvalue ? 3 : 2));
 
   // call runtime
+  const auto callRuntime = [&]() -> LLValue * {
+    if (lvalue) {
+      LLValue *rawAATI = DtoTypeInfoOf(
+          loc, aa->type->unSharedOf()->mutableOf(), /*base=*/false);
+      LLValue *castedAATI = DtoBitCast(rawAATI, funcTy->getParamType(1));
+      LLValue *valsize = DtoConstSize_t(getTypeAllocSize(DtoType(type)));
+      return gIR->CreateCallOrInvoke(func, aaval, castedAATI, valsize, pkey,
+                                     "aa.index");
+    }
+    LLValue *keyti = to_keyti(loc, aa, funcTy->getParamType(1));
+    return gIR->CreateCallOrInvoke(func, aaval, keyti, pkey, "aa.index");
+  };
+
+  Type *keyType = static_cast<TypeAArray *>(aa->type->toBasetype())->index;
+  const auto keyKind = getInlineAAKeyKind(keyType);
   LLValue *ret;
-  if (lvalue) {
-    LLValue *rawAATI =
-        DtoTypeInfoOf(loc, aa->type->unSharedOf()->mutableOf(), /*base=*/false);
-    LLValue *castedAATI = DtoBitCast(rawAATI, funcTy->getParamType(1));
-    LLValue *valsize = DtoConstSize_t(getTypeAllocSize(DtoType(type)));
-    ret = gIR->CreateCallOrInvoke(func, aaval, castedAATI, valsize, pkey,
-                                  "aa.index");
+  if (keyKind == AAKeyKind::None) {
+    ret = callRuntime();
   } else {
-    LLValue *keyti = to_keyti(loc, aa, funcTy->getParamType(1));
-    ret = gIR->CreateCallOrInvoke(func, aaval, keyti, pkey, "aa.index");
+    // _aaGetY() inserts the key into a null AA
+    ret = DtoAAInlineLookup(keyKind, keyType,
+                            lvalue ? DtoLoad(aaval) : aaval, keyPtr,
+                            /*nullIsMiss=*/!lvalue,
+                            callRuntime);
   }
 
   // cast return value
@@ -128,11 +510,20 @@ DValue *DtoAAIn(const Loc &loc, Type *type, DValue *aa, DValue *key) {
   LLValue *keyti = to_keyti(loc, aa, funcTy->getParamType(1));
 
   // pkey param
-  LLValue *pkey = makeLValue(loc, key);
-  pkey = DtoBitCast(pkey, getVoidPtrType());
+  LLValue *keyPtr = makeLValue(loc, key);
+  LLValue *pkey = DtoBitCast(keyPtr, getVoidPtrType());
 
   // call runtime
-  LLValue *ret = gIR->CreateCallOrInvoke(func, aaval, keyti, pkey, "aa.in");
+  const auto callRuntime = [&]() -> LLValue * {
+    return gIR->CreateCallOrInvoke(func, aaval, keyti, pkey, "aa.in");
+  };
+
+  Type *keyType = static_cast<TypeAArray *>(aa->type->toBasetype())->index;
+  const auto keyKind = getInlineAAKeyKind(keyType);
+  LLValue *ret = keyKind == AAKeyKind::None
+                     ? callRuntime()
+                     : DtoAAInlineLookup(keyKind, keyType, aaval, keyPtr,
+                                         /*nullIsMiss=*/true, callRuntime);
 
   // cast return value
   LLType *targettype = DtoType(type);
@@ -172,13 +563,65 @@ DValue *DtoAARemove(const Loc &loc, DValue *aa, DValue *key) {
   LLValue *keyti = to_keyti(loc, aa, funcTy->getParamType(1));
 
   // pkey param
-  LLValue *pkey = makeLValue(loc, key);
-  pkey = DtoBitCast(pkey, funcTy->getParamType(2));
+  LLValue *keyPtr = makeLValue(loc, key);
+  LLValue *pkey = DtoBitCast(keyPtr, funcTy->getParamType(2));
+
+  Type *keyType = static_cast<TypeAArray *>(aa->type->toBasetype())->index;
+  const auto keyKind = getInlineAAKeyKind(keyType);
+  if (keyKind == AAKeyKind::None) {
+    // call runtime
+    LLValue *res = gIR->CreateCallOrInvoke(func, aaval, keyti, pkey);
+    return new DImValue(Type::tbool, res);
+  }
+
+  LLValue *impl = DtoBitCast(aaval, getPtrToType(getAAImplType()), ".aa.impl");
+  llvm::BasicBlock *nullbb = gIR->scopebb();
+  llvm::BasicBlock *probebb = gIR->insertBB("aa.remove");
+  llvm::BasicBlock *clearbb = gIR->insertBBAfter(probebb, "aa.remove.clear");
+  llvm::BasicBlock *fallbackbb = gIR->insertBBAfter(clearbb, "aa.fallback");
+  llvm::BasicBlock *endbb = gIR->insertBBAfter(fallbackbb, "aa.remove.end");
+  gIR->ir->CreateCondBr(gIR->ir->CreateIsNull(impl), endbb, probebb);
+
+  gIR->ir->SetInsertPoint(probebb);
+  AAProbe probe = emitAAProbe(keyKind, keyType, impl, pkey);
+
+  // Let druntime remove the entry if the AA is to be shrunk afterwards, i.e.,
+  // if `(length - 1) * SHRINK_DEN < dim * SHRINK_NUM` (1/8).
+  gIR->ir->SetInsertPoint(probe.foundbb);
+  LLValue *usedPtr = DtoGEP(impl, 0u, AAImpl_used);
+  LLValue *deletedPtr = DtoGEP(impl, 0u, AAImpl_deleted);
+  LLValue *deleted = DtoLoad(deletedPtr);
+  LLValue *newLength = gIR->ir->CreateSub(
+      gIR->ir->CreateSub(DtoLoad(usedPtr), deleted), DtoConstUint(1));
+  LLValue *dim = DtoLoad(DtoGEP(impl, 0u, AAImpl_dim));
+  LLValue *shrink = gIR->ir->CreateICmpULT(
+      gIR->ir->CreateMul(gIR->ir->CreateZExt(newLength, DtoSize_t()),
+                         DtoConstSize_t(8)),
+      dim);
+  gIR->ir->CreateCondBr(shrink, fallbackbb, clearbb);
+
+  gIR->ir->SetInsertPoint(clearbb);
+  DtoStore(DtoConstSize_t(HASH_DELETED), DtoGEP(probe.bucket, 0u, 0));
+  DtoStore(getNullPtr(getVoidPtrType()), DtoGEP(probe.bucket, 0u, 1));
+  DtoStore(gIR->ir->CreateAdd(deleted, DtoConstUint(1)), deletedPtr);
+  gIR->ir->CreateBr(endbb);
+
+  gIR->ir->SetInsertPoint(probe.missbb);
+  gIR->ir->CreateBr(fallbackbb);
 
   // call runtime
+  gIR->ir->SetInsertPoint(fallbackbb);
   LLValue *res = gIR->CreateCallOrInvoke(func, aaval, keyti, pkey);
+  llvm::BasicBlock *fallbackEndbb = gIR->scopebb();
+  gIR->ir->CreateBr(endbb);
+
+  gIR->ir->SetInsertPoint(endbb);
+  auto result = gIR->ir->CreatePHI(res->getType(), 3, ".aa.removed");
+  result->addIncoming(LLConstantInt::getFalse(res->getType()), nullbb);
+  result->addIncoming(LLConstantInt::getTrue(res->getType()), clearbb);
+  result->addIncoming(res, fallbackEndbb);
 
-  return new DImValue(Type::tbool, res);
+  return new DImValue(Type::tbool, result);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -27,6 +27,14 @@
 #include "gen/tollvm.h"
 #include "ir/irfunction.h"
 #include "ir/irmodule.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/CommandLine.h"
+
+static llvm::cl::opt<bool> appendFastPath(
+    "fappend-fastpath", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Extend arrays in-place for single-element appends (~=) "
+                   "using an inline capacity check, calling druntime only "
+                   "when the array needs to grow (experimental)"));
 
 static void DtoSetArray(DValue *array, LLValue *dim, LLValue *ptr);
 
@@ -199,16 +207,56 @@ static void copySlice(const Loc &loc, LLValue *dstarr, LLValue *dstlen,
   const bool checksEnabled =
       global.params.useAssert == CHECKENABLEon || gIR->emitArrayBoundsChecks();
   if (checksEnabled && !knownInBounds) {
+    auto &PGO = gIR->funcGen().pgo;
+    uint64_t length, count, total;
+    llvm::BasicBlock *endbb = nullptr;
+    if (PGO.profileSize(dstlen, length, count, total)) {
+      // The profile shows a dominant length: copy slices of that length inline
+      // with a fixed size if both lengths match and the slices don't overlap,
+      // and let the runtime check (and copy) all others.
+      LLValue *size = DtoConstSize_t(length * elementSize);
+      LLValue *dst = gIR->ir->CreatePtrToInt(dstarr, DtoSize_t());
+      LLValue *src = gIR->ir->CreatePtrToInt(srcarr, DtoSize_t());
+      LLValue *lengthConst = DtoConstSize_t(length);
+      LLValue *cond = gIR->ir->CreateAnd(
+          gIR->ir->CreateICmpEQ(dstlen, lengthConst),
+          gIR->ir->CreateICmpEQ(srclen, lengthConst));
+      cond = gIR->ir->CreateAnd(
+          cond,
+          gIR->ir->CreateOr(
+              gIR->ir->CreateICmpULE(gIR->ir->CreateAdd(dst, size), src),
+              gIR->ir->CreateICmpULE(gIR->ir->CreateAdd(src, size), dst)),
+          ".sliceCopy.fixedSize");
+
+      llvm::BasicBlock *fixedbb = gIR->insertBB("sliceCopy.fixed");
+      llvm::BasicBlock *checkedbb = gIR->insertBBAfter(fixedbb, "sliceCopy");
+      endbb = gIR->insertBBAfter(checkedbb, "sliceCopy.end");
+      auto br = gIR->ir->CreateCondBr(cond, fixedbb, checkedbb);
+      PGO.addBranchWeights(br,
+                           PGO.createProfileWeights(count, total - count));
+
+      gIR->ir->SetInsertPoint(fixedbb);
+      DtoMemCpy(dstarr, srcarr, size);
+      gIR->ir->CreateBr(endbb);
+      gIR->ir->SetInsertPoint(checkedbb);
+    }
+
     LLFunction *fn = getRuntimeFunction(loc, gIR->module, "_d_array_slice_copy");
     gIR->CreateCallOrInvoke(
         fn, {dstarr, dstlen, srcarr, srclen, DtoConstSize_t(elementSize)}, "",
         /*isNothrow=*/true);
+
+    if (endbb) {
+      gIR->ir->CreateBr(endbb);
+      gIR->ir->SetInsertPoint(endbb);
+    }
   } else {
     // We might have dstarr == srcarr at compile time, but as long as
     // sz1 == 0 at runtime, this would probably still be legal (the C spec
     // is unclear here).
     LLValue *size = computeSize(dstlen, elementSize);
-    DtoMemCpy(dstarr, srcarr, size);
+    auto copy = DtoMemCpy(dstarr, srcarr, size);
+    gIR->funcGen().pgo.emitMemOPSizePGO(copy, size);
   }
 }
 
@@ -700,8 +748,41 @@ DSliceValue *DtoNewDynArray(const Loc &loc, Type *arrayType, DValue *dim,
   LLValue *arrayLen = DtoRVal(dim);
 
   // call allocator
-  LLValue *newArray =
-      gIR->CreateCallOrInvoke(fn, arrayTypeInfo, arrayLen, ".gc_mem");
+  LLValue *newArray;
+  auto &PGO = gIR->funcGen().pgo;
+  uint64_t length, count, total;
+  if (PGO.profileSize(arrayLen, length, count, total)) {
+    // The profile shows a dominant length: allocate arrays of that length with
+    // a constant length, which e.g. allows promoting non-escaping ones to the
+    // stack.
+    llvm::BasicBlock *fixedbb = gIR->insertBB("newarray.fixed");
+    llvm::BasicBlock *dynbb = gIR->insertBBAfter(fixedbb, "newarray");
+    llvm::BasicBlock *endbb = gIR->insertBBAfter(dynbb, "newarray.end");
+    auto br = gIR->ir->CreateCondBr(
+        gIR->ir->CreateICmpEQ(arrayLen, DtoConstSize_t(length)), fixedbb,
+        dynbb);
+    PGO.addBranchWeights(br, PGO.createProfileWeights(count, total - count));
+
+    gIR->ir->SetInsertPoint(fixedbb);
+    LLValue *fixedArray = gIR->CreateCallOrInvoke(
+        fn, arrayTypeInfo, DtoConstSize_t(length), ".gc_mem");
+    fixedbb = gIR->scopebb();
+    gIR->ir->CreateBr(endbb);
+
+    gIR->ir->SetInsertPoint(dynbb);
+    LLValue *dynArray =
+        gIR->CreateCallOrInvoke(fn, arrayTypeInfo, arrayLen, ".gc_mem");
+    dynbb = gIR->scopebb();
+    gIR->ir->CreateBr(endbb);
+
+    gIR->ir->SetInsertPoint(endbb);
+    auto phi = gIR->ir->CreatePHI(fixedArray->getType(), 2, ".gc_mem");
+    phi->addIncoming(fixedArray, fixedbb);
+    phi->addIncoming(dynArray, dynbb);
+    newArray = phi;
+  } else {
+    newArray = gIR->CreateCallOrInvoke(fn, arrayTypeInfo, arrayLen, ".gc_mem");
+  }
 
   // return a DSliceValue with the well-known length for better optimizability
   auto ptr =
@@ -807,6 +888,193 @@ DSliceValue *DtoResizeDynArray(const Loc &loc, Type *arrayType, DValue *array,
 
 ////////////////////////////////////////////////////////////////////////////////
 
+namespace {
+// Number of entries of the per-thread append cache, a power of 2.
+constexpr unsigned appendCacheSize = 4;
+
+// The layout of large (>= PAGESIZE) appendable GC blocks, see
+// `__setArrayAllocLength()` in druntime's rt.lifetime: the used length (in
+// bytes, from the array start) is stored as size_t at the start of the block,
+// followed by the array data at offset LARGEPREFIX. The last byte of the block
+// is padding (LARGEPAD = LARGEPREFIX + 1).
+constexpr unsigned appendPageSize = 4096;
+constexpr unsigned appendLargePrefix = 16;
+// Arrays with more bytes can only be stored in large blocks (MAXMEDSIZE).
+constexpr unsigned appendMaxMediumSize = appendPageSize / 2 - 2;
+
+// Each entry is a `{ size_t ptr, size_t base, size_t size }` triple, describing
+// the start of a slice which was last extended by `~=` and the large GC block
+// it was stored in. The pointers are stored complemented, so that the GC
+// doesn't consider the entries as references when scanning the TLS ranges:
+// the cache must not keep dead blocks alive. The entries are therefore only
+// hints, which are validated against the GC on every hit.
+LLStructType *getAppendCacheEntryType() {
+  LLType *sizeTy = DtoSize_t();
+  return LLStructType::get(gIR->context(), {sizeTy, sizeTy, sizeTy});
+}
+
+// Returns the thread-local append cache of the current module.
+LLGlobalVariable *getAppendCache() {
+  const char *name = "ldc.arrayappend_cache";
+  if (auto existing = gIR->module.getGlobalVariable(name, true))
+    return existing;
+
+  auto type = LLArrayType::get(getAppendCacheEntryType(), appendCacheSize);
+  auto global = defineGlobal(Loc(), gIR->module, name, getNullValue(type),
+                             LLGlobalValue::LinkOnceODRLinkage, false,
+                             /*isThreadLocal=*/true);
+  setLinkage({LLGlobalValue::LinkOnceODRLinkage, needsCOMDAT()}, global);
+  global->setVisibility(LLGlobalValue::HiddenVisibility);
+  return global;
+}
+
+// Hides a pointer from the GC, see getAppendCacheEntryType().
+LLValue *hideFromGC(LLValue *ptr) {
+  return gIR->ir->CreateNot(gIR->ir->CreatePtrToInt(ptr, DtoSize_t()));
+}
+
+// Returns the cache entry for a slice starting at `ptr`. Large blocks are page
+// aligned, so they are distributed by page number.
+LLValue *getAppendCacheEntry(LLValue *ptr) {
+  LLValue *index = gIR->ir->CreateAnd(
+      gIR->ir->CreateLShr(gIR->ir->CreatePtrToInt(ptr, DtoSize_t()), 12),
+      DtoConstSize_t(appendCacheSize - 1), ".appendCache.index");
+  return DtoGEP(getAppendCache(), DtoConstSize_t(0), index,
+                ".appendCache.entry");
+}
+
+bool canUseAppendFastPath(Type *arrayType) {
+  if (!appendFastPath)
+    return false;
+
+  // druntime synchronizes the block metadata of shared arrays.
+  Type *elemType = arrayType->nextOf();
+  if (elemType->isShared())
+    return false;
+
+  return getTypeAllocSize(DtoMemType(elemType)) != 0;
+}
+
+// Extends the slice `array` by a single uninitialized element, like
+// `_d_arrayappendcTX(ti, array, 1)`.
+//
+// With -fappend-fastpath, arrays in large GC blocks are extended inline if the
+// slice ends at the used length of the block and the block capacity suffices,
+// updating the used length in the block like druntime. The block of a slice is
+// looked up in a small thread-local cache, which is filled by the druntime
+// calls. A hit is validated by asking the GC for the current size of the
+// cached block, as the block may have been freed, shrunk or reused since (e.g.
+// via `GC.free` or `GC.realloc`); the block metadata is only accessed if it
+// is still a large block of the same size. As the used length is checked and
+// kept up to date, a cache miss only costs a druntime call, and `capacity`,
+// `reserve` and `assumeSafeAppend` work as usual.
+void DtoAppendUninitializedElement(const Loc &loc, DValue *array,
+                                   Type *arrayType) {
+  LLFunction *fn = getRuntimeFunction(loc, gIR->module, "_d_arrayappendcTX");
+  LLValue *ti = DtoTypeInfoOf(loc, arrayType);
+  LLValue *arrayPtr =
+      DtoBitCast(DtoLVal(array), fn->getFunctionType()->getParamType(1));
+
+  if (!canUseAppendFastPath(arrayType)) {
+    gIR->CreateCallOrInvoke(fn, ti, arrayPtr, DtoConstSize_t(1),
+                            ".appendedArray");
+    return;
+  }
+
+  LLType *voidPtrTy = getVoidPtrType();
+  LLFunction *sizeOfFn = getRuntimeFunction(loc, gIR->module, "gc_sizeOf");
+  LLValue *elemSize =
+      DtoConstSize_t(getTypeAllocSize(DtoMemType(arrayType->nextOf())));
+
+  // look up the cache entry for the slice
+  LLValue *length = DtoArrayLen(array);
+  LLValue *ptr = DtoBitCast(DtoArrayPtr(array), voidPtrTy);
+  LLValue *entry = getAppendCacheEntry(ptr);
+  LLValue *hit = gIR->ir->CreateICmpEQ(DtoLoad(DtoGEP(entry, 0u, 0)),
+                                       hideFromGC(ptr), ".appendCache.hit");
+
+  llvm::BasicBlock *validatebb = gIR->insertBB("append.validate");
+  llvm::BasicBlock *checkbb = gIR->insertBBAfter(validatebb, "append.check");
+  llvm::BasicBlock *fastbb = gIR->insertBBAfter(checkbb, "append.fast");
+  llvm::BasicBlock *slowbb = gIR->insertBBAfter(fastbb, "append.slow");
+  llvm::BasicBlock *querybb = gIR->insertBBAfter(slowbb, "append.query");
+  llvm::BasicBlock *recordbb = gIR->insertBBAfter(querybb, "append.record");
+  llvm::BasicBlock *endbb = gIR->insertBBAfter(recordbb, "append.end");
+  llvm::MDBuilder mdBuilder(gIR->context());
+  gIR->ir->CreateCondBr(hit, validatebb, slowbb,
+                        mdBuilder.createBranchWeights(64, 1));
+
+  // check that the cached block still exists with the same size, and that the
+  // new element fits (exclusive of the padding byte)
+  gIR->ir->SetInsertPoint(validatebb);
+  LLValue *base = gIR->ir->CreateIntToPtr(
+      gIR->ir->CreateNot(DtoLoad(DtoGEP(entry, 0u, 1))), voidPtrTy, ".base");
+  LLValue *size = DtoLoad(DtoGEP(entry, 0u, 2), ".size");
+  LLValue *currentSize = gIR->CreateCallOrInvoke(sizeOfFn, base, ".size");
+  LLValue *end = DtoGEP1(ptr, gIR->ir->CreateMul(length, elemSize), ".end");
+  LLValue *newEnd = DtoGEP1(end, elemSize, ".newEnd");
+  LLValue *capacityEnd = DtoGEP1(
+      base, gIR->ir->CreateSub(size, DtoConstSize_t(1)), ".capacityEnd");
+  gIR->ir->CreateCondBr(
+      gIR->ir->CreateAnd(gIR->ir->CreateICmpEQ(currentSize, size),
+                         gIR->ir->CreateICmpULE(newEnd, capacityEnd)),
+      checkbb, slowbb, mdBuilder.createBranchWeights(64, 1));
+
+  // check that the slice ends at the used length of the block
+  gIR->ir->SetInsertPoint(checkbb);
+  LLValue *usedPtr = DtoBitCast(base, getPtrToType(DtoSize_t()), ".usedPtr");
+  LLValue *used = gIR->ir->CreateSub(
+      gIR->ir->CreatePtrToInt(end, DtoSize_t()),
+      gIR->ir->CreatePtrToInt(DtoGEP1(base, DtoConstSize_t(appendLargePrefix)),
+                              DtoSize_t()),
+      ".used");
+  gIR->ir->CreateCondBr(gIR->ir->CreateICmpEQ(DtoLoad(usedPtr), used), fastbb,
+                        slowbb, mdBuilder.createBranchWeights(64, 1));
+
+  // fast path: bump the used length of the block and the slice length
+  gIR->ir->SetInsertPoint(fastbb);
+  DtoStore(gIR->ir->CreateAdd(used, elemSize), usedPtr);
+  DtoStore(gIR->ir->CreateAdd(length, DtoConstSize_t(1)),
+           DtoGEP(DtoLVal(array), 0u, 0));
+  llvm::BranchInst::Create(endbb, gIR->scopebb());
+
+  // slow path: append via druntime, then cache the block of the (possibly
+  // moved) slice if it is large
+  gIR->ir->SetInsertPoint(slowbb);
+  gIR->CreateCallOrInvoke(fn, ti, arrayPtr, DtoConstSize_t(1),
+                          ".appendedArray");
+  LLValue *newLength = DtoArrayLen(array);
+  LLValue *newPtr = DtoBitCast(DtoArrayPtr(array), voidPtrTy);
+  gIR->ir->CreateCondBr(
+      gIR->ir->CreateICmpUGT(gIR->ir->CreateMul(newLength, elemSize),
+                             DtoConstSize_t(appendMaxMediumSize)),
+      querybb, endbb);
+
+  gIR->ir->SetInsertPoint(querybb);
+  LLFunction *addrOfFn = getRuntimeFunction(loc, gIR->module, "gc_addrOf");
+  LLValue *newBase = gIR->CreateCallOrInvoke(addrOfFn, newPtr, ".base");
+  gIR->ir->CreateCondBr(
+      gIR->ir->CreateICmpNE(newBase, getNullPtr(getVoidPtrType())), recordbb,
+      endbb);
+
+  gIR->ir->SetInsertPoint(recordbb);
+  LLValue *blockSize = gIR->CreateCallOrInvoke(sizeOfFn, newBase, ".size");
+  // 0 (never valid) for small blocks
+  LLValue *largeSize = gIR->ir->CreateSelect(
+      gIR->ir->CreateICmpUGE(blockSize, DtoConstSize_t(appendPageSize)),
+      blockSize, DtoConstSize_t(0), ".largeSize");
+  LLValue *newEntry = getAppendCacheEntry(newPtr);
+  DtoStore(hideFromGC(newPtr), DtoGEP(newEntry, 0u, 0));
+  DtoStore(hideFromGC(newBase), DtoGEP(newEntry, 0u, 1));
+  DtoStore(largeSize, DtoGEP(newEntry, 0u, 2));
+  llvm::BranchInst::Create(endbb, gIR->scopebb());
+
+  gIR->ir->SetInsertPoint(endbb);
+}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 void DtoCatAssignElement(const Loc &loc, DValue *array, Expression *exp) {
   IF_LOG Logger::println("DtoCatAssignElement");
   LOG_SCOPE;
@@ -818,13 +1086,9 @@ void DtoCatAssignElement(const Loc &loc, DValue *array, Expression *exp) {
   // Evaluate the expression to be appended first; it may affect the array.
   DValue *expVal = toElem(exp);
 
-  // The druntime function extends the slice in-place (length += 1, ptr
-  // potentially moved to a new block).
-  LLFunction *fn = getRuntimeFunction(loc, gIR->module, "_d_arrayappendcTX");
-  gIR->CreateCallOrInvoke(
-      fn, DtoTypeInfoOf(loc, arrayType),
-      DtoBitCast(DtoLVal(array), fn->getFunctionType()->getParamType(1)),
-      DtoConstSize_t(1), ".appendedArray");
+  // Extend the slice in-place (length += 1, ptr potentially moved to a new
+  // block).
+  DtoAppendUninitializedElement(loc, array, arrayType);
 
   // Assign to the new last element.
   LLValue *newLength = DtoArrayLen(array);
@@ -929,6 +1193,43 @@ DSliceValue *DtoAppendDChar(const Loc &loc, DValue *arr, Expression *exp,
                             const char *func) {
   LLValue *valueToAppend = DtoRVal(exp);
 
+  Type *arrayType = arr->type->toBasetype();
+  if (canUseAppendFastPath(arrayType)) {
+    // Code points below this limit are encoded as a single code unit and can
+    // be appended as element.
+    Type *elemType = arrayType->nextOf()->toBasetype();
+    const unsigned singleCodeUnitLimit = elemType->ty == Tchar ? 0x80 : 0xD800;
+
+    llvm::BasicBlock *singlebb = gIR->insertBB("appendchar.single");
+    llvm::BasicBlock *encodebb =
+        gIR->insertBBAfter(singlebb, "appendchar.encode");
+    llvm::BasicBlock *endbb = gIR->insertBBAfter(encodebb, "appendchar.end");
+    gIR->ir->CreateCondBr(
+        gIR->ir->CreateICmpULT(valueToAppend,
+                               DtoConstUint(singleCodeUnitLimit)),
+        singlebb, encodebb);
+
+    gIR->ir->SetInsertPoint(singlebb);
+    DtoAppendUninitializedElement(loc, arr, arrayType);
+    LLValue *lastIndex = gIR->ir->CreateSub(
+        DtoArrayLen(arr), DtoConstSize_t(1), ".lastIndex");
+    LLValue *lastElemPtr = DtoGEP1(DtoArrayPtr(arr), lastIndex, ".lastElem");
+    DtoStore(gIR->ir->CreateTrunc(valueToAppend, DtoType(elemType)),
+             lastElemPtr);
+    llvm::BranchInst::Create(endbb, gIR->scopebb());
+
+    gIR->ir->SetInsertPoint(encodebb);
+    LLFunction *fn = getRuntimeFunction(loc, gIR->module, func);
+    gIR->CreateCallOrInvoke(
+        fn, DtoBitCast(DtoLVal(arr), fn->getFunctionType()->getParamType(0)),
+        DtoBitCast(valueToAppend, fn->getFunctionType()->getParamType(1)),
+        ".appendedArray");
+    llvm::BranchInst::Create(endbb, gIR->scopebb());
+
+    gIR->ir->SetInsertPoint(endbb);
+    return getSlice(arr->type, DtoLoad(DtoLVal(arr)));
+  }
+
   // Prepare arguments
   LLFunction *fn = getRuntimeFunction(loc, gIR->module, func);
 
@@ -13,10 +13,13 @@
 #include "dmd/declaration.h"
 #include "dmd/errors.h"
 #include "dmd/expression.h"
+#include "dmd/id.h"
 #include "dmd/identifier.h"
 #include "dmd/init.h"
+#include "dmd/module.h"
 #include "dmd/mtype.h"
 #include "dmd/target.h"
+#include "driver/cl_options.h"
 #include "gen/arrays.h"
 #include "gen/dvalue.h"
 #include "gen/functions.h"
@@ -24,6 +27,7 @@
 #include "gen/llvm.h"
 #include "gen/llvmhelpers.h"
 #include "gen/logger.h"
+#include "gen/mangling.h"
 #include "gen/nested.h"
 #include "gen/optimizer.h"
 #include "gen/runtime.h"
@@ -32,6 +36,13 @@
 #include "ir/iraggr.h"
 #include "ir/irfunction.h"
 #include "ir/irtypeclass.h"
+#include "llvm/Support/CommandLine.h"
+
+static llvm::cl::opt<bool> dynamicCastFastPath(
+    "fdynamic-cast-fastpath", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Inline dynamic casts from classes to classes by comparing "
+                   "ClassInfo pointers, calling druntime only if they may be "
+                   "duplicated across binaries (experimental)"));
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -341,6 +352,104 @@ static void resolveObjectAndClassInfoClasses() {
   DtoResolveClass(Type::typeinfoclass);
 }
 
+namespace {
+/// Emits `_d_dynamic_cast(obj, cinfo)`, returning an i8*.
+LLValue *callDynamicCast(const Loc &loc, LLValue *obj, LLValue *cinfo) {
+  llvm::Function *func =
+      getRuntimeFunction(loc, gIR->module, "_d_dynamic_cast");
+  LLFunctionType *funcTy = func->getFunctionType();
+  obj = DtoBitCast(obj, funcTy->getParamType(0));
+  cinfo = DtoBitCast(cinfo, funcTy->getParamType(1));
+  LLValue *ret = gIR->CreateCallOrInvoke(func, obj, cinfo);
+  return DtoBitCast(ret, getVoidPtrType());
+}
+
+/// Emits a dynamic cast from a D class to a D class without calling druntime
+/// in the common cases. The ClassInfo of the object's dynamic type is compared
+/// against the target's; for final target classes, that's all there is to it.
+/// Otherwise, the `ClassInfo.base` chain is walked up to the static source
+/// class (the target can't be one of its ancestors, or the cast would have
+/// been a static one).
+/// The ClassInfo of a class may be duplicated across binaries (e.g., an
+/// executable and a shared library), so druntime is called if no match was
+/// found, which additionally compares the class names.
+LLValue *DtoInlineDynamicCastObject(const Loc &loc, LLValue *obj,
+                                    ClassDeclaration *from,
+                                    ClassDeclaration *to) {
+  LLType *voidPtrTy = getVoidPtrType();
+  ClassDeclaration *cinfoDecl = Type::typeinfoclass;
+  VarDeclaration *baseVar = cinfoDecl->fields[4];
+  assert(strcmp(baseVar->ident->toChars(), "base") == 0);
+  LLType *cinfoTy = DtoType(cinfoDecl->type);
+
+  const bool isFinal = (to->storage_class & STCfinal) != 0;
+
+  LLValue *toCinfo =
+      DtoBitCast(getIrAggr(to)->getClassInfoSymbol(), voidPtrTy);
+  LLValue *fromCinfo =
+      DtoBitCast(getIrAggr(from)->getClassInfoSymbol(), voidPtrTy);
+
+  llvm::BasicBlock *entrybb = gIR->scopebb();
+  llvm::BasicBlock *loadbb = gIR->insertBB("dyncast.load");
+  llvm::BasicBlock *walkbb =
+      isFinal ? nullptr : gIR->insertBBAfter(loadbb, "dyncast.walk");
+  llvm::BasicBlock *missbb =
+      gIR->insertBBAfter(walkbb ? walkbb : loadbb, "dyncast.miss");
+  llvm::BasicBlock *endbb = gIR->insertBBAfter(missbb, "dyncast.end");
+
+  obj = DtoBitCast(obj, voidPtrTy);
+  LLValue *isNull = gIR->ir->CreateICmpEQ(obj, getNullPtr(voidPtrTy));
+  gIR->ir->CreateCondBr(isNull, endbb, loadbb);
+
+  // Load the ClassInfo from slot 0 of the object's vtable.
+  gIR->ir->SetInsertPoint(loadbb);
+  LLType *vtblPtrTy = getPtrToType(getPtrToType(voidPtrTy));
+  LLValue *vtbl = DtoLoad(DtoBitCast(obj, vtblPtrTy), "dyncast.vtbl");
+  LLValue *cinfo = DtoLoad(vtbl, "dyncast.classinfo");
+  LLValue *isMatch = gIR->ir->CreateICmpEQ(cinfo, toCinfo);
+
+  llvm::BasicBlock *nextbb = nullptr;
+  if (isFinal) {
+    gIR->ir->CreateCondBr(isMatch, endbb, missbb);
+  } else {
+    nextbb = gIR->insertBBAfter(walkbb, "dyncast.next");
+    gIR->ir->CreateCondBr(isMatch, endbb, walkbb);
+
+    // Stop at the static source class or the root, whatever comes first.
+    gIR->ir->SetInsertPoint(walkbb);
+    llvm::PHINode *cur = gIR->ir->CreatePHI(voidPtrTy, 2, "dyncast.cur");
+    cur->addIncoming(cinfo, loadbb);
+    LLValue *atTop = gIR->ir->CreateOr(
+        gIR->ir->CreateICmpEQ(cur, fromCinfo),
+        gIR->ir->CreateICmpEQ(cur, getNullPtr(voidPtrTy)));
+    gIR->ir->CreateCondBr(atTop, missbb, nextbb);
+
+    gIR->ir->SetInsertPoint(nextbb);
+    LLValue *pbase =
+        DtoIndexAggregate(DtoBitCast(cur, cinfoTy), cinfoDecl, baseVar);
+    LLValue *base = DtoBitCast(DtoLoad(pbase, "dyncast.base"), voidPtrTy);
+    cur->addIncoming(base, nextbb);
+    gIR->ir->CreateCondBr(gIR->ir->CreateICmpEQ(base, toCinfo), endbb,
+                          walkbb);
+  }
+
+  // No match, but the ClassInfo might still be a duplicate.
+  gIR->ir->SetInsertPoint(missbb);
+  LLValue *missResult = callDynamicCast(loc, obj, toCinfo);
+  missbb = gIR->scopebb();
+  gIR->ir->CreateBr(endbb);
+
+  gIR->ir->SetInsertPoint(endbb);
+  llvm::PHINode *result = gIR->ir->CreatePHI(voidPtrTy, 4, "dyncast.result");
+  result->addIncoming(getNullPtr(voidPtrTy), entrybb);
+  result->addIncoming(obj, loadbb);
+  if (nextbb)
+    result->addIncoming(obj, nextbb);
+  result->addIncoming(missResult, missbb);
+  return result;
+}
+}
+
 DValue *DtoDynamicCastObject(const Loc &loc, DValue *val, Type *_to) {
   // call:
   // Object _d_dynamic_cast(Object o, ClassInfo c)
@@ -351,13 +460,24 @@ DValue *DtoDynamicCastObject(const Loc &loc, DValue *val, Type *_to) {
 
   resolveObjectAndClassInfoClasses();
 
+  TypeClass *from = static_cast<TypeClass *>(val->type->toBasetype());
+  TypeClass *to = static_cast<TypeClass *>(_to->toBasetype());
+  if (dynamicCastFastPath && to->sym->classKind == ClassKind::d &&
+      !to->sym->isInterfaceDeclaration() &&
+      from->sym->classKind == ClassKind::d) {
+    DtoResolveClass(from->sym);
+    DtoResolveClass(to->sym);
+    LLValue *ret =
+        DtoInlineDynamicCastObject(loc, DtoRVal(val), from->sym, to->sym);
+    return new DImValue(_to, DtoBitCast(ret, DtoType(_to)));
+  }
+
   // Object o
   LLValue *obj = DtoRVal(val);
   obj = DtoBitCast(obj, funcTy->getParamType(0));
   assert(funcTy->getParamType(0) == obj->getType());
 
   // ClassInfo c
-  TypeClass *to = static_cast<TypeClass *>(_to->toBasetype());
   DtoResolveClass(to->sym);
 
   LLValue *cinfo = getIrAggr(to->sym)->getClassInfoSymbol();
@@ -431,6 +551,14 @@ LLValue *DtoVirtualFunctionPointer(DValue *inst, FuncDeclaration *fdecl) {
   funcval = DtoGEP(funcval, 0u, 0);
   // load vtbl ptr
   funcval = DtoLoad(funcval);
+  // tell LLVM which vtables it may point to (-fwhole-program-vtables)
+  if (auto typeId = getVtblTypeId(inst->type->toBasetype()->isClassHandle())) {
+    LLValue *args[] = {DtoBitCast(funcval, getVoidPtrType()),
+                       llvm::MetadataAsValue::get(gIR->context(), typeId)};
+    LLValue *typeTest =
+        gIR->ir->CreateCall(GET_INTRINSIC_DECL(type_test), args);
+    gIR->ir->CreateCall(GET_INTRINSIC_DECL(assume), typeTest);
+  }
   // index vtbl
   const std::string name = fdecl->toChars();
   const auto vtblname = name + "@vtbl";
@@ -450,3 +578,51 @@ LLValue *DtoVirtualFunctionPointer(DValue *inst, FuncDeclaration *fdecl) {
 
   return funcval;
 }
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+/// Returns true if the given class or interface is declared in druntime or
+/// Phobos. Their vtables carry no type metadata (the libraries aren't built
+/// with -fwhole-program-vtables), so they must not be assumed to be complete.
+bool isFromDefaultLib(ClassDeclaration *cd) {
+  Module *m = cd->getModule();
+  ModuleDeclaration *md = m ? m->md : nullptr;
+  if (!md)
+    return false;
+  if (!md->packages || md->packages->length == 0)
+    return md->id == Id::object;
+  const llvm::StringRef root = (*md->packages)[0]->toChars();
+  return root == "core" || root == "std" || root == "etc" || root == "ldc" ||
+         root == "rt";
+}
+
+/// Returns the class or interface whose vtable layout is a prefix of the given
+/// one's.
+ClassDeclaration *getVtblPrefixAncestor(ClassDeclaration *cd) {
+  if (cd->isInterfaceDeclaration()) {
+    // Only the layout of the first base interface is a prefix; converting to
+    // other base interfaces requires a dynamic cast.
+    return cd->interfaces.length > 0 ? cd->interfaces.ptr[0]->sym : nullptr;
+  }
+  return cd->baseClass;
+}
+}
+
+llvm::MDString *getVtblTypeId(ClassDeclaration *cd) {
+  if (!opts::wholeProgramVtables || !cd || cd->classKind != ClassKind::d ||
+      cd->isCOMinterface() || isFromDefaultLib(cd)) {
+    return nullptr;
+  }
+
+  return llvm::MDString::get(gIR->context(),
+                             getIRMangledAggregateName(cd, "6__vtblZ"));
+}
+
+void addVtblTypeMetadata(llvm::GlobalVariable *vtbl, ClassDeclaration *cd) {
+  // The address point of D vtables is always at offset 0.
+  for (; cd; cd = getVtblPrefixAncestor(cd)) {
+    if (auto typeId = getVtblTypeId(cd))
+      vtbl->addTypeMetadata(0, typeId);
+  }
+}
@@ -21,6 +21,10 @@ class CtorDeclaration;
 class FuncDeclaration;
 class NewExp;
 class TypeClass;
+namespace llvm {
+class GlobalVariable;
+class MDString;
+}
 
 /// Resolves the llvm type for a class declaration
 void DtoResolveClass(ClassDeclaration *cd);
@@ -36,3 +40,12 @@ DValue *DtoDynamicCastObject(const Loc &loc, DValue *val, Type *to);
 DValue *DtoDynamicCastInterface(const Loc &loc, DValue *val, Type *to);
 
 llvm::Value *DtoVirtualFunctionPointer(DValue *inst, FuncDeclaration *fdecl);
+
+/// Returns the type identifier used in the `!type` metadata of all vtables
+/// compatible with the given class or interface, or null if
+/// -fwhole-program-vtables doesn't apply to it.
+llvm::MDString *getVtblTypeId(ClassDeclaration *cd);
+
+/// Attaches `!type` metadata for the given class or interface and all of its
+/// ancestors to a vtable (-fwhole-program-vtables).
+void addVtblTypeMetadata(llvm::GlobalVariable *vtbl, ClassDeclaration *cd);
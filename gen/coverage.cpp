@@ -10,8 +10,12 @@
 #include "gen/coverage.h"
 
 #include "dmd/module.h"
+#include "driver/cl_options.h"
 #include "gen/irstate.h"
 #include "gen/logger.h"
+#include "gen/tollvm.h"
+#include "ir/irmodule.h"
+#include "llvm/IR/MDBuilder.h"
 
 void emitCoverageLinecountInc(const Loc &loc) {
   Module *m = gIR->dmodule;
@@ -31,14 +35,77 @@ void emitCoverageLinecountInc(const Loc &loc) {
   LOG_SCOPE;
 
   // Get GEP into _d_cover_data array
+  LLArrayType *dataType =
+      LLArrayType::get(LLType::getInt32Ty(gIR->context()), m->numlines);
   LLConstant *idxs[] = {DtoConstUint(0), DtoConstUint(line)};
   LLValue *ptr = llvm::ConstantExpr::getGetElementPtr(
-      LLArrayType::get(LLType::getInt32Ty(gIR->context()), m->numlines),
-      m->d_cover_data, idxs, true);
+      dataType, m->d_cover_data, idxs, true);
 
-  // Do an atomic increment, so this works when multiple threads are executed.
-  gIR->ir->CreateAtomicRMW(llvm::AtomicRMWInst::Add, ptr, DtoConstUint(1),
-                           llvm::AtomicOrdering::Monotonic);
+  switch (opts::coverageIncrement) {
+  case opts::CoverageIncrement::atomic:
+    // Do an atomic increment, so this works when multiple threads are
+    // executed.
+    gIR->ir->CreateAtomicRMW(llvm::AtomicRMWInst::Add, ptr, DtoConstUint(1),
+                             llvm::AtomicOrdering::Monotonic);
+    break;
+  case opts::CoverageIncrement::bitmap:
+    // Just flag the line as executed, without a read-modify-write. Racing
+    // stores of the same value are fine (but must be atomic), and the cache
+    // line is only written to if the flag isn't set yet.
+    {
+      llvm::BasicBlock *setbb = gIR->insertBB("cov.set");
+      llvm::BasicBlock *endbb = gIR->insertBBAfter(setbb, "cov.end");
+      auto flag = llvm::cast<llvm::LoadInst>(DtoAlignedLoad(ptr));
+      flag->setAtomic(llvm::AtomicOrdering::Monotonic);
+      LLValue *isSet = gIR->ir->CreateICmpNE(flag, DtoConstUint(0));
+      gIR->ir->CreateCondBr(isSet, endbb, setbb);
+      gIR->ir->SetInsertPoint(setbb);
+      auto store = gIR->ir->CreateStore(DtoConstUint(1), ptr);
+      store->setAtomic(llvm::AtomicOrdering::Monotonic);
+      store->setAlignment(LLAlign(4));
+      gIR->ir->CreateBr(endbb);
+      gIR->ir->SetInsertPoint(endbb);
+    }
+    break;
+  case opts::CoverageIncrement::sharded:
+    // Increment the thread's counter, registering its shard on first use.
+    // Only the main thread (or a thread without a shard) counts in
+    // _d_cover_data itself, which is updated atomically as other threads'
+    // shards are merged into it. The shards are private to their thread.
+    {
+      IrModule *irm = getIrModule(m);
+      llvm::BasicBlock *oldbb = gIR->scopebb();
+      llvm::BasicBlock *initbb = gIR->insertBB("cov.init");
+      llvm::BasicBlock *incbb = gIR->insertBBAfter(initbb, "cov.inc");
+      llvm::BasicBlock *atomicbb = gIR->insertBBAfter(incbb, "cov.atomic");
+      llvm::BasicBlock *shardbb = gIR->insertBBAfter(atomicbb, "cov.shard");
+      llvm::BasicBlock *endbb = gIR->insertBBAfter(shardbb, "cov.end");
+      LLValue *data = DtoLoad(irm->coverageDataPtr, "cov.data");
+      llvm::MDBuilder mdBuilder(gIR->context());
+      gIR->ir->CreateCondBr(gIR->ir->CreateIsNull(data), initbb, incbb,
+                            mdBuilder.createBranchWeights(1, 1000));
+      gIR->ir->SetInsertPoint(initbb);
+      LLValue *shard = gIR->ir->CreateCall(irm->coverageShardInit, {});
+      gIR->ir->CreateBr(incbb);
+      gIR->ir->SetInsertPoint(incbb);
+      llvm::PHINode *counters = gIR->ir->CreatePHI(data->getType(), 2);
+      counters->addIncoming(data, oldbb);
+      counters->addIncoming(shard, initbb);
+      LLValue *counter = gIR->ir->CreateInBoundsGEP(
+          dataType, counters, {DtoConstUint(0), DtoConstUint(line)});
+      gIR->ir->CreateCondBr(gIR->ir->CreateICmpEQ(counters, m->d_cover_data),
+                            atomicbb, shardbb);
+      gIR->ir->SetInsertPoint(atomicbb);
+      gIR->ir->CreateAtomicRMW(llvm::AtomicRMWInst::Add, counter,
+                               DtoConstUint(1), llvm::AtomicOrdering::Monotonic);
+      gIR->ir->CreateBr(endbb);
+      gIR->ir->SetInsertPoint(shardbb);
+      DtoStore(gIR->ir->CreateAdd(DtoLoad(counter), DtoConstUint(1)), counter);
+      gIR->ir->CreateBr(endbb);
+      gIR->ir->SetInsertPoint(endbb);
+    }
+    break;
+  }
 
   unsigned num_sizet_bits = gDataLayout->getTypeSizeInBits(DtoSize_t());
   unsigned idx = line / num_sizet_bits;
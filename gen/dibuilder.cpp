@@ -21,6 +21,7 @@
 #include "dmd/nspace.h"
 #include "dmd/template.h"
 #include "driver/cl_options.h"
+#include "driver/cl_options_instrumentation.h"
 #include "driver/ldc-version.h"
 #include "gen/functions.h"
 #include "gen/irstate.h"
@@ -923,12 +924,14 @@ void DIBuilder::EmitCompileUnit(Module *m) {
       DBuilder.createFile(llvm::sys::path::filename(srcpath),
                           llvm::sys::path::parent_path(srcpath)),
       producerName,
-      isOptimizationEnabled(), // isOptimized
-      llvm::StringRef(),       // Flags TODO
-      1,                       // Runtime Version TODO
-      llvm::StringRef(),       // SplitName
-      getDebugEmissionKind(),  // DebugEmissionKind
-      0                        // DWOId
+      isOptimizationEnabled(),    // isOptimized
+      llvm::StringRef(),          // Flags TODO
+      1,                          // Runtime Version TODO
+      llvm::StringRef(),          // SplitName
+      getDebugEmissionKind(),     // DebugEmissionKind
+      0,                          // DWOId
+      true,                       // SplitDebugInlining
+      opts::debugInfoForProfiling // DebugInfoForProfiling
   );
 }
 
@@ -764,7 +764,12 @@ void createThunkFunc(llvm::Module &module, const llvm::Function *src,
   auto bb = llvm::BasicBlock::Create(module.getContext(), "", dst);
   llvm::IRBuilder<> builder(module.getContext());
   builder.SetInsertPoint(bb);
+  // The jit runtime may swap the thunk while it is being called (asynchronous
+  // compilation).
   auto thunkPtr = builder.CreateLoad(thunkVar);
+  thunkPtr->setAtomic(llvm::AtomicOrdering::Acquire);
+  thunkPtr->setAlignment(
+      LLAlign(module.getDataLayout().getPointerABIAlignment(0)));
   llvm::SmallVector<llvm::Value *, 6> args;
   for (auto &arg : dst->args()) {
     args.push_back(&arg);
@@ -847,10 +852,11 @@ void defineDynamicCompiledFunction(IRState *irs, IrFunction *func) {
     auto srcFunc = func->getLLVMFunc();
     auto it = irs->dynamicCompiledFunctions.find(srcFunc);
     assert(irs->dynamicCompiledFunctions.end() != it);
-    auto thunkVarType = srcFunc->getFunctionType()->getPointerTo();
+    // Calls are dispatched to the statically compiled function until the
+    // dynamically compiled one is available.
     auto thunkVar = new llvm::GlobalVariable(
-        irs->module, thunkVarType, false, llvm::GlobalValue::PrivateLinkage,
-        llvm::ConstantPointerNull::get(thunkVarType),
+        irs->module, srcFunc->getType(), false,
+        llvm::GlobalValue::PrivateLinkage, srcFunc,
         ".rtcompile_thunkvar_" + srcFunc->getName());
     auto dstFunc = it->second.thunkFunc;
     createThunkFunc(irs->module, srcFunc, dstFunc, thunkVar);
@@ -197,6 +197,10 @@ public:
   /// value.
   llvm::AllocaInst *retValSlot = nullptr;
 
+  /// With sampled `-finstrument-functions`, a stack slot recording whether the
+  /// current invocation has called the entry hook (and so calls the exit hook).
+  llvm::AllocaInst *instrumentFunctionsSampled = nullptr;
+
   /// Emits a call or invoke to the given callee, depending on whether there
   /// are catches/cleanups active or not.
   LLCallBasePtr callOrInvoke(llvm::Value *callee,
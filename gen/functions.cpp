@@ -53,8 +53,11 @@
 #include "ir/irmodule.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include <iostream>
 
@@ -512,9 +515,26 @@ void applyXRayAttributes(FuncDeclaration &fdecl, llvm::Function &func) {
 
   if (!fdecl.emitInstrumentation) {
     func.addFnAttr("function-instrument", "xray-never");
-  } else {
+    return;
+  }
+
+  // `@ldc.attributes.xray` takes precedence over the filter files.
+  if (func.hasFnAttribute("function-instrument"))
+    return;
+
+  auto module = fdecl.getModule();
+  switch (opts::matchXRayFilterFiles(fdecl.toPrettyChars(),
+                                     module ? module->srcfile.toChars() : "")) {
+  case opts::XRayFilterResult::always:
+    func.addFnAttr("function-instrument", "xray-always");
+    break;
+  case opts::XRayFilterResult::never:
+    func.addFnAttr("function-instrument", "xray-never");
+    break;
+  case opts::XRayFilterResult::none:
     func.addFnAttr("xray-instruction-threshold",
                    opts::getXRayInstructionThresholdString());
+    break;
   }
 }
 
@@ -918,6 +938,139 @@ void emitDMDStyleFunctionTrace(IRState &irs, FuncDeclaration *fd,
   }
 }
 
+namespace {
+// The number of events in the thread-local trace buffer of the runtime
+// (runtime/trace-rt/trace_buffer.c), a power of 2.
+const unsigned traceBufferSize = 4096;
+
+// Whether the trace timestamps are read from the target's cycle counter. The
+// runtime converts them to wall-clock time; on other targets, it provides the
+// timestamps itself.
+bool hasTraceCycleCounter() {
+  const auto arch = global.params.targetTriple->getArch();
+  return arch == llvm::Triple::x86 || arch == llvm::Triple::x86_64 ||
+         arch == llvm::Triple::aarch64;
+}
+
+// Returns the current timestamp, in the ticks the runtime calibrates against
+// (see `readTicks()` in trace_buffer.c). On AArch64, `llvm.readcyclecounter`
+// reads PMCCNTR_EL0, which traps in user mode on Linux and is a different
+// clock, so the virtual counter is read instead.
+LLValue *emitTraceTimestamp(IRState &irs) {
+  if (!hasTraceCycleCounter()) {
+    return irs.ir->CreateCall(
+        getRuntimeFunction(Loc(), irs.module, "_d_trace_buffer_clock"));
+  }
+  if (global.params.targetTriple->getArch() == llvm::Triple::aarch64) {
+    auto asmType = llvm::FunctionType::get(irs.ir->getInt64Ty(), false);
+    auto readCounter = llvm::InlineAsm::get(asmType, "mrs $0, cntvct_el0",
+                                            "=r", /*hasSideEffects=*/true);
+    return irs.ir->CreateCall(readCounter);
+  }
+  return irs.ir->CreateCall(GET_INTRINSIC_DECL(readcyclecounter));
+}
+
+// Returns the thread-local trace buffer of the current module, which is
+// registered with the runtime at the thread's first event:
+//   struct {
+//     ulong pos, flushed;
+//     struct { ulong timestamp; const(char)* func; }[traceBufferSize] events;
+//   }
+// The top bit of an event's timestamp is set for function exits.
+LLGlobalVariable *getTraceBuffer(IRState &irs) {
+  const char *name = "ldc.trace_buffer";
+  if (auto existing = irs.module.getGlobalVariable(name, true))
+    return existing;
+
+  LLType *i64Ty = LLType::getInt64Ty(irs.context());
+  LLType *eventTy = LLStructType::get(irs.context(), {i64Ty, getVoidPtrType()});
+  LLType *bufferTy = LLStructType::get(
+      irs.context(),
+      {i64Ty, i64Ty, llvm::ArrayType::get(eventTy, traceBufferSize)});
+  auto global = defineGlobal(Loc(), irs.module, name, getNullValue(bufferTy),
+                             LLGlobalValue::LinkOnceODRLinkage, false,
+                             /*isThreadLocal=*/true);
+  setLinkage({LLGlobalValue::LinkOnceODRLinkage, needsCOMDAT()}, global);
+  global->setVisibility(LLGlobalValue::HiddenVisibility);
+  return global;
+}
+
+// Appends a function entry or exit event to the trace buffer, right before
+// `insertBefore`.
+void emitTraceBufferEvent(IRState &irs, llvm::Instruction *insertBefore,
+                          LLConstant *funcName, bool isExit) {
+  const auto savedInsertPoint = irs.saveInsertPoint();
+  irs.ir->SetInsertPoint(insertBefore);
+
+  auto buffer = getTraceBuffer(irs);
+  LLValue *posPtr = DtoGEP(buffer, 0u, 0);
+  LLValue *pos = DtoLoad(posPtr, ".trace.pos");
+  LLValue *index =
+      irs.ir->CreateAnd(pos, irs.ir->getInt64(traceBufferSize - 1));
+
+  // At the thread's first event, the runtime registers the buffer; whenever it
+  // is full, the runtime hands the events over to its writer thread.
+  llvm::MDBuilder mdb(irs.context());
+  auto flushTerm = llvm::SplitBlockAndInsertIfThen(
+      irs.ir->CreateICmpEQ(index, irs.ir->getInt64(0)), insertBefore,
+      /*Unreachable=*/false, mdb.createBranchWeights(1, traceBufferSize - 1));
+  irs.ir->SetInsertPoint(flushTerm);
+  irs.ir->CreateCall(
+      getRuntimeFunction(Loc(), irs.module, "_d_trace_buffer_flush"),
+      DtoBitCast(buffer, getVoidPtrType()));
+
+  irs.ir->SetInsertPoint(insertBefore);
+  LLValue *timestamp = emitTraceTimestamp(irs);
+  if (isExit)
+    timestamp = irs.ir->CreateOr(timestamp, irs.ir->getInt64(1ULL << 63));
+
+  LLValue *event = DtoGEP(DtoGEP(buffer, 0u, 2), DtoConstUint(0), index);
+  DtoStore(timestamp, DtoGEP(event, 0u, 0));
+  DtoStore(funcName, DtoGEP(event, 0u, 1));
+  DtoStore(irs.ir->CreateAdd(pos, irs.ir->getInt64(1)), posPtr);
+}
+} // anonymous namespace
+
+void emitTraceBufferInstrumentation(IRState &irs, FuncDeclaration *fd,
+                                    llvm::Function *func) {
+  // Like XRay, skip small leaf functions, whose tracing overhead would
+  // dominate their runtime.
+  unsigned numInstructions = 0;
+  bool isLeaf = true;
+  for (auto &bb : *func) {
+    for (auto &inst : bb) {
+      if ((llvm::isa<llvm::CallInst>(inst) ||
+           llvm::isa<llvm::InvokeInst>(inst)) &&
+          !llvm::isa<llvm::IntrinsicInst>(inst))
+        isLeaf = false;
+      ++numInstructions;
+    }
+  }
+  if (isLeaf && numInstructions < opts::traceInstructionThreshold)
+    return;
+
+  LLConstant *funcName = DtoConstCString(fd->toPrettyChars());
+
+  llvm::SmallVector<llvm::Instruction *, 4> exits;
+  for (auto &bb : *func) {
+    if (auto ret = llvm::dyn_cast<llvm::ReturnInst>(bb.getTerminator())) {
+      // A musttail call must immediately precede the return.
+      auto call = llvm::dyn_cast_or_null<llvm::CallInst>(ret->getPrevNode());
+      if (call && call->isMustTailCall())
+        exits.push_back(call);
+      else
+        exits.push_back(ret);
+    }
+  }
+  for (auto exit : exits)
+    emitTraceBufferEvent(irs, exit, funcName, /*isExit=*/true);
+
+  auto entry = func->getEntryBlock().begin();
+  while (llvm::isa<llvm::AllocaInst>(*entry))
+    ++entry;
+  emitTraceBufferEvent(irs, &*entry, funcName, /*isExit=*/false);
+}
+
 // If the specified block is trivially unreachable, erases it and returns true.
 // This is a common case because it happens when 'return' is the last statement
 // in a function.
@@ -1357,6 +1510,11 @@ void DtoDefineFunction(FuncDeclaration *fd, bool linkageAvailableExternally) {
     allocaPoint = nullptr;
   }
 
+  if (opts::functionTraceMode == opts::FunctionTraceMode::traceBuffer &&
+      fd->emitInstrumentation && !fd->isCMain()) {
+    emitTraceBufferInstrumentation(*gIR, fd, func);
+  }
+
   if (gIR->dcomputetarget && hasKernelAttr(fd)) {
     auto fn = gIR->module.getFunction(fd->mangleString);
     gIR->dcomputetarget->addKernelMetadata(fd, fn);
@@ -207,9 +207,9 @@ public:
   // debug info helper
   ldc::DIBuilder DBuilder;
 
-  // PGO data file reader
-  std::unique_ptr<llvm::IndexedInstrProfReader> PGOReader;
-  llvm::IndexedInstrProfReader *getPGOReader() const { return PGOReader.get(); }
+  // PGO data file reader, shared by all modules
+  llvm::IndexedInstrProfReader *PGOReader = nullptr;
+  llvm::IndexedInstrProfReader *getPGOReader() const { return PGOReader; }
 
   // for inline asm
   IRAsmBlock *asmBlock = nullptr;
@@ -22,6 +22,7 @@
 #include "dmd/statement.h"
 #include "dmd/target.h"
 #include "dmd/template.h"
+#include "driver/cl_options.h"
 #include "driver/cl_options_instrumentation.h"
 #include "driver/timetrace.h"
 #include "gen/abi.h"
@@ -48,6 +49,7 @@
 #include "llvm/ProfileData/InstrProfReader.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 
@@ -299,6 +301,13 @@ llvm::Function *buildRegisterDSO(RegistryStyle style, llvm::Value *dsoSlot,
   return fn;
 }
 
+const char *getModuleInfoRefsSectionName(RegistryStyle style) {
+  return global.params.targetTriple->isWindowsMSVCEnvironment()
+             ? ".minfo"
+             : style == RegistryStyle::sectionDarwin ? "__DATA,.minfo"
+                                                     : "__minfo";
+}
+
 void emitModuleRefToSection(RegistryStyle style, std::string moduleMangle,
                             llvm::Constant *thisModuleInfo) {
   assert(style == RegistryStyle::sectionSimple ||
@@ -313,16 +322,12 @@ void emitModuleRefToSection(RegistryStyle style, std::string moduleMangle,
   const bool isFirst = !gIR->module.getGlobalVariable("ldc.dso_slot");
 
   const auto moduleInfoPtrTy = DtoPtrToType(getModuleInfoType());
-  const auto moduleInfoRefsSectionName =
-      global.params.targetTriple->isWindowsMSVCEnvironment()
-          ? ".minfo"
-          : style == RegistryStyle::sectionDarwin ? "__DATA,.minfo" : "__minfo";
 
   const auto thismrefIRMangle =
       getIRMangledModuleRefSymbolName(moduleMangle.c_str());
   auto thismref = defineDSOGlobal(thismrefIRMangle,
                                   DtoBitCast(thisModuleInfo, moduleInfoPtrTy));
-  thismref->setSection(moduleInfoRefsSectionName);
+  thismref->setSection(getModuleInfoRefsSectionName(style));
   gIR->usedArray.push_back(thismref);
 
   if (!isFirst || style == RegistryStyle::sectionSimple) {
@@ -376,6 +381,566 @@ void emitModuleRefToSection(RegistryStyle style, std::string moduleMangle,
   dsoDtor->setSection("__DATA,__mod_term_func,mod_term_funcs");
 }
 
+// -cov=sharded: the registry of the threads' coverage shards.
+//
+// Each thread counts into the array pointed to by the thread-local
+// _d_cover_data_ptr of a module. It is null until the thread first executes an
+// instrumented line of the module, which then points it to the thread's shard
+// and adds the shard to the thread's `ldc.cover_thread` record. The first shard
+// links the record into the `ldc.cover_threads` list and sets it as the
+// thread's value of the single `ldc.cover_key` thread-exit key (pthread key
+// destructor / fiber-local storage callback), which adds the shards to the
+// modules' _d_cover_data. All of this is shared by the modules of a DSO via
+// linkonce_odr symbols and guarded by the `ldc.cover_lock` spinlock.
+//
+// Thread-exit callbacks don't run for the main thread when the process exits,
+// so the coverage ctor points the calling (main) thread directly to
+// _d_cover_data, which is therefore updated with (uncontended) atomic adds.
+// The threads still alive at that point (e.g., daemon threads) are merged by
+// the main thread's ModuleInfo TLS dtor, which druntime runs before the shared
+// dtor writing the .lst files. That dtor is attached to a separate `ldc.cover`
+// ModuleInfo without any imports, as attaching it to the instrumented modules
+// would subject them to druntime's cycle check.
+
+LLType *getCoverageCountsType() {
+  return LLType::getInt32PtrTy(gIR->context());
+}
+
+// { void* next, uint* data, uint* counts, size_t numlines, void** dataPtr }
+LLStructType *getCoverageShardType() {
+  LLType *voidPtrTy = getVoidPtrType();
+  return LLStructType::get(gIR->context(),
+                           {voidPtrTy, getCoverageCountsType(),
+                            getCoverageCountsType(), DtoSize_t(),
+                            voidPtrTy->getPointerTo()});
+}
+
+// { void* next, void* prev, void* shards }
+LLStructType *getCoverageThreadType() {
+  LLType *voidPtrTy = getVoidPtrType();
+  return LLStructType::get(gIR->context(), {voidPtrTy, voidPtrTy, voidPtrTy});
+}
+
+// pthread_key_t is an unsigned long on Darwin, a 32-bit integer elsewhere;
+// FlsAlloc() returns a DWORD.
+LLType *getCoverageKeyType() {
+  return global.params.targetTriple->isOSDarwin()
+             ? DtoSize_t()
+             : LLType::getInt32Ty(gIR->context());
+}
+
+LLGlobalVariable *getCoverageGlobal(const char *name, LLType *type,
+                                    bool isThreadLocal = false) {
+  if (auto existing = gIR->module.getGlobalVariable(name, true)) {
+    return existing;
+  }
+  return defineDSOGlobal(name, getNullValue(type), isThreadLocal);
+}
+
+// Returns the linkonce_odr function `name` and whether it needs to be defined.
+std::pair<LLFunction *, bool> getCoverageFunction(const char *name,
+                                                  LLFunctionType *type) {
+  if (auto existing = gIR->module.getFunction(name)) {
+    return {existing, false};
+  }
+  LLFunction *fn = createDSOFunction(name, type);
+  if (global.params.targetTriple->getArch() == llvm::Triple::x86_64) {
+    fn->addFnAttr(LLAttribute::UWTable);
+  }
+  return {fn, true};
+}
+
+// Spins until `ldc.cover_lock` is acquired.
+void emitCoverageLock(IRBuilder<> &builder) {
+  auto lock = getCoverageGlobal("ldc.cover_lock",
+                                LLType::getInt32Ty(gIR->context()));
+  auto spinbb = llvm::BasicBlock::Create(
+      gIR->context(), "lock", builder.GetInsertBlock()->getParent());
+  auto lockedbb = llvm::BasicBlock::Create(
+      gIR->context(), "locked", builder.GetInsertBlock()->getParent());
+  builder.CreateBr(spinbb);
+  builder.SetInsertPoint(spinbb);
+  LLValue *old = builder.CreateAtomicRMW(llvm::AtomicRMWInst::Xchg, lock,
+                                         DtoConstUint(1),
+                                         llvm::AtomicOrdering::Acquire);
+  builder.CreateCondBr(builder.CreateICmpEQ(old, DtoConstUint(0)), lockedbb,
+                       spinbb);
+  builder.SetInsertPoint(lockedbb);
+}
+
+void emitCoverageUnlock(IRBuilder<> &builder) {
+  auto lock = getCoverageGlobal("ldc.cover_lock",
+                                LLType::getInt32Ty(gIR->context()));
+  auto store = builder.CreateStore(DtoConstUint(0), lock);
+  store->setAtomic(llvm::AtomicOrdering::Release);
+  store->setAlignment(LLAlign(4));
+}
+
+// void ldc.cover_merge_shards(void* shards, bool detach): adds the counts of
+// a thread's shards to the modules' _d_cover_data and resets them. If
+// `detach` is set (on the owning thread), the shards are unregistered too.
+LLFunction *getCoverageMergeShards() {
+  auto &context = gIR->context();
+  LLType *voidPtrTy = getVoidPtrType();
+  auto fnAndIsNew = getCoverageFunction(
+      "ldc.cover_merge_shards",
+      LLFunctionType::get(LLType::getVoidTy(context),
+                          {voidPtrTy, LLType::getInt1Ty(context)}, false));
+  LLFunction *fn = fnAndIsNew.first;
+  if (!fnAndIsNew.second) {
+    return fn;
+  }
+
+  LLStructType *shardTy = getCoverageShardType();
+  LLType *i32Ty = LLType::getInt32Ty(context);
+  auto entrybb = llvm::BasicBlock::Create(context, "", fn);
+  auto shardbb = llvm::BasicBlock::Create(context, "shard", fn);
+  auto loopbb = llvm::BasicBlock::Create(context, "loop", fn);
+  auto mergebb = llvm::BasicBlock::Create(context, "merge", fn);
+  auto nextbb = llvm::BasicBlock::Create(context, "next", fn);
+  auto detachbb = llvm::BasicBlock::Create(context, "detach", fn);
+  auto advancebb = llvm::BasicBlock::Create(context, "advance", fn);
+  auto exitbb = llvm::BasicBlock::Create(context, "exit", fn);
+
+  auto args = fn->arg_begin();
+  LLValue *first = &*args++;
+  LLValue *detach = &*args;
+
+  IRBuilder<> builder(entrybb);
+  builder.CreateCondBr(builder.CreateIsNull(first), exitbb, shardbb);
+
+  // for (shard = shards; shard; shard = shard.next)
+  builder.SetInsertPoint(shardbb);
+  auto shardPhi = builder.CreatePHI(voidPtrTy, 2, "shard");
+  shardPhi->addIncoming(first, entrybb);
+  LLValue *shard = builder.CreateBitCast(shardPhi, shardTy->getPointerTo());
+  LLValue *data =
+      builder.CreateLoad(builder.CreateStructGEP(shardTy, shard, 1));
+  LLValue *counts =
+      builder.CreateLoad(builder.CreateStructGEP(shardTy, shard, 2));
+  LLValue *numlines =
+      builder.CreateLoad(builder.CreateStructGEP(shardTy, shard, 3));
+  builder.CreateBr(loopbb);
+
+  //   for (i = 0; i < shard.numlines; ++i)
+  builder.SetInsertPoint(loopbb);
+  auto i = builder.CreatePHI(DtoSize_t(), 2, "i");
+  i->addIncoming(DtoConstSize_t(0), shardbb);
+  LLValue *countPtr = builder.CreateInBoundsGEP(i32Ty, counts, i);
+  auto count = builder.CreateLoad(countPtr, "count");
+  count->setAtomic(llvm::AtomicOrdering::Monotonic);
+  count->setAlignment(LLAlign(4));
+  builder.CreateCondBr(builder.CreateICmpNE(count, DtoConstUint(0)), mergebb,
+                       nextbb);
+
+  //     if (count) { atomicOp!"+="(data[i], count); counts[i] = 0; }
+  builder.SetInsertPoint(mergebb);
+  builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add,
+                          builder.CreateInBoundsGEP(i32Ty, data, i), count,
+                          llvm::AtomicOrdering::Monotonic);
+  auto reset = builder.CreateStore(DtoConstUint(0), countPtr);
+  reset->setAtomic(llvm::AtomicOrdering::Monotonic);
+  reset->setAlignment(LLAlign(4));
+  builder.CreateBr(nextbb);
+
+  builder.SetInsertPoint(nextbb);
+  LLValue *inc = builder.CreateAdd(i, DtoConstSize_t(1));
+  i->addIncoming(inc, nextbb);
+  builder.CreateCondBr(builder.CreateICmpEQ(inc, numlines), detachbb, loopbb);
+
+  //   if (detach) *shard.dataPtr = null;
+  // Lines executed by later thread-exit callbacks register the shard again.
+  builder.SetInsertPoint(detachbb);
+  auto storebb = llvm::BasicBlock::Create(context, "detach.store", fn,
+                                          advancebb);
+  builder.CreateCondBr(detach, storebb, advancebb);
+  builder.SetInsertPoint(storebb);
+  builder.CreateStore(
+      getNullPtr(voidPtrTy),
+      builder.CreateLoad(builder.CreateStructGEP(shardTy, shard, 4)));
+  builder.CreateBr(advancebb);
+
+  builder.SetInsertPoint(advancebb);
+  LLValue *next =
+      builder.CreateLoad(builder.CreateStructGEP(shardTy, shard, 0));
+  shardPhi->addIncoming(next, advancebb);
+  builder.CreateCondBr(builder.CreateIsNull(next), exitbb, shardbb);
+
+  builder.SetInsertPoint(exitbb);
+  builder.CreateRetVoid();
+
+  return fn;
+}
+
+// void ldc.cover_thread_exit(void* thread): the thread-exit callback
+LLFunction *getCoverageThreadExit() {
+  auto &context = gIR->context();
+  LLType *voidPtrTy = getVoidPtrType();
+  auto fnAndIsNew = getCoverageFunction(
+      "ldc.cover_thread_exit",
+      LLFunctionType::get(LLType::getVoidTy(context), {voidPtrTy}, false));
+  LLFunction *fn = fnAndIsNew.first;
+  if (!fnAndIsNew.second) {
+    return fn;
+  }
+  if (global.params.targetTriple->isOSWindows()) {
+    fn->setCallingConv(gABI->callingConv(LINK::windows));
+  }
+
+  LLStructType *threadTy = getCoverageThreadType();
+  LLType *threadPtrTy = threadTy->getPointerTo();
+  auto threads = getCoverageGlobal("ldc.cover_threads", voidPtrTy);
+
+  IRBuilder<> builder(llvm::BasicBlock::Create(context, "", fn));
+  LLValue *thread = builder.CreateBitCast(&*fn->arg_begin(), threadPtrTy);
+  emitCoverageLock(builder);
+
+  LLValue *shardsPtr = builder.CreateStructGEP(threadTy, thread, 2);
+  builder.CreateCall(getCoverageMergeShards(),
+                     {builder.CreateLoad(shardsPtr, "shards"),
+                      llvm::ConstantInt::getTrue(context)});
+  builder.CreateStore(getNullPtr(voidPtrTy), shardsPtr);
+
+  // Unlink the thread from ldc.cover_threads.
+  LLValue *next =
+      builder.CreateLoad(builder.CreateStructGEP(threadTy, thread, 0), "next");
+  LLValue *prev =
+      builder.CreateLoad(builder.CreateStructGEP(threadTy, thread, 1), "prev");
+  auto prevbb = llvm::BasicBlock::Create(context, "prev", fn);
+  auto headbb = llvm::BasicBlock::Create(context, "head", fn);
+  auto unlinkbb = llvm::BasicBlock::Create(context, "unlink", fn);
+  auto nextbb = llvm::BasicBlock::Create(context, "next", fn);
+  auto exitbb = llvm::BasicBlock::Create(context, "exit", fn);
+  builder.CreateCondBr(builder.CreateIsNull(prev), headbb, prevbb);
+
+  builder.SetInsertPoint(prevbb);
+  builder.CreateStore(
+      next, builder.CreateStructGEP(
+                threadTy, builder.CreateBitCast(prev, threadPtrTy), 0));
+  builder.CreateBr(unlinkbb);
+
+  builder.SetInsertPoint(headbb);
+  builder.CreateStore(next, threads);
+  builder.CreateBr(unlinkbb);
+
+  builder.SetInsertPoint(unlinkbb);
+  builder.CreateCondBr(builder.CreateIsNull(next), exitbb, nextbb);
+
+  builder.SetInsertPoint(nextbb);
+  builder.CreateStore(
+      prev, builder.CreateStructGEP(
+                threadTy, builder.CreateBitCast(next, threadPtrTy), 1));
+  builder.CreateBr(exitbb);
+
+  builder.SetInsertPoint(exitbb);
+  emitCoverageUnlock(builder);
+  builder.CreateRetVoid();
+
+  return fn;
+}
+
+// void ldc.cover_init_key(): creates the thread-exit key on first call
+LLFunction *getCoverageInitKey() {
+  auto &context = gIR->context();
+  auto fnAndIsNew = getCoverageFunction(
+      "ldc.cover_init_key",
+      LLFunctionType::get(LLType::getVoidTy(context), false));
+  LLFunction *fn = fnAndIsNew.first;
+  if (!fnAndIsNew.second) {
+    return fn;
+  }
+
+  LLType *i32Ty = LLType::getInt32Ty(context);
+  LLType *voidPtrTy = getVoidPtrType();
+  auto key = getCoverageGlobal("ldc.cover_key", getCoverageKeyType());
+  // 0: not created yet, 1: created, 2: creation failed
+  auto keyState = getCoverageGlobal("ldc.cover_key_state", i32Ty);
+
+  auto entrybb = llvm::BasicBlock::Create(context, "", fn);
+  auto createbb = llvm::BasicBlock::Create(context, "create", fn);
+  auto exitbb = llvm::BasicBlock::Create(context, "exit", fn);
+
+  IRBuilder<> builder(entrybb);
+  builder.CreateCondBr(
+      builder.CreateICmpEQ(builder.CreateLoad(keyState), DtoConstUint(0)),
+      createbb, exitbb);
+
+  builder.SetInsertPoint(createbb);
+  LLValue *callback = builder.CreateBitCast(getCoverageThreadExit(), voidPtrTy);
+  LLValue *success = nullptr;
+  if (global.params.targetTriple->isOSWindows()) {
+    // ldc.cover_key = FlsAlloc(&ldc.cover_thread_exit)
+    LLFunction *alloc = getRuntimeFunction(Loc(), gIR->module, "FlsAlloc");
+    auto call = builder.CreateCall(alloc, {callback});
+    call->setCallingConv(alloc->getCallingConv());
+    builder.CreateStore(call, key);
+    // FLS_OUT_OF_INDEXES
+    success = builder.CreateICmpNE(call, DtoConstUint(0xFFFFFFFF));
+  } else {
+    // pthread_key_create(&ldc.cover_key, &ldc.cover_thread_exit)
+    LLFunction *create =
+        getRuntimeFunction(Loc(), gIR->module, "pthread_key_create");
+    auto call = builder.CreateCall(
+        create, {builder.CreateBitCast(key, voidPtrTy), callback});
+    call->setCallingConv(create->getCallingConv());
+    success = builder.CreateICmpEQ(call, DtoConstInt(0));
+  }
+  builder.CreateStore(
+      builder.CreateSelect(success, DtoConstUint(1), DtoConstUint(2)),
+      keyState);
+  builder.CreateBr(exitbb);
+
+  builder.SetInsertPoint(exitbb);
+  builder.CreateRetVoid();
+
+  return fn;
+}
+
+// bool ldc.cover_add_shard(void* shard): registers a module's shard for the
+// calling thread. Returns false if there's no thread-exit key to merge the
+// shard with, in which case the thread counts in _d_cover_data directly.
+LLFunction *getCoverageAddShard() {
+  auto &context = gIR->context();
+  LLType *voidPtrTy = getVoidPtrType();
+  auto fnAndIsNew = getCoverageFunction(
+      "ldc.cover_add_shard",
+      LLFunctionType::get(LLType::getInt1Ty(context), {voidPtrTy}, false));
+  LLFunction *fn = fnAndIsNew.first;
+  if (!fnAndIsNew.second) {
+    return fn;
+  }
+  fn->addFnAttr(llvm::Attribute::Cold);
+  fn->addFnAttr(llvm::Attribute::NoInline);
+
+  const bool isWindows = global.params.targetTriple->isOSWindows();
+  LLType *i32Ty = LLType::getInt32Ty(context);
+  LLStructType *shardTy = getCoverageShardType();
+  LLStructType *threadTy = getCoverageThreadType();
+  auto key = getCoverageGlobal("ldc.cover_key", getCoverageKeyType());
+  auto keyState = getCoverageGlobal("ldc.cover_key_state", i32Ty);
+  auto threads = getCoverageGlobal("ldc.cover_threads", voidPtrTy);
+  auto thread = getCoverageGlobal("ldc.cover_thread", threadTy,
+                                  /*isThreadLocal=*/true);
+
+  auto entrybb = llvm::BasicBlock::Create(context, "", fn);
+  auto registerbb = llvm::BasicBlock::Create(context, "register", fn);
+  auto linkbb = llvm::BasicBlock::Create(context, "link", fn);
+  auto headbb = llvm::BasicBlock::Create(context, "head", fn);
+  auto addbb = llvm::BasicBlock::Create(context, "add", fn);
+  auto failedbb = llvm::BasicBlock::Create(context, "failed", fn);
+  auto nokeybb = llvm::BasicBlock::Create(context, "nokey", fn);
+
+  IRBuilder<> builder(entrybb);
+  builder.CreateCondBr(
+      builder.CreateICmpEQ(builder.CreateLoad(keyState), DtoConstUint(1)),
+      registerbb, nokeybb);
+
+  builder.SetInsertPoint(registerbb);
+  emitCoverageLock(builder);
+  LLValue *threadVoidPtr = builder.CreateBitCast(thread, voidPtrTy);
+  LLValue *shardsPtr = builder.CreateStructGEP(threadTy, thread, 2);
+  LLValue *shards = builder.CreateLoad(shardsPtr, "shards");
+  builder.CreateCondBr(builder.CreateIsNull(shards), linkbb, addbb);
+
+  // The thread's first shard: FlsSetValue / pthread_setspecific(ldc.cover_key,
+  // &ldc.cover_thread), then link it into ldc.cover_threads.
+  builder.SetInsertPoint(linkbb);
+  LLFunction *setValue = getRuntimeFunction(
+      Loc(), gIR->module, isWindows ? "FlsSetValue" : "pthread_setspecific");
+  auto call = builder.CreateCall(
+      setValue, {builder.CreateLoad(key, "key"), threadVoidPtr});
+  call->setCallingConv(setValue->getCallingConv());
+  LLValue *success = isWindows ? builder.CreateICmpNE(call, DtoConstInt(0))
+                               : builder.CreateICmpEQ(call, DtoConstInt(0));
+  auto insertbb = llvm::BasicBlock::Create(context, "insert", fn, headbb);
+  builder.CreateCondBr(success, insertbb, failedbb);
+
+  builder.SetInsertPoint(insertbb);
+  LLValue *head = builder.CreateLoad(threads, "head");
+  builder.CreateStore(head, builder.CreateStructGEP(threadTy, thread, 0));
+  builder.CreateStore(getNullPtr(voidPtrTy),
+                      builder.CreateStructGEP(threadTy, thread, 1));
+  builder.CreateStore(threadVoidPtr, threads);
+  builder.CreateCondBr(builder.CreateIsNull(head), addbb, headbb);
+
+  builder.SetInsertPoint(headbb);
+  builder.CreateStore(threadVoidPtr,
+                      builder.CreateStructGEP(
+                          threadTy,
+                          builder.CreateBitCast(head, threadTy->getPointerTo()),
+                          1));
+  builder.CreateBr(addbb);
+
+  // shard.next = ldc.cover_thread.shards; ldc.cover_thread.shards = shard;
+  builder.SetInsertPoint(addbb);
+  LLValue *shard = &*fn->arg_begin();
+  LLValue *shardNextPtr = builder.CreateStructGEP(
+      shardTy, builder.CreateBitCast(shard, shardTy->getPointerTo()), 0);
+  builder.CreateStore(builder.CreateLoad(shardsPtr), shardNextPtr);
+  builder.CreateStore(shard, shardsPtr);
+  emitCoverageUnlock(builder);
+  builder.CreateRet(llvm::ConstantInt::getTrue(context));
+
+  builder.SetInsertPoint(failedbb);
+  emitCoverageUnlock(builder);
+  builder.CreateBr(nokeybb);
+
+  builder.SetInsertPoint(nokeybb);
+  builder.CreateRet(llvm::ConstantInt::getFalse(context));
+
+  return fn;
+}
+
+// void ldc.cover_merge_threads(): the `ldc.cover` ModuleInfo TLS dtor, merging
+// the shards of all live threads when the main thread terminates
+LLFunction *getCoverageMergeThreads() {
+  auto &context = gIR->context();
+  auto fnAndIsNew = getCoverageFunction(
+      "ldc.cover_merge_threads",
+      LLFunctionType::get(LLType::getVoidTy(context), false));
+  LLFunction *fn = fnAndIsNew.first;
+  if (!fnAndIsNew.second) {
+    return fn;
+  }
+  fn->setCallingConv(gABI->callingConv(LINK::d));
+
+  LLType *voidPtrTy = getVoidPtrType();
+  LLStructType *threadTy = getCoverageThreadType();
+  auto isMainThread = getCoverageGlobal(
+      "ldc.cover_main_thread", LLType::getInt8Ty(context),
+      /*isThreadLocal=*/true);
+  auto threads = getCoverageGlobal("ldc.cover_threads", voidPtrTy);
+
+  auto entrybb = llvm::BasicBlock::Create(context, "", fn);
+  auto mergebb = llvm::BasicBlock::Create(context, "merge", fn);
+  auto exitbb = llvm::BasicBlock::Create(context, "exit", fn);
+
+  IRBuilder<> builder(entrybb);
+  builder.CreateCondBr(
+      builder.CreateICmpNE(builder.CreateLoad(isMainThread),
+                           DtoConstUbyte(0)),
+      mergebb, exitbb);
+
+  builder.SetInsertPoint(mergebb);
+  emitCoverageLock(builder);
+  LLValue *first = builder.CreateLoad(threads, "first");
+  llvm::BasicBlock *lockedbb = builder.GetInsertBlock();
+  auto loopbb = llvm::BasicBlock::Create(context, "loop", fn, exitbb);
+  auto unlockbb = llvm::BasicBlock::Create(context, "unlock", fn, exitbb);
+  builder.CreateCondBr(builder.CreateIsNull(first), unlockbb, loopbb);
+
+  // for (thread = ldc.cover_threads; thread; thread = thread.next)
+  //   ldc.cover_merge_shards(thread.shards, false);
+  // The other threads keep counting (without atomics), so increments racing
+  // with the merge may be lost.
+  builder.SetInsertPoint(loopbb);
+  auto threadPhi = builder.CreatePHI(voidPtrTy, 2, "thread");
+  threadPhi->addIncoming(first, lockedbb);
+  LLValue *thread =
+      builder.CreateBitCast(threadPhi, threadTy->getPointerTo());
+  builder.CreateCall(
+      getCoverageMergeShards(),
+      {builder.CreateLoad(builder.CreateStructGEP(threadTy, thread, 2)),
+       llvm::ConstantInt::getFalse(context)});
+  LLValue *next =
+      builder.CreateLoad(builder.CreateStructGEP(threadTy, thread, 0));
+  threadPhi->addIncoming(next, loopbb);
+  builder.CreateCondBr(builder.CreateIsNull(next), unlockbb, loopbb);
+
+  builder.SetInsertPoint(unlockbb);
+  emitCoverageUnlock(builder);
+  builder.CreateBr(exitbb);
+
+  builder.SetInsertPoint(exitbb);
+  builder.CreateRetVoid();
+
+  return fn;
+}
+
+// Add a thread-local copy of _d_cover_data for -cov=sharded, see above.
+// Returns the function to be called by the coverage ctor.
+LLFunction *addCoverageDataShard(Module *m) {
+  IF_LOG Logger::println("Build private TLS variable: uint[%d] "
+                         "_d_cover_data_shard",
+                         m->numlines);
+
+  auto &context = gIR->context();
+  LLType *i32Ty = LLType::getInt32Ty(context);
+  LLType *voidPtrTy = getVoidPtrType();
+  IrModule *irm = getIrModule(m);
+
+  LLArrayType *type = LLArrayType::get(i32Ty, m->numlines);
+  auto shard = new llvm::GlobalVariable(
+      gIR->module, type, false, LLGlobalValue::InternalLinkage,
+      llvm::ConstantAggregateZero::get(type), "_d_cover_data_shard", nullptr,
+      llvm::GlobalVariable::GeneralDynamicTLSModel);
+  LLPointerType *ptrType = type->getPointerTo();
+  auto dataPtr = new llvm::GlobalVariable(
+      gIR->module, ptrType, false, LLGlobalValue::InternalLinkage,
+      getNullPtr(ptrType), "_d_cover_data_ptr", nullptr,
+      llvm::GlobalVariable::GeneralDynamicTLSModel);
+  irm->coverageDataPtr = dataPtr;
+  LLStructType *shardTy = getCoverageShardType();
+  auto shardInfo = new llvm::GlobalVariable(
+      gIR->module, shardTy, false, LLGlobalValue::InternalLinkage,
+      llvm::ConstantAggregateZero::get(shardTy), "_d_cover_data_shard_info",
+      nullptr, llvm::GlobalVariable::GeneralDynamicTLSModel);
+
+  const auto createFunction = [&](LLType *returnTy, const char *name) {
+    auto fn = LLFunction::Create(LLFunctionType::get(returnTy, false),
+                                 LLGlobalValue::InternalLinkage, name,
+                                 &gIR->module);
+    if (global.params.targetTriple->getArch() == llvm::Triple::x86_64) {
+      fn->addFnAttr(LLAttribute::UWTable);
+    }
+    return fn;
+  };
+
+  // uint[]* ldc.cover_shard_init(): called on a thread's first counter update
+  LLFunction *init = createFunction(ptrType, "ldc.cover_shard_init");
+  init->addFnAttr(llvm::Attribute::Cold);
+  init->addFnAttr(llvm::Attribute::NoInline);
+  {
+    IRBuilder<> builder(llvm::BasicBlock::Create(context, "", init));
+    // The shard info refers to thread-local addresses, so it is initialized
+    // here.
+    LLValue *fields[] = {
+        getNullPtr(voidPtrTy),
+        builder.CreateBitCast(m->d_cover_data, getCoverageCountsType()),
+        builder.CreateBitCast(shard, getCoverageCountsType()),
+        DtoConstSize_t(m->numlines),
+        builder.CreateBitCast(dataPtr, voidPtrTy->getPointerTo())};
+    for (unsigned i = 0; i < 5; ++i) {
+      builder.CreateStore(fields[i],
+                          builder.CreateStructGEP(shardTy, shardInfo, i));
+    }
+    LLValue *added = builder.CreateCall(
+        getCoverageAddShard(), {builder.CreateBitCast(shardInfo, voidPtrTy)});
+    LLValue *counters =
+        builder.CreateSelect(added, shard, m->d_cover_data, "counters");
+    builder.CreateStore(counters, dataPtr);
+    builder.CreateRet(counters);
+  }
+  irm->coverageShardInit = init;
+
+  // void ldc.cover_shard_register(): called by the coverage ctor on the main
+  // thread
+  LLFunction *reg =
+      createFunction(LLType::getVoidTy(context), "ldc.cover_shard_register");
+  {
+    IRBuilder<> builder(llvm::BasicBlock::Create(context, "", reg));
+    builder.CreateCall(getCoverageInitKey(), {});
+    builder.CreateStore(DtoConstUbyte(1),
+                        getCoverageGlobal("ldc.cover_main_thread",
+                                          LLType::getInt8Ty(context),
+                                          /*isThreadLocal=*/true));
+    builder.CreateStore(m->d_cover_data, dataPtr);
+    builder.CreateRetVoid();
+  }
+
+  return reg;
+}
+
 // Add module-private variables and functions for coverage analysis.
 void addCoverageAnalysis(Module *m) {
   IF_LOG {
@@ -445,6 +1010,14 @@ void addCoverageAnalysis(Module *m) {
                                        DtoGEP(m->d_cover_data, 0, 0));
   }
 
+  // -cov=sharded: uint[# source lines] _d_cover_data_shard (thread-local),
+  // added to _d_cover_data when the thread terminates.
+  LLFunction *registerShards = nullptr;
+  if (opts::coverageIncrement == opts::CoverageIncrement::sharded &&
+      m->numlines > 0) {
+    registerShards = addCoverageDataShard(m);
+  }
+
   // Create "static constructor" that calls _d_cover_register2(string filename,
   // size_t[] valid, uint[] data, ubyte minPercent)
   // Build ctor name
@@ -486,6 +1059,10 @@ void addCoverageAnalysis(Module *m) {
 
     builder.CreateCall(fn, args);
 
+    if (registerShards) {
+      builder.CreateCall(registerShards, {});
+    }
+
     builder.CreateRetVoid();
   }
 
@@ -513,26 +1090,48 @@ void addCoverageAnalysisInitializer(Module *m) {
   m->d_cover_valid->setInitializer(llvm::ConstantArray::get(type, arrayInits));
 }
 
-// Load InstrProf data from file and store in it IrState
-// TODO: This is probably not the right place, we should load it once for all
-// modules?
-void loadInstrProfileData(IRState *irs) {
-  // Only load from datafileInstrProf if we are doing frontend-based PGO.
-  if (opts::isUsingASTBasedPGOProfile() && global.params.datafileInstrProf) {
-    IF_LOG Logger::println("Read profile data from %s",
-                           global.params.datafileInstrProf);
+namespace {
+/// Returns the process-wide reader of the AST-based PGO profile, creating it
+/// on first use. The profile file is memory-mapped and only read on demand, so
+/// sharing a single reader across all modules avoids re-opening (and paging
+/// in) the whole file for each of them. Record lookups do mutate the reader
+/// (its record buffer) and are serialized in gen/pgo_ASTbased.cpp.
+llvm::IndexedInstrProfReader *getSharedInstrProfReader(IRState *irs) {
+  static std::unique_ptr<llvm::IndexedInstrProfReader> reader = [irs] {
+    const char *filename = global.params.datafileInstrProf;
+    ::TimeTraceScope timeScope("Load profile data", llvm::StringRef(filename));
+    IF_LOG Logger::println("Read profile data from %s", filename);
+
+    auto reportError = [&](const std::string &message) {
+      irs->dmodule->error("Could not read profile file '%s': %s", filename,
+                          message.c_str());
+      fatal();
+    };
+
+    // Don't require a null terminator so that the buffer can be mmap'ed.
+    auto bufferOrErr = llvm::MemoryBuffer::getFile(
+        filename, /*FileSize=*/-1, /*RequiresNullTerminator=*/false);
+    if (!bufferOrErr)
+      reportError(bufferOrErr.getError().message());
 
     auto readerOrErr =
-        llvm::IndexedInstrProfReader::create(global.params.datafileInstrProf);
+        llvm::IndexedInstrProfReader::create(std::move(bufferOrErr.get()));
     if (auto E = readerOrErr.takeError()) {
       handleAllErrors(std::move(E), [&](const llvm::ErrorInfoBase &EI) {
-        irs->dmodule->error("Could not read profile file '%s': %s",
-                            global.params.datafileInstrProf,
-                            EI.message().c_str());
+        reportError(EI.message());
       });
-      fatal();
     }
-    irs->PGOReader = std::move(readerOrErr.get());
+    return std::move(readerOrErr.get());
+  }();
+  return reader.get();
+}
+} // anonymous namespace
+
+// Attach the InstrProf data, loaded once for all modules, to the IrState.
+void loadInstrProfileData(IRState *irs) {
+  // Only load from datafileInstrProf if we are doing frontend-based PGO.
+  if (opts::isUsingASTBasedPGOProfile() && global.params.datafileInstrProf) {
+    irs->PGOReader = getSharedInstrProfReader(irs);
 
     if (!irs->module.getProfileSummary(
 #if LDC_LLVM_VER >= 900
@@ -555,6 +1154,36 @@ void loadInstrProfileData(IRState *irs) {
   }
 }
 
+// Emits the ModuleInfo of the `ldc.cover` pseudo-module for -cov=sharded. It
+// has no imports and a TLS dtor only, and is shared by all modules of a DSO.
+void emitCoverageModuleInfo(RegistryStyle style) {
+  const char *name = "ldc.cover_moduleinfo";
+  if (gIR->module.getGlobalVariable(name, true)) {
+    return;
+  }
+
+  // The variable-length ModuleInfo record, see genModuleInfo().
+  LLConstant *fields[] = {
+      DtoConstUint(0x80000000 | 0x10), // MInew | MItlsdtor
+      DtoConstUint(0),                 // index
+      getCoverageMergeThreads(),
+      llvm::ConstantDataArray::getString(gIR->context(), "ldc.cover")};
+  auto moduleInfo = defineDSOGlobal(
+      name, LLConstantStruct::getAnon(gIR->context(), fields));
+
+  // Every object file referencing the ModuleInfo must contribute the same
+  // single reference to the .minfo section.
+  auto mref = defineDSOGlobal(
+      "ldc.cover_moduleref",
+      DtoBitCast(moduleInfo, DtoPtrToType(getModuleInfoType())));
+  mref->setSection(getModuleInfoRefsSectionName(style));
+  if (!global.params.targetTriple->isOSBinFormatMachO()) {
+    moduleInfo->setComdat(gIR->module.getOrInsertComdat(name));
+    mref->setComdat(gIR->module.getOrInsertComdat(mref->getName()));
+  }
+  gIR->usedArray.push_back(mref);
+}
+
 void registerModuleInfo(Module *m) {
   const auto moduleInfoSym = genModuleInfo(m);
   const auto style = getModuleRegistryStyle();
@@ -568,6 +1197,12 @@ void registerModuleInfo(Module *m) {
     AppendFunctionToLLVMGlobalCtorsDtors(miCtor, 65535, true);
   } else {
     emitModuleRefToSection(style, mangle, moduleInfoSym);
+
+    // -cov=sharded: the DSO's `ldc.cover` ModuleInfo merging the shards of the
+    // live threads at exit, see addCoverageDataShard().
+    if (getIrModule(m)->coverageDataPtr) {
+      emitCoverageModuleInfo(style);
+    }
   }
 }
 }
@@ -621,6 +1256,8 @@ void codegenModule(IRState *irs, Module *m) {
     addCoverageAnalysisInitializer(m);
   }
 
+  defineInstrumentFunctionsEnabledFlag(irs->module);
+
   gIR = nullptr;
   irs->dmodule = nullptr;
 }
@@ -240,6 +240,18 @@ static void addSanitizerCoveragePass(const PassManagerBuilder &Builder,
 #endif
 }
 
+static void addAddDiscriminatorsPass(const PassManagerBuilder &Builder,
+                                     legacy::PassManagerBase &PM) {
+  PM.add(createAddDiscriminatorsPass());
+}
+
+#if LDC_LLVM_VER >= 900
+static void addHotColdSplittingPass(const PassManagerBuilder &Builder,
+                                    legacy::PassManagerBase &PM) {
+  PM.add(createHotColdSplittingPass());
+}
+#endif
+
 // Adds PGO instrumentation generation and use passes.
 static void addPGOPasses(PassManagerBuilder &builder,
                          legacy::PassManagerBase &mpm, unsigned optLevel) {
@@ -260,6 +272,18 @@ static void addPGOPasses(PassManagerBuilder &builder,
     builder.PGOInstrGen = global.params.datafileInstrProf;
   } else if (opts::isUsingIRBasedPGOProfile()) {
     builder.PGOInstrUse = global.params.datafileInstrProf;
+#if LDC_LLVM_VER >= 900
+    // Context-sensitive PGO: the second-stage instrumentation after inlining,
+    // or the use of a profile which has been merged with its results.
+    if (opts::isInstrumentingForCSPGO()) {
+      builder.EnablePGOCSInstrGen = true;
+      builder.PGOInstrGen = opts::csPGOInstrGenFile;
+    } else if (opts::isUsingCSPGOProfile()) {
+      builder.EnablePGOCSInstrUse = true;
+    }
+#endif
+  } else if (opts::isUsingSampleBasedPGOProfile()) {
+    builder.PGOSampleUse = global.params.datafileInstrProf;
   }
 }
 
@@ -338,6 +362,13 @@ static void addOptimizationPasses(legacy::PassManagerBase &mpm,
                          addSanitizerCoveragePass);
   }
 
+  // Distinguish multiple basic blocks on the same source line, for sampling
+  // profilers to attribute samples to the right blocks.
+  if (opts::debugInfoForProfiling || opts::isUsingSampleBasedPGOProfile()) {
+    builder.addExtension(PassManagerBuilder::EP_EarlyAsPossible,
+                         addAddDiscriminatorsPass);
+  }
+
   if (!disableLangSpecificPasses) {
     if (!disableSimplifyDruntimeCalls) {
       builder.addExtension(PassManagerBuilder::EP_LoopOptimizerEnd,
@@ -350,6 +381,16 @@ static void addOptimizationPasses(legacy::PassManagerBase &mpm,
     }
   }
 
+#if LDC_LLVM_VER >= 900
+  // Outline the code that the profile shows to be cold into separate (cold)
+  // functions. For LTO, this is done by the linker plugin.
+  if (opts::profileFunctionLayout && opts::isUsingPGOProfile() &&
+      optLevel > 0 && !opts::isUsingLTO()) {
+    builder.addExtension(PassManagerBuilder::EP_OptimizerLast,
+                         addHotColdSplittingPass);
+  }
+#endif
+
   // EP_OptimizerLast does not exist in LLVM 3.0, add it manually below.
   builder.addExtension(PassManagerBuilder::EP_OptimizerLast,
                        addStripExternalsPass);
@@ -33,12 +33,37 @@
 #include "llvm/Support/Endian.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/MD5.h"
+#include <algorithm>
+#include <mutex>
 
 namespace {
 llvm::cl::opt<bool, false, opts::FlagParser<bool>> enablePGOIndirectCalls(
     "pgo-indirect-calls", llvm::cl::ZeroOrMore, llvm::cl::Hidden,
     llvm::cl::desc("(*) Enable PGO of indirect calls"),
     llvm::cl::init(true));
+
+llvm::cl::opt<bool, false, opts::FlagParser<bool>> enablePGOSizes(
+    "pgo-sizes", llvm::cl::ZeroOrMore, llvm::cl::Hidden,
+    llvm::cl::desc("(*) Enable PGO of copy and allocation sizes"),
+    llvm::cl::init(true));
+
+llvm::cl::opt<unsigned> pgoSizePercentThreshold(
+    "pgo-size-percent-threshold", llvm::cl::ZeroOrMore, llvm::cl::Hidden,
+    llvm::cl::desc("Minimum percentage of executions with the same size for "
+                   "specializing a copy or allocation for that size"),
+    llvm::cl::init(80));
+
+llvm::cl::opt<unsigned> pgoSizeCountThreshold(
+    "pgo-size-count-threshold", llvm::cl::ZeroOrMore, llvm::cl::Hidden,
+    llvm::cl::desc("Minimum execution count of a size for specializing a copy "
+                   "or allocation for that size"),
+    llvm::cl::init(1000));
+
+llvm::cl::opt<bool> enableStaleProfileMatching(
+    "fprofile-stale-matching", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Salvage profile data of functions whose control flow "
+                   "changed since profiling (AST-based PGO). Use -wi to "
+                   "report matched, partially matched and dropped functions"));
 }
 
 /// \brief Stable hasher for PGO region counters.
@@ -147,8 +172,124 @@ public:
     MD5.final(Result);
     return Result.low();
   }
+
+  /// Recovers the sequence of \p Count hash types that produced \p Hash.
+  /// This is only possible for small functions, whose hash is the packed
+  /// sequence itself rather than an MD5 digest. Returns false otherwise.
+  static bool decode(uint64_t Hash, unsigned Count,
+                     std::vector<unsigned char> &Types) {
+    if (Count > NumTypesPerWord)
+      return false;
+    Types.assign(Count, None);
+    for (unsigned i = Count; i-- > 0;) {
+      unsigned Type = Hash & (TooBig - 1);
+      if (Type == None || Type >= LastHashType)
+        return false;
+      Types[i] = static_cast<unsigned char>(Type);
+      Hash >>= NumBitsPerType;
+    }
+    return Hash == 0;
+  }
 };
 
+namespace {
+/// The outcome of matching stale profile data to a function.
+enum class StaleMatch { Dropped, Ends, Positional, Partial, Matched };
+
+/// Maps the counters of a stale profile record with hash \p StaleHash onto the
+/// region counters of a function whose counters have the hash types
+/// \p Kinds. The entry counter always maps. The other counters are aligned
+/// by hash type and relative position (longest common subsequence) when the
+/// stale type sequence can be recovered from the hash, or by position alone
+/// otherwise. If the number of counters changed, the position of the change is
+/// unknown, so the first half of the counters is aligned from the start and the
+/// others from the end. Counters without a stale counterpart are set to zero.
+StaleMatch alignStaleCounters(llvm::ArrayRef<unsigned char> Kinds,
+                              uint64_t StaleHash,
+                              llvm::ArrayRef<uint64_t> StaleCounts,
+                              std::vector<uint64_t> &Counts,
+                              unsigned &NumMatched) {
+  NumMatched = 0;
+  if (StaleCounts.empty())
+    return StaleMatch::Dropped;
+
+  std::vector<unsigned char> StaleKinds;
+  const size_t N = StaleCounts.size() - 1, M = Kinds.size();
+  if (!PGOHash::decode(StaleHash, N, StaleKinds)) {
+    if (N == M) {
+      Counts.assign(StaleCounts.begin(), StaleCounts.end());
+      NumMatched = M;
+      return StaleMatch::Positional;
+    }
+    Counts.assign(M + 1, 0);
+    Counts[0] = StaleCounts[0];
+    NumMatched = std::min(N, M);
+    const size_t Front = NumMatched / 2;
+    for (size_t i = 0; i < Front; ++i)
+      Counts[i + 1] = StaleCounts[i + 1];
+    for (size_t i = 1; i <= NumMatched - Front; ++i)
+      Counts[M + 1 - i] = StaleCounts[N + 1 - i];
+    return StaleMatch::Ends;
+  }
+
+  Counts.assign(M + 1, 0);
+  Counts[0] = StaleCounts[0];
+
+  std::vector<unsigned> LCS((N + 1) * (M + 1), 0);
+  auto at = [&](size_t i, size_t j) -> unsigned & {
+    return LCS[i * (M + 1) + j];
+  };
+  for (size_t i = N; i-- > 0;) {
+    for (size_t j = M; j-- > 0;) {
+      at(i, j) = StaleKinds[i] == Kinds[j]
+                     ? at(i + 1, j + 1) + 1
+                     : std::max(at(i + 1, j), at(i, j + 1));
+    }
+  }
+  for (size_t i = 0, j = 0; i < N && j < M;) {
+    if (StaleKinds[i] == Kinds[j]) {
+      Counts[j + 1] = StaleCounts[i + 1];
+      ++NumMatched;
+      ++i;
+      ++j;
+    } else if (at(i + 1, j) >= at(i, j + 1)) {
+      ++i;
+    } else {
+      ++j;
+    }
+  }
+  return NumMatched == M ? StaleMatch::Matched : StaleMatch::Partial;
+}
+
+/// A profile record as needed for stale profile matching.
+struct StaleProfileRecord {
+  uint64_t Hash;
+  std::vector<uint64_t> Counts;
+};
+
+/// The profile reader is shared by all modules (see loadInstrProfileData()).
+/// Reading a record refills the reader's internal record buffer, so all
+/// lookups and iterations must be serialized.
+std::mutex PGOReaderMutex;
+
+/// Returns all records of the profile file, indexed by function name. The
+/// indexed reader can only look up records by name _and_ hash, so the whole
+/// profile is read once, when the first hash mismatch is encountered.
+const llvm::StringMap<std::vector<StaleProfileRecord>> &
+getStaleProfileRecords(llvm::IndexedInstrProfReader *PGOReader) {
+  static llvm::StringMap<std::vector<StaleProfileRecord>> Records;
+  static bool Loaded = false;
+  std::lock_guard<std::mutex> Lock(PGOReaderMutex);
+  if (Loaded)
+    return Records;
+  Loaded = true;
+
+  for (const auto &Record : *PGOReader)
+    Records[Record.Name].push_back({Record.Hash, Record.Counts});
+  return Records;
+}
+} // anonymous namespace
+
 ///////////////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -160,10 +301,17 @@ struct MapRegionCounters : public StoppableVisitor {
   PGOHash Hash;
   /// The map of statements to counters.
   llvm::DenseMap<const RootObject *, unsigned> &CounterMap;
+  /// The hash type of each counter after the function entry counter.
+  std::vector<unsigned char> Kinds;
 
   MapRegionCounters(llvm::DenseMap<const RootObject *, unsigned> &CounterMap)
       : NextCounter(0), CounterMap(CounterMap) {}
 
+  void combine(PGOHash::HashType Type) {
+    Hash.combine(Type);
+    Kinds.push_back(Type);
+  }
+
   using StoppableVisitor::visit;
 
 // FIXME: this macro should also stop deeper traversal at duplicate nodes, using
@@ -225,37 +373,37 @@ struct MapRegionCounters : public StoppableVisitor {
   void visit(IfStatement *stmt) override {
     SKIP_VISITED(stmt);
     CounterMap[stmt] = NextCounter++;
-    Hash.combine(PGOHash::IfStmt);
+    combine(PGOHash::IfStmt);
   }
 
   void visit(WhileStatement *stmt) override {
     SKIP_VISITED(stmt);
     CounterMap[stmt] = NextCounter++;
-    Hash.combine(PGOHash::WhileStmt);
+    combine(PGOHash::WhileStmt);
   }
 
   void visit(DoStatement *stmt) override {
     SKIP_VISITED(stmt);
     CounterMap[stmt] = NextCounter++;
-    Hash.combine(PGOHash::DoStmt);
+    combine(PGOHash::DoStmt);
   }
 
   void visit(ForStatement *stmt) override {
     SKIP_VISITED(stmt);
     CounterMap[stmt] = NextCounter++;
-    Hash.combine(PGOHash::ForStmt);
+    combine(PGOHash::ForStmt);
   }
 
   void visit(ForeachStatement *stmt) override {
     SKIP_VISITED(stmt);
     CounterMap[stmt] = NextCounter++;
-    Hash.combine(PGOHash::ForeachStmt);
+    combine(PGOHash::ForeachStmt);
   }
 
   void visit(ForeachRangeStatement *stmt) override {
     SKIP_VISITED(stmt);
     CounterMap[stmt] = NextCounter++;
-    Hash.combine(PGOHash::ForeachRangeStmt);
+    combine(PGOHash::ForeachRangeStmt);
   }
 
   void visit(UnrolledLoopStatement *stmt) override {
@@ -268,34 +416,34 @@ struct MapRegionCounters : public StoppableVisitor {
     // exit block of the 'loop'.
     SKIP_VISITED(stmt);
     CounterMap[stmt] = NextCounter++;
-    Hash.combine(PGOHash::UnrolledLoopIterationScope);
+    combine(PGOHash::UnrolledLoopIterationScope);
     for (auto s : *stmt->statements) {
       CounterMap[s] = NextCounter++;
-      Hash.combine(PGOHash::UnrolledLoopIterationScope);
+      combine(PGOHash::UnrolledLoopIterationScope);
     }
   }
 
   void visit(LabelStatement *stmt) override {
     SKIP_VISITED(stmt);
     CounterMap[stmt] = NextCounter++;
-    Hash.combine(PGOHash::LabelStmt);
+    combine(PGOHash::LabelStmt);
   }
 
   void visit(SwitchStatement *stmt) override {
     SKIP_VISITED(stmt);
     CounterMap[stmt] = NextCounter++;
-    Hash.combine(PGOHash::SwitchStmt);
+    combine(PGOHash::SwitchStmt);
   }
 
   void visit(CaseStatement *stmt) override {
     SKIP_VISITED(stmt);
     CounterMap[stmt] = NextCounter++;
-    Hash.combine(PGOHash::CaseStmt);
+    combine(PGOHash::CaseStmt);
     // Iff this statement is the target of a goto case statement, add an extra
     // counter for this case (as if it is a label statement).
     if (stmt->gototarget) {
       CounterMap[CodeGenPGO::getCounterPtr(stmt, 1)] = NextCounter++;
-      Hash.combine(PGOHash::CaseGoto);
+      combine(PGOHash::CaseGoto);
     }
   }
 
@@ -307,25 +455,25 @@ struct MapRegionCounters : public StoppableVisitor {
   void visit(DefaultStatement *stmt) override {
     SKIP_VISITED(stmt);
     CounterMap[stmt] = NextCounter++;
-    Hash.combine(PGOHash::DefaultStmt);
+    combine(PGOHash::DefaultStmt);
 
     // Iff this statement is the target of a goto case statement, add an extra
     // counter for this case (as if it is a label statement).
     if (stmt->gototarget) {
       CounterMap[CodeGenPGO::getCounterPtr(stmt, 1)] = NextCounter++;
-      Hash.combine(PGOHash::CaseGoto);
+      combine(PGOHash::CaseGoto);
     }
   }
 
   void visit(TryCatchStatement *stmt) override {
     SKIP_VISITED(stmt);
     CounterMap[stmt] = NextCounter++;
-    Hash.combine(PGOHash::TryCatchStmt);
+    combine(PGOHash::TryCatchStmt);
     // Note that this results in the exception counters obtaining their counter
     // numbers before recursing into the counter handlers:
     for (auto c : *stmt->catches) {
       CounterMap[c] = NextCounter++;
-      Hash.combine(PGOHash::TryCatchCatch);
+      combine(PGOHash::TryCatchCatch);
     }
   }
 
@@ -336,18 +484,18 @@ struct MapRegionCounters : public StoppableVisitor {
 
     SKIP_VISITED(stmt);
     CounterMap[stmt] = NextCounter++;
-    Hash.combine(PGOHash::TryFinallyStmt);
+    combine(PGOHash::TryFinallyStmt);
   }
   void visit(CondExp *expr) override {
     SKIP_VISITED(expr);
     CounterMap[expr] = NextCounter++;
-    Hash.combine(PGOHash::ConditionalExpr);
+    combine(PGOHash::ConditionalExpr);
   }
 
   void visit(LogicalExp *expr) override {
     SKIP_VISITED(expr);
     CounterMap[expr] = NextCounter++;
-    Hash.combine(expr->op == TOKandand ? PGOHash::AndAndExpr
+    combine(expr->op == TOKandand ? PGOHash::AndAndExpr
                                        : PGOHash::OrOrExpr);
   }
 
@@ -878,6 +1026,7 @@ void CodeGenPGO::mapRegionCounters(const FuncDeclaration *D) {
   assert(regioncounter.NextCounter == RegionCounterMap->size());
   NumRegionCounters = regioncounter.NextCounter;
   FunctionHash = regioncounter.Hash.finalize();
+  RegionCounterKinds = std::move(regioncounter.Kinds);
 }
 
 void CodeGenPGO::computeRegionCounts(const FuncDeclaration *FD) {
@@ -893,6 +1042,11 @@ void CodeGenPGO::applyFunctionAttributes(llvm::Function *Fn) {
 
   uint64_t FunctionCount = getRegionCount(nullptr);
   Fn->setEntryCount(FunctionCount);
+
+  // Functions that were never executed during profiling are moved out of the
+  // way of the hot code.
+  if (opts::profileFunctionLayout && FunctionCount == 0)
+    Fn->addFnAttr(llvm::Attribute::Cold);
 }
 
 void CodeGenPGO::emitCounterIncrement(const RootObject *S) const {
@@ -916,8 +1070,10 @@ void CodeGenPGO::loadRegionCounts(llvm::IndexedInstrProfReader *PGOReader,
                                   const FuncDeclaration *fd) {
   RegionCounts.clear();
 
-  llvm::Expected<llvm::InstrProfRecord> RecordExpected =
-      PGOReader->getInstrProfRecord(FuncName, FunctionHash);
+  llvm::Expected<llvm::InstrProfRecord> RecordExpected = [&] {
+    std::lock_guard<std::mutex> Lock(PGOReaderMutex);
+    return PGOReader->getInstrProfRecord(FuncName, FunctionHash);
+  }();
   auto EC = RecordExpected.takeError();
 
   if (EC) {
@@ -928,6 +1084,8 @@ void CodeGenPGO::loadRegionCounts(llvm::IndexedInstrProfReader *PGOReader,
       // Don't output a compiler warning when profile data is missing for a
       // function, because it could be intentional.
     } else if (IPE == llvm::instrprof_error::hash_mismatch) {
+      if (enableStaleProfileMatching && loadStaleRegionCounts(fd))
+        return;
       IF_LOG Logger::println(
           "Ignoring profile data: hash mismatch for function: %s",
           FuncName.c_str());
@@ -963,6 +1121,66 @@ void CodeGenPGO::loadRegionCounts(llvm::IndexedInstrProfReader *PGOReader,
                          FuncName.c_str());
 }
 
+/// Tries to salvage the profile data of a function whose control-flow hash
+/// does not match any profile record. Returns false if the data is dropped.
+bool CodeGenPGO::loadStaleRegionCounts(const FuncDeclaration *fd) {
+  const auto &Records = getStaleProfileRecords(gIR->getPGOReader());
+  auto It = Records.find(FuncName);
+  if (It == Records.end())
+    return false;
+
+  StaleMatch Best = StaleMatch::Dropped;
+  unsigned BestMatched = 0;
+  for (const auto &Record : It->second) {
+    std::vector<uint64_t> Counts;
+    unsigned NumMatched;
+    StaleMatch Match = alignStaleCounters(RegionCounterKinds, Record.Hash,
+                                          Record.Counts, Counts, NumMatched);
+    if (Match > Best || (Match == Best && NumMatched > BestMatched)) {
+      Best = Match;
+      BestMatched = NumMatched;
+      RegionCounts = std::move(Counts);
+    }
+  }
+
+  auto *prettyName = const_cast<FuncDeclaration *>(fd)->toPrettyChars();
+  switch (Best) {
+  case StaleMatch::Dropped:
+    return false;
+  case StaleMatch::Ends:
+    IF_LOG Logger::println(
+        "Stale profile data matched by position from both ends: %s",
+        FuncName.c_str());
+    warning(fd->loc,
+            "Matched stale profile data for function `%s` (`%s`) by counter "
+            "position from both ends: %u of %u region counters",
+            prettyName, FuncName.c_str(), BestMatched + 1, NumRegionCounters);
+    break;
+  case StaleMatch::Positional:
+    IF_LOG Logger::println("Stale profile data matched by position: %s",
+                           FuncName.c_str());
+    warning(fd->loc,
+            "Matched stale profile data for function `%s` (`%s`) by counter "
+            "position only",
+            prettyName, FuncName.c_str());
+    break;
+  case StaleMatch::Partial:
+    IF_LOG Logger::println("Stale profile data partially matched: %s",
+                           FuncName.c_str());
+    warning(fd->loc,
+            "Partially matched stale profile data for function `%s` (`%s`): "
+            "%u of %u region counters",
+            prettyName, FuncName.c_str(), BestMatched + 1, NumRegionCounters);
+    break;
+  case StaleMatch::Matched:
+    IF_LOG Logger::println("Stale profile data matched: %s", FuncName.c_str());
+    warning(fd->loc, "Matched stale profile data for function `%s` (`%s`)",
+            prettyName, FuncName.c_str());
+    break;
+  }
+  return true;
+}
+
 /// \brief Calculate what to divide by to scale weights.
 ///
 /// Given the maximum weight, calculate a divisor that will scale all the
@@ -1107,6 +1325,8 @@ void CodeGenPGO::valueProfile(uint32_t valueKind, llvm::Instruction *valueSite,
 
     if (ptrCastNeeded)
       value = gIR->ir->CreatePtrToInt(value, gIR->ir->getInt64Ty());
+    else
+      value = gIR->ir->CreateZExtOrTrunc(value, gIR->ir->getInt64Ty());
 
     auto *i8PtrTy = llvm::Type::getInt8PtrTy(gIR->context());
     llvm::Value *Args[5] = {
@@ -1132,3 +1352,59 @@ void CodeGenPGO::valueProfile(uint32_t valueKind, llvm::Instruction *valueSite,
     NumValueSites[valueKind]++;
   }
 }
+
+void CodeGenPGO::emitMemOPSizePGO(llvm::Instruction *memop,
+                                  llvm::Value *size) {
+  // Constant sizes need no profiling.
+  if (enablePGOSizes && !llvm::isa<llvm::Constant>(size))
+    valueProfile(llvm::IPVK_MemOPSize, memop, size, false);
+}
+
+bool CodeGenPGO::profileSize(llvm::Value *size, uint64_t &value,
+                             uint64_t &count, uint64_t &total) {
+  if (!enablePGOSizes || !size || llvm::isa<llvm::Constant>(size))
+    return false;
+
+  const uint32_t valueKind = llvm::IPVK_MemOPSize;
+  if (opts::isInstrumentingForASTBasedPGO() && emitInstrumentation) {
+    if (!RegionCounterMap)
+      return false;
+    auto *i8PtrTy = llvm::Type::getInt8PtrTy(gIR->context());
+    llvm::Value *Args[5] = {
+        llvm::ConstantExpr::getBitCast(FuncNameVar, i8PtrTy),
+        gIR->ir->getInt64(FunctionHash),
+        gIR->ir->CreateZExtOrTrunc(size, gIR->ir->getInt64Ty()),
+        gIR->ir->getInt32(valueKind),
+        gIR->ir->getInt32(NumValueSites[valueKind])};
+    gIR->ir->CreateCall(GET_INTRINSIC_DECL(instrprof_value_profile), Args);
+    NumValueSites[valueKind]++;
+    return false;
+  }
+
+  if (!ProfRecord ||
+      NumValueSites[valueKind] >= ProfRecord->getNumValueSites(valueKind))
+    return false;
+
+  const uint32_t site = NumValueSites[valueKind]++;
+  const uint32_t numValues =
+      ProfRecord->getNumValueDataForSite(valueKind, site);
+  if (!numValues)
+    return false;
+  auto valueData = ProfRecord->getValueForSite(valueKind, site, &total);
+  count = 0;
+  for (uint32_t i = 0; i < numValues; ++i) {
+    if (valueData[i].Count > count) {
+      value = valueData[i].Value;
+      count = valueData[i].Count;
+    }
+  }
+
+  // Sizes are profiled in ranges; only small sizes are recorded exactly (and
+  // powers of two with LLVM 12+).
+  bool isPrecise = value <= 8;
+#if LDC_LLVM_VER >= 1200
+  isPrecise = isPrecise || llvm::isPowerOf2_64(value);
+#endif
+  return isPrecise && count >= pgoSizeCountThreshold &&
+         count * 100 >= total * pgoSizePercentThreshold;
+}
@@ -130,6 +130,19 @@ public:
   void valueProfile(uint32_t valueKind, llvm::Instruction *valueSite,
                     llvm::Value *value, bool ptrCastNeeded);
 
+  /// Adds profiling instrumentation/annotation of the byte size `size` of the
+  /// memory intrinsic call `memop` (memcpy, memset, ...). For PGO use, LLVM
+  /// specializes the intrinsic for its dominant sizes.
+  void emitMemOPSizePGO(llvm::Instruction *memop, llvm::Value *size);
+
+  /// Adds value profiling of the integer `size` (e.g., an array length passed
+  /// to the runtime) at the current insertion point. For PGO use, returns true
+  /// if a single, precisely profiled value dominates the profile; it is then
+  /// returned in `value`, its execution count in `count` and the total
+  /// execution count of the site in `total`.
+  bool profileSize(llvm::Value *size, uint64_t &value, uint64_t &count,
+                   uint64_t &total);
+
 private:
   std::string FuncName;
   llvm::GlobalVariable *FuncNameVar;
@@ -138,6 +151,9 @@ private:
   uint64_t FunctionHash;
   std::unique_ptr<llvm::DenseMap<const RootObject *, unsigned>>
       RegionCounterMap;
+  /// The PGOHash type of each region counter, in counter order and excluding
+  /// the function entry counter. Used to salvage stale profile data.
+  std::vector<unsigned char> RegionCounterKinds;
   std::unique_ptr<llvm::DenseMap<const RootObject *, uint64_t>> StmtCountMap;
   std::vector<uint64_t> RegionCounts;
   uint64_t CurrentRegionCount;
@@ -168,4 +184,5 @@ private:
   void applyFunctionAttributes(llvm::Function *Fn);
   void loadRegionCounts(llvm::IndexedInstrProfReader *PGOReader,
                         const FuncDeclaration *D);
+  bool loadStaleRegionCounts(const FuncDeclaration *D);
 };
@@ -20,6 +20,7 @@
 #include "driver/cl_options_instrumentation.h"
 #include "gen/abi.h"
 #include "gen/attributes.h"
+#include "gen/funcgenstate.h"
 #include "gen/functions.h"
 #include "gen/irstate.h"
 #include "gen/llvm.h"
@@ -32,6 +33,7 @@
 #include "ir/irtypefunction.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/Attributes.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/MemoryBuffer.h"
@@ -592,6 +594,12 @@ static void buildRuntimeModule() {
   createFwdDecl(LINK::c, voidArrayTy, {"_d_arrayappendcTX"},
                 {typeInfoTy, voidArrayTy, sizeTy}, {STCconst, STCref, 0});
 
+  // void* gc_addrOf(void* p)
+  createFwdDecl(LINK::c, voidPtrTy, {"gc_addrOf"}, {voidPtrTy});
+
+  // size_t gc_sizeOf(void* p)
+  createFwdDecl(LINK::c, sizeTy, {"gc_sizeOf"}, {voidPtrTy});
+
   // void[] _d_arrayappendT(const TypeInfo ti, ref byte[] x, byte[] y)
   createFwdDecl(LINK::c, voidArrayTy, {"_d_arrayappendT"},
                 {typeInfoTy, voidArrayTy, voidArrayTy}, {STCconst, STCref, 0});
@@ -834,6 +842,22 @@ static void buildRuntimeModule() {
   if (global.params.cov) {
     createFwdDecl(LINK::c, voidTy, {"_d_cover_register2"},
                   {stringTy, sizeTy->arrayOf(), uintTy->arrayOf(), ubyteTy});
+
+    // Thread-exit callbacks for -cov=sharded
+    if (global.params.targetTriple->isOSWindows()) {
+      // uint FlsAlloc(void* callback)
+      createFwdDecl(LINK::windows, uintTy, {"FlsAlloc"}, {voidPtrTy});
+      // int FlsSetValue(uint index, void* data)
+      createFwdDecl(LINK::windows, intTy, {"FlsSetValue"}, {uintTy, voidPtrTy});
+    } else {
+      // int pthread_key_create(pthread_key_t* key, void* destructor)
+      createFwdDecl(LINK::c, intTy, {"pthread_key_create"},
+                    {voidPtrTy, voidPtrTy});
+      // int pthread_setspecific(pthread_key_t key, const void* value)
+      Type *keyTy = global.params.targetTriple->isOSDarwin() ? sizeTy : uintTy;
+      createFwdDecl(LINK::c, intTy, {"pthread_setspecific"},
+                    {keyTy, voidPtrTy});
+    }
   }
 
   if (global.params.hasObjectiveC) {
@@ -885,6 +909,18 @@ static void buildRuntimeModule() {
   // extern(C) void _c_trace_epi()
   createFwdDecl(LINK::c, voidTy, {"_c_trace_epi"}, {});
 
+  //////////////////////////////////////////////////////////////////////////////
+  //////////////////////////////////////////////////////////////////////////////
+  ////// -finstrument=trace-buffer
+
+  // extern(C) void _d_trace_buffer_flush(void* buffer)
+  createFwdDecl(LINK::c, voidTy, {"_d_trace_buffer_flush"}, {voidPtrTy}, {},
+                Attr_NoUnwind);
+
+  // extern(C) ulong _d_trace_buffer_clock()
+  createFwdDecl(LINK::c, ulongTy, {"_d_trace_buffer_clock"}, {}, {},
+                Attr_NoUnwind);
+
   //////////////////////////////////////////////////////////////////////////////
   //////////////////////////////////////////////////////////////////////////////
   ////// C standard library functions (a druntime link dependency)
@@ -905,12 +941,103 @@ static void emitInstrumentationFn(const char *name) {
   gIR->ir->CreateCall(fn, {callee, caller});
 }
 
+static const char *const instrumentFunctionsEnabledFlagName =
+    "_d_instrument_functions_enabled";
+
+// Returns the global flag enabling the profiling hooks on every call with
+// sampled `-finstrument-functions`. Only declared here, as user code may still
+// define it later in the module; see defineInstrumentFunctionsEnabledFlag().
+static LLGlobalVariable *getInstrumentFunctionsEnabledFlag() {
+  return declareGlobal(Loc(), gIR->module,
+                       LLType::getInt32Ty(gIR->context()),
+                       instrumentFunctionsEnabledFlagName,
+                       /*isConstant=*/false);
+}
+
+void defineInstrumentFunctionsEnabledFlag(llvm::Module &module) {
+  auto flag = module.getGlobalVariable(instrumentFunctionsEnabledFlagName);
+  if (!flag || !flag->isDeclaration())
+    return;
+
+  flag->setInitializer(getNullValue(flag->getValueType()));
+  setLinkage({LLGlobalValue::LinkOnceODRLinkage, needsCOMDAT()}, flag);
+}
+
+// Returns the per-thread call countdown for sampled `-finstrument-functions`.
+static LLGlobalVariable *getInstrumentFunctionsCountdown() {
+  const char *name = "ldc.instrument_functions_countdown";
+  if (auto existing = gIR->module.getGlobalVariable(name, true))
+    return existing;
+
+  auto countdown = defineGlobal(Loc(), gIR->module, name, DtoConstUint(0),
+                                LLGlobalValue::LinkOnceODRLinkage,
+                                /*isConstant=*/false, /*isThreadLocal=*/true);
+  setLinkage({LLGlobalValue::LinkOnceODRLinkage, needsCOMDAT()}, countdown);
+  countdown->setVisibility(LLGlobalValue::HiddenVisibility);
+  return countdown;
+}
+
+// Calls the profiling hook if `sampled` is true.
+static void emitSampledInstrumentationFn(const char *name, LLValue *sampled) {
+  const unsigned period = opts::instrumentFunctionsSample;
+  auto callbb = gIR->insertBB("cyg_profile");
+  auto endbb = gIR->insertBBAfter(callbb, "cyg_profile.end");
+  llvm::MDBuilder mdBuilder(gIR->context());
+  gIR->ir->CreateCondBr(
+      sampled, callbb, endbb,
+      mdBuilder.createBranchWeights(1, period > 1 ? period - 1 : 1000));
+
+  gIR->ir->SetInsertPoint(callbb);
+  emitInstrumentationFn(name);
+  gIR->ir->CreateBr(endbb);
+  gIR->ir->SetInsertPoint(endbb);
+}
+
 void emitInstrumentationFnEnter(FuncDeclaration *decl) {
-  if (opts::instrumentFunctions && decl->emitInstrumentation)
+  if (!opts::instrumentFunctions || !decl->emitInstrumentation)
+    return;
+
+  const unsigned period = opts::instrumentFunctionsSample;
+  if (period == 1) {
     emitInstrumentationFn("__cyg_profile_func_enter");
+    return;
+  }
+
+  // The hooks are called if enabled globally at runtime ...
+  auto flag = getInstrumentFunctionsEnabledFlag();
+  auto flagValue =
+      llvm::cast<llvm::LoadInst>(DtoAlignedLoad(flag, "cyg_profile.enabled"));
+  flagValue->setAtomic(llvm::AtomicOrdering::Monotonic);
+  LLValue *sampled = gIR->ir->CreateIsNotNull(flagValue);
+
+  // ... or on every `period`-th call of the thread.
+  if (period > 1) {
+    auto countdownPtr = getInstrumentFunctionsCountdown();
+    LLValue *countdown = DtoLoad(countdownPtr, "cyg_profile.countdown");
+    LLValue *isDue = gIR->ir->CreateIsNull(countdown);
+    DtoStore(gIR->ir->CreateSelect(
+                 isDue, DtoConstUint(period - 1),
+                 gIR->ir->CreateSub(countdown, DtoConstUint(1))),
+             countdownPtr);
+    sampled = gIR->ir->CreateOr(sampled, isDue);
+  }
+
+  auto &funcGen = gIR->funcGen();
+  funcGen.instrumentFunctionsSampled =
+      DtoRawAlloca(sampled->getType(), 0, "cyg_profile.sampled");
+  DtoStore(sampled, funcGen.instrumentFunctionsSampled);
+
+  emitSampledInstrumentationFn("__cyg_profile_func_enter", sampled);
 }
 
 void emitInstrumentationFnLeave(FuncDeclaration *decl) {
-  if (opts::instrumentFunctions && decl->emitInstrumentation)
+  if (!opts::instrumentFunctions || !decl->emitInstrumentation)
+    return;
+
+  if (auto sampledSlot = gIR->funcGen().instrumentFunctionsSampled) {
+    emitSampledInstrumentationFn("__cyg_profile_func_exit",
+                                 DtoLoad(sampledSlot));
+  } else {
     emitInstrumentationFn("__cyg_profile_func_exit");
+  }
 }
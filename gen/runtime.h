@@ -36,6 +36,9 @@ llvm::Function *getUnwindResumeFunction(const Loc &loc, llvm::Module &target);
 
 void emitInstrumentationFnEnter(FuncDeclaration *decl);
 void emitInstrumentationFnLeave(FuncDeclaration *decl);
+// Defines `_d_instrument_functions_enabled` if referenced by sampled
+// `-finstrument-functions` code, but not defined by user code in the module.
+void defineInstrumentFunctionsEnabledFlag(llvm::Module &module);
 
 Type *getObjectType();
 Type *getTypeInfoType();
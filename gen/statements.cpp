@@ -18,6 +18,7 @@
 #include "dmd/module.h"
 #include "dmd/mtype.h"
 #include "dmd/root/port.h"
+#include "dmd/template.h"
 #include "gen/abi.h"
 #include "gen/arrays.h"
 #include "gen/classes.h"
@@ -37,7 +38,9 @@
 #include "ir/irmodule.h"
 #include "llvm/IR/CFG.h"
 #include "llvm/IR/InlineAsm.h"
+#include "llvm/Support/CommandLine.h"
 #include <fstream>
+#include <map>
 #include <math.h>
 #include <stdio.h>
 
@@ -105,6 +108,172 @@ public:
   void visit(Expression *) override {}
 };
 
+static llvm::cl::opt<bool> disableStringSwitchLowering(
+    "disable-string-switch-lowering", llvm::cl::ZeroOrMore, llvm::cl::Hidden,
+    llvm::cl::desc("Determine the case of string switches by calling "
+                   "druntime's object.__switch template"));
+
+namespace {
+/// The frontend lowers `switch` statements on strings to a switch on the
+/// index of the matching label in the sorted list of case labels, computed by
+/// `object.__switch!(T, caseLabels...)(condition)` (binary search).
+///
+/// This emits the index computation inline instead, as a decision tree over
+/// the length and then the code units at the most distinctive positions, until
+/// a single candidate label remains, which is verified with a single memcmp.
+class StringSwitchLowering {
+  IRState &irs;
+  const Loc &loc;
+  llvm::SmallVector<StringExp *, 16> labels;
+  LLValue *length = nullptr;
+  LLValue *ptr = nullptr;
+  llvm::BasicBlock *resultbb = nullptr;
+  llvm::PHINode *result = nullptr;
+
+  LLConstantInt *getIndex(int i) {
+    return LLConstantInt::get(LLType::getInt32Ty(irs.context()), i, true);
+  }
+
+  void emitNoMatch(llvm::BasicBlock *bb) {
+    llvm::BranchInst::Create(resultbb, bb);
+    result->addIncoming(getIndex(-1), bb);
+  }
+
+  // Picks the not yet checked position with the highest number of distinct
+  // code units among the candidates.
+  size_t choosePosition(llvm::ArrayRef<unsigned> candidates, size_t len,
+                        const std::vector<bool> &checked) {
+    size_t best = 0, bestCount = 0;
+    for (size_t pos = 0; pos < len; ++pos) {
+      if (checked[pos])
+        continue;
+      llvm::SmallDenseSet<unsigned, 16> distinct;
+      for (unsigned c : candidates)
+        distinct.insert(labels[c]->charAt(pos));
+      if (distinct.size() > bestCount) {
+        best = pos;
+        bestCount = distinct.size();
+      }
+    }
+    assert(bestCount > 1 && "duplicate string case labels");
+    return best;
+  }
+
+  void emitCandidates(llvm::ArrayRef<unsigned> candidates, size_t len,
+                      std::vector<bool> &checked) {
+    if (candidates.size() == 1) {
+      const unsigned index = candidates[0];
+      LLValue *match = DtoConstBool(true);
+      if (len != 0) {
+        StringExp *label = labels[index];
+        LLFunction *fn = getRuntimeFunction(loc, irs.module, "memcmp");
+        LLValue *args[] = {
+            DtoBitCast(ptr, getVoidPtrType()),
+            DtoBitCast(irs.getCachedStringLiteral(label), getVoidPtrType()),
+            DtoConstSize_t(len * label->sz)};
+        match = irs.ir->CreateICmpEQ(irs.ir->CreateCall(fn, args),
+                                     DtoConstInt(0), "stringswitch.match");
+      }
+      result->addIncoming(
+          irs.ir->CreateSelect(match, getIndex(index), getIndex(-1)),
+          irs.scopebb());
+      irs.ir->CreateBr(resultbb);
+      return;
+    }
+
+    const size_t pos = choosePosition(candidates, len, checked);
+    std::map<unsigned, llvm::SmallVector<unsigned, 4>> groups;
+    for (unsigned c : candidates)
+      groups[labels[c]->charAt(pos)].push_back(c);
+
+    LLValue *codeUnit = DtoLoad(DtoGEP1(ptr, DtoConstSize_t(pos)));
+    llvm::BasicBlock *nomatchbb = irs.insertBB("stringswitch.nomatch");
+    auto si = irs.ir->CreateSwitch(codeUnit, nomatchbb, groups.size());
+    emitNoMatch(nomatchbb);
+
+    checked[pos] = true;
+    for (const auto &group : groups) {
+      llvm::BasicBlock *bb = irs.insertBBBefore(resultbb, "stringswitch.char");
+      si->addCase(LLConstantInt::get(
+                      llvm::cast<llvm::IntegerType>(codeUnit->getType()),
+                      group.first),
+                  bb);
+      irs.ir->SetInsertPoint(bb);
+      emitCandidates(group.second, len, checked);
+    }
+    checked[pos] = false;
+  }
+
+public:
+  StringSwitchLowering(IRState &irs, const Loc &loc) : irs(irs), loc(loc) {}
+
+  /// Returns the `object.__switch` call's argument if `condition` is such a
+  /// call with string literal labels.
+  Expression *match(Expression *condition) {
+    auto ce = condition->isCallExp();
+    if (!ce || !ce->f || ce->f->ident != Id::__switch ||
+        ce->arguments->length != 1) {
+      return nullptr;
+    }
+    auto ti = ce->f->parent ? ce->f->parent->isTemplateInstance() : nullptr;
+    if (!ti || !ti->tiargs || !ti->tempdecl ||
+        ti->tempdecl->getModule()->ident != Id::object) {
+      return nullptr;
+    }
+
+    Type *charType = isType((*ti->tiargs)[0]);
+    if (!charType)
+      return nullptr;
+    const auto charSize = charType->toBasetype()->size();
+    for (size_t i = 1; i < ti->tiargs->length; ++i) {
+      auto e = isExpression((*ti->tiargs)[i]);
+      auto se = e ? e->isStringExp() : nullptr;
+      if (!se || se->sz != charSize)
+        return nullptr;
+      labels.push_back(se);
+    }
+
+    return (*ce->arguments)[0];
+  }
+
+  /// Emits the computation of the case index for the string `condition`.
+  LLValue *emit(Expression *condition) {
+    LLValue *slice = DtoRVal(toElemDtor(condition));
+    length = DtoExtractValue(slice, 0, "stringswitch.length");
+    ptr = DtoExtractValue(slice, 1, "stringswitch.ptr");
+
+    llvm::BasicBlock *entrybb = irs.scopebb();
+    resultbb = irs.insertBB("stringswitch.result");
+    irs.ir->SetInsertPoint(resultbb);
+    result = irs.ir->CreatePHI(LLType::getInt32Ty(irs.context()), 0,
+                               "stringswitch.index");
+    irs.ir->SetInsertPoint(entrybb);
+
+    std::map<size_t, llvm::SmallVector<unsigned, 4>> byLength;
+    for (unsigned i = 0; i < labels.size(); ++i)
+      byLength[labels[i]->len].push_back(i);
+
+    llvm::BasicBlock *nomatchbb =
+        irs.insertBBBefore(resultbb, "stringswitch.nomatch");
+    auto si = irs.ir->CreateSwitch(length, nomatchbb, byLength.size());
+    emitNoMatch(nomatchbb);
+
+    for (const auto &group : byLength) {
+      llvm::BasicBlock *bb = irs.insertBBBefore(resultbb, "stringswitch.len");
+      si->addCase(DtoConstSize_t(group.first), bb);
+      irs.ir->SetInsertPoint(bb);
+      std::vector<bool> checked(group.first, false);
+      emitCandidates(group.second, group.first, checked);
+    }
+
+    irs.ir->SetInsertPoint(resultbb);
+    return result;
+  }
+};
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
 class ToIRVisitor : public Visitor {
   IRState *irs;
 
@@ -997,7 +1166,15 @@ public:
     irs->ir->SetInsertPoint(oldbb);
     if (useSwitchInst) {
       // The case index value.
-      LLValue *condVal = DtoRVal(toElemDtor(stmt->condition));
+      LLValue *condVal;
+      StringSwitchLowering stringSwitch(*irs, stmt->loc);
+      Expression *stringCondition = nullptr;
+      if (!disableStringSwitchLowering &&
+          (stringCondition = stringSwitch.match(stmt->condition))) {
+        condVal = stringSwitch.emit(stringCondition);
+      } else {
+        condVal = DtoRVal(toElemDtor(stmt->condition));
+      }
 
       // Create switch and add the cases.
       // For PGO instrumentation, we need to add counters /before/ the case
@@ -365,7 +365,8 @@ void DtoMemSetZero(LLValue *dst, unsigned align) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void DtoMemCpy(LLValue *dst, LLValue *src, LLValue *nbytes, unsigned align) {
+llvm::CallInst *DtoMemCpy(LLValue *dst, LLValue *src, LLValue *nbytes,
+                          unsigned align) {
   LLType *VoidPtrTy = getVoidPtrType();
 
   dst = DtoBitCast(dst, VoidPtrTy);
@@ -373,9 +374,9 @@ void DtoMemCpy(LLValue *dst, LLValue *src, LLValue *nbytes, unsigned align) {
 
 #if LDC_LLVM_VER >= 700
   auto A = LLMaybeAlign(align);
-  gIR->ir->CreateMemCpy(dst, A, src, A, nbytes, false /*isVolatile*/);
+  return gIR->ir->CreateMemCpy(dst, A, src, A, nbytes, false /*isVolatile*/);
 #else
-  gIR->ir->CreateMemCpy(dst, src, nbytes, align, false /*isVolatile*/);
+  return gIR->ir->CreateMemCpy(dst, src, nbytes, align, false /*isVolatile*/);
 #endif
 }
 
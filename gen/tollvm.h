@@ -190,8 +190,10 @@ void DtoMemSetZero(LLValue *dst, unsigned align = 1);
  * @param src Source memory.
  * @param nbytes Number of bytes to copy.
  * @param align The minimum alignment of the source and destination memory.
+ * @return The memcpy call.
  */
-void DtoMemCpy(LLValue *dst, LLValue *src, LLValue *nbytes, unsigned align = 1);
+llvm::CallInst *DtoMemCpy(LLValue *dst, LLValue *src, LLValue *nbytes,
+                          unsigned align = 1);
 
 /**
  * The same as DtoMemCpy but figures out the size itself based on the dst
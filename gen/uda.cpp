@@ -8,6 +8,7 @@
 #include "dmd/id.h"
 #include "dmd/identifier.h"
 #include "dmd/module.h"
+#include "driver/cl_options_instrumentation.h"
 #include "gen/irstate.h"
 #include "gen/llvm.h"
 #include "gen/llvmhelpers.h"
@@ -350,6 +351,25 @@ void applyAttrTarget(StructLiteralExp *sle, llvm::Function *func,
   }
 }
 
+void applyAttrXRay(StructLiteralExp *sle, llvm::Function *func) {
+  checkStructElems(sle, {Type::tstring});
+  llvm::StringRef value = getStringElem(sle, 0);
+
+  if (value != "always" && value != "never") {
+    sle->warning(
+        "ignoring unrecognized parameter `%.*s` for `@ldc.attributes.%s`",
+        static_cast<int>(value.size()), value.data(),
+        sle->sd->ident->toChars());
+    return;
+  }
+
+  // Only relevant with -fxray-instrument, see applyXRayAttributes().
+  if (opts::fXRayInstrument) {
+    func->addFnAttr("function-instrument",
+                    value == "always" ? "xray-always" : "xray-never");
+  }
+}
+
 void applyAttrAssumeUsed(IRState &irs, StructLiteralExp *sle,
                          llvm::Constant *symbol) {
   checkStructElems(sle, {});
@@ -425,6 +445,8 @@ void applyFuncDeclUDAs(FuncDeclaration *decl, IrFunction *irFunc) {
         applyAttrTarget(sle, func, irFunc);
       } else if (ident == Id::udaAssumeUsed) {
         applyAttrAssumeUsed(*gIR, sle, func);
+      } else if (ident == Id::udaXRay) {
+        applyAttrXRay(sle, func);
       } else if (ident == Id::udaWeak || ident == Id::udaKernel) {
         // @weak and @kernel are applied elsewhere
       } else if (ident == Id::udaDynamicCompile) {
@@ -17,6 +17,7 @@
 #include "dmd/target.h"
 #include "gen/abi.h"
 #include "gen/arrays.h"
+#include "gen/classes.h"
 #include "gen/funcgenstate.h"
 #include "gen/functions.h"
 #include "gen/irstate.h"
@@ -78,8 +79,10 @@ LLGlobalVariable *IrClass::getVtblSymbol(bool define) {
 
   if (define) {
     auto init = getVtblInit(); // might define vtbl
-    if (!vtbl->hasInitializer())
+    if (!vtbl->hasInitializer()) {
       defineGlobal(vtbl, init, aggrdecl);
+      addVtblTypeMetadata(vtbl, aggrdecl->isClassDeclaration());
+    }
   }
 
   return vtbl;
@@ -478,6 +481,7 @@ llvm::GlobalVariable *IrClass::getInterfaceVtblSymbol(BaseClass *b,
   if (define && !gvar->hasInitializer()) {
     auto init = getInterfaceVtblInit(b, interfaces_index);
     defineGlobal(gvar, init, aggrdecl);
+    addVtblTypeMetadata(gvar, b->sym);
   }
 
   return gvar;
@@ -43,6 +43,9 @@ struct IrModule {
   GatesList sharedGates;
   FuncDeclList unitTests;
   llvm::Function *coverageCtor = nullptr;
+  // -cov=sharded: the thread's counters and the function initializing them
+  llvm::GlobalVariable *coverageDataPtr = nullptr;
+  llvm::Function *coverageShardInit = nullptr;
 
   llvm::DIModule *diModule = nullptr;
 
@@ -12,32 +12,63 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <functional>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "bind.h"
 #include "callback_ostream.h"
 #include "context.h"
 #include "jit_context.h"
+#include "object_cache.h"
 #include "optimizer.h"
 #include "options.h"
+#include "parallel_codegen.h"
 #include "utils.h"
 
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Mangler.h"
 #include "llvm/Linker/Linker.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 
 namespace {
+namespace cl = llvm::cl;
+cl::opt<bool> lazyCompile(
+    "jit-lazy-compile", cl::ZeroOrMore,
+    cl::desc("Compile @dynamicCompile functions on their first call instead of "
+             "in compileDynamicCode() (bind functions are still compiled "
+             "eagerly)"));
+cl::opt<unsigned> tierUpThreshold(
+    "jit-tier-up-threshold", cl::ZeroOrMore, cl::init(0),
+    cl::desc("Compile @dynamicCompile functions without optimizations and with "
+             "profiling counters first, and recompile the ones called this "
+             "many times in the background at -O3, using the collected "
+             "profile (0 = disabled)"));
+cl::opt<bool> lazyLoad(
+    "jit-lazy-load", cl::ZeroOrMore, cl::init(true),
+    cl::desc("Only load the IR of the functions reachable from the "
+             "@dynamicCompile functions, bind instances and global variables, "
+             "instead of all functions of the dynamically compiled modules"));
 
 #pragma pack(push, 1)
 
@@ -86,6 +117,7 @@ void enumModules(const RtCompileModuleList *modlist_head,
     interruptPoint(context, "check version");
     if (current->version != ApiVersion) {
       fatal(context, "Module was built with different jit api version");
+      return;
     }
     fun(*current);
     current = current->next;
@@ -170,6 +202,14 @@ void *resolveSymbol(llvm::JITSymbol &symbol) {
   }
 }
 
+std::string getBindFuncName(llvm::StringRef specialization) {
+  return ("\1.jit_bind." + specialization).str();
+}
+
+bool isBindFunction(llvm::StringRef name) {
+  return name.startswith("\1.jit_bind.");
+}
+
 void generateBind(const Context &context, DynamicCompilerContext &jitContext,
                   JitModuleInfo &moduleInfo, llvm::Module &module) {
   auto getIrFunc = [&](const void *ptr) -> llvm::Function * {
@@ -185,9 +225,17 @@ void generateBind(const Context &context, DynamicCompilerContext &jitContext,
   bindFuncs.reserve(jitContext.getBindInstances().size() * 2);
 
   auto genBind = [&](void *bindPtr, void *originalFunc, void *exampleFunc,
-                     const llvm::ArrayRef<ParamSlice> &params) {
+                     const llvm::ArrayRef<ParamSlice> &params,
+                     const std::string &specialization) {
     assert(bindPtr != nullptr);
     assert(bindFuncs.end() == bindFuncs.find(bindPtr));
+    // Bind instances with the same function and values share their code.
+    const auto name = getBindFuncName(specialization);
+    if (auto func = module.getFunction(name)) {
+      moduleInfo.addBindHandle(func->getName(), bindPtr);
+      bindFuncs.insert({bindPtr, func});
+      return;
+    }
     auto funcToInline = getIrFunc(originalFunc);
     if (funcToInline != nullptr) {
       auto exampleIrFunc = getIrFunc(exampleFunc);
@@ -232,6 +280,8 @@ void generateBind(const Context &context, DynamicCompilerContext &jitContext,
       auto func =
           bindParamsToFunc(module, *funcToInline, *exampleIrFunc, params,
                            errhandler, BindOverride(overrideHandler));
+      // Stable name for incremental compilation.
+      func->setName(name);
       moduleInfo.addBindHandle(func->getName(), bindPtr);
       bindFuncs.insert({bindPtr, func});
     } else {
@@ -243,15 +293,30 @@ void generateBind(const Context &context, DynamicCompilerContext &jitContext,
     auto &bindDesc = bind.second;
     assert(bindDesc.originalFunc != nullptr);
     genBind(bindPtr, bindDesc.originalFunc, bindDesc.exampleFunc,
-            bindDesc.params);
+            bindDesc.params, bindDesc.specialization);
   }
 }
 
+std::string getTier1Name(llvm::StringRef name) {
+  return (name + ".jit_tier1").str();
+}
+
+/// Returns the name of the current code of a function, which is its tier 1
+/// code once it has been recompiled, see `tierUp()`.
+std::string getCurrentName(DynamicCompilerContext &jit, llvm::StringRef name) {
+  auto &tier = jit.getTierState();
+  auto it = tier.current.find(name);
+  if (tier.current.end() != it && it->second->tieredUp) {
+    return getTier1Name(name);
+  }
+  return name.str();
+}
+
 void applyBind(const Context &context, DynamicCompilerContext &jitContext,
                const JitModuleInfo &moduleInfo) {
   auto &layout = jitContext.getDataLayout();
   for (auto &elem : moduleInfo.getBindHandles()) {
-    auto decorated = decorate(elem.name, layout);
+    auto decorated = decorate(getCurrentName(jitContext, elem.name), layout);
     auto symbol = jitContext.findSymbol(decorated);
     auto addr = resolveSymbol(symbol);
     if (nullptr == addr) {
@@ -259,8 +324,7 @@ void applyBind(const Context &context, DynamicCompilerContext &jitContext,
                          elem.name + "\" (\"" + decorated + "\")";
       fatal(context, desc);
     } else {
-      auto handle = static_cast<void **>(elem.handle);
-      *handle = addr;
+      jitContext.setThunk(static_cast<void **>(elem.handle), addr);
     }
   }
 }
@@ -308,6 +372,741 @@ void setFunctionsTarget(llvm::Module &module, const llvm::TargetMachine &TM) {
   }
 }
 
+const char *const changedVarMD = "ldc.jit.changed";
+
+/// The values of the @dynamicCompileConst variables in `module`, which are
+/// marked if they have changed since the last compilation.
+void collectRtCompileVarValues(
+    llvm::Module &module, llvm::ArrayRef<RtCompileVarList> vals,
+    const DynamicCompilerContext::CompiledState &compiledState,
+    llvm::StringMap<std::string> &values) {
+  const auto &layout = module.getDataLayout();
+  for (auto &&val : vals) {
+    auto var = module.getGlobalVariable(val.name);
+    if (nullptr == var) {
+      continue;
+    }
+    const auto size = layout.getTypeAllocSize(var->getValueType());
+    std::string value(static_cast<const char *>(val.init), size);
+    auto it = compiledState.varValues.find(val.name);
+    if (compiledState.varValues.end() == it || it->second != value) {
+      var->setMetadata(changedVarMD, llvm::MDNode::get(module.getContext(), {}));
+    }
+    values[val.name] = std::move(value);
+  }
+}
+
+bool isJitDefinition(const llvm::Function &func) {
+  return !func.isDeclaration() && !func.hasLocalLinkage() &&
+         !func.hasAvailableExternallyLinkage();
+}
+
+/// Finds the functions that need to be (re)compiled: the ones which haven't
+/// been compiled yet (including the bind functions of new specializations),
+/// the ones using changed @dynamicCompileConst variables and, transitively,
+/// all their users (which may have inlined them).
+std::unordered_set<llvm::Function *>
+findAffectedFunctions(DynamicCompilerContext &jitContext,
+                      llvm::Module &module) {
+  std::unordered_set<llvm::Function *> affected;
+  std::vector<llvm::Function *> worklist;
+  auto markAffected = [&](llvm::Function *func) {
+    if (func != nullptr && affected.insert(func).second) {
+      worklist.push_back(func);
+    }
+  };
+
+  std::unordered_set<const llvm::Value *> visited;
+  std::function<void(const llvm::Value *)> markUsers =
+      [&](const llvm::Value *value) {
+        for (auto user : value->users()) {
+          if (auto instr = llvm::dyn_cast<llvm::Instruction>(user)) {
+            markAffected(const_cast<llvm::Function *>(instr->getFunction()));
+          } else if (visited.insert(user).second) {
+            // constant expressions and globals, e.g. function pointer tables
+            markUsers(user);
+          }
+        }
+      };
+
+  for (auto &&var : module.globals()) {
+    if (var.getMetadata(changedVarMD) != nullptr) {
+      var.setMetadata(changedVarMD, nullptr);
+      markUsers(&var);
+    }
+  }
+
+  for (auto &&func : module.functions()) {
+    if (isJitDefinition(func) && !jitContext.isSymbolCompiled(func.getName())) {
+      markAffected(&func);
+    }
+  }
+
+  while (!worklist.empty()) {
+    auto func = worklist.back();
+    worklist.pop_back();
+    markUsers(func);
+  }
+  return affected;
+}
+
+/// Returns `roots` and, transitively, the functions satisfying `pred`
+/// referenced by them.
+std::unordered_set<llvm::Function *> collectReferencedFunctions(
+    llvm::ArrayRef<llvm::Function *> roots,
+    llvm::function_ref<bool(llvm::Function &)> pred) {
+  std::unordered_set<llvm::Function *> ret;
+  std::vector<llvm::Function *> worklist;
+  auto add = [&](llvm::Function *func) {
+    if (ret.insert(func).second) {
+      worklist.push_back(func);
+    }
+  };
+
+  std::unordered_set<const llvm::Value *> visited;
+  std::function<void(llvm::Value *)> visit = [&](llvm::Value *value) {
+    if (auto func = llvm::dyn_cast<llvm::Function>(value)) {
+      if (pred(*func)) {
+        add(func);
+      }
+    } else if (auto var = llvm::dyn_cast<llvm::GlobalVariable>(value)) {
+      if (var->hasInitializer() && visited.insert(var).second) {
+        visit(var->getInitializer());
+      }
+    } else if (auto constant = llvm::dyn_cast<llvm::Constant>(value)) {
+      // constant expressions and aggregates, e.g. function pointer tables
+      if (visited.insert(constant).second) {
+        for (auto &&op : constant->operands()) {
+          visit(op.get());
+        }
+      }
+    }
+  };
+
+  for (auto root : roots) {
+    add(root);
+  }
+  while (!worklist.empty()) {
+    auto func = worklist.back();
+    worklist.pop_back();
+    for (auto &&bb : *func) {
+      for (auto &&instr : bb) {
+        for (auto &&op : instr.operands()) {
+          visit(op.get());
+        }
+      }
+    }
+  }
+  return ret;
+}
+
+/// Returns the symbols of the lazily loaded `modules` which need to be loaded
+/// regardless of references to them: the @dynamicCompile functions, the
+/// functions of bind instances (incl. bound function pointers, see
+/// `generateBind()`), the functions compiled previously (as retained code may
+/// still reference them) and the global variables and aliases.
+std::vector<llvm::GlobalValue *>
+getLoadRoots(DynamicCompilerContext &jitContext,
+             const JitModuleInfo &moduleInfo,
+             llvm::ArrayRef<std::unique_ptr<llvm::Module>> modules,
+             const llvm::StringMap<llvm::GlobalValue *> &definitions) {
+  std::vector<llvm::GlobalValue *> roots;
+  auto addFunc = [&](llvm::StringRef name) {
+    auto it = definitions.find(name);
+    if (definitions.end() != it) {
+      roots.push_back(it->second);
+      return;
+    }
+    for (auto &&module : modules) {
+      auto func = module->getFunction(name);
+      if (func != nullptr && !func->isDeclaration()) {
+        roots.push_back(func);
+        return;
+      }
+    }
+  };
+  auto addFuncPtr = [&](const void *ptr) {
+    if (ptr == nullptr) {
+      return;
+    }
+    if (auto func = moduleInfo.getFunc(ptr)) {
+      addFunc(func->name);
+    }
+  };
+
+  for (auto &&fun : moduleInfo.functions()) {
+    if (fun.thunkVar != nullptr) {
+      addFunc(fun.name);
+    }
+  }
+  for (auto &&bind : jitContext.getBindInstances()) {
+    auto &desc = bind.second;
+    addFuncPtr(desc.originalFunc);
+    addFuncPtr(desc.exampleFunc);
+    for (auto &&param : desc.params) {
+      auto data = static_cast<const char *>(param.data);
+      for (size_t offset = 0; offset + sizeof(void *) <= param.size;
+           offset += sizeof(void *)) {
+        void *ptr = nullptr;
+        std::memcpy(&ptr, data + offset, sizeof(ptr));
+        addFuncPtr(ptr);
+      }
+    }
+  }
+  for (auto &&module : modules) {
+    for (auto &&func : module->functions()) {
+      if (!func.isDeclaration() &&
+          jitContext.isSymbolCompiled(func.getName())) {
+        roots.push_back(&func);
+      }
+    }
+    for (auto &&var : module->globals()) {
+      roots.push_back(&var);
+    }
+    for (auto &&alias : module->aliases()) {
+      roots.push_back(&alias);
+    }
+  }
+  return roots;
+}
+
+/// Loads the bodies of the functions of the lazily loaded `modules` reachable
+/// from `roots`, following references to symbols defined in other modules via
+/// `definitions`. The other functions are turned into declarations, or removed
+/// if local. Returns the number of loaded functions.
+std::size_t materializeReachableFunctions(
+    const Context &context,
+    llvm::ArrayRef<std::unique_ptr<llvm::Module>> modules,
+    const llvm::StringMap<llvm::GlobalValue *> &definitions,
+    llvm::ArrayRef<llvm::GlobalValue *> roots) {
+  std::vector<llvm::Function *> worklist;
+  std::unordered_set<const llvm::Value *> visited;
+  std::function<void(llvm::Value *)> visit = [&](llvm::Value *value) {
+    if (auto gv = llvm::dyn_cast<llvm::GlobalValue>(value)) {
+      if (gv->isDeclaration() && !gv->hasLocalLinkage()) {
+        auto it = definitions.find(gv->getName());
+        if (definitions.end() != it) {
+          gv = it->second;
+        }
+      }
+      if (!visited.insert(gv).second) {
+        return;
+      }
+      if (auto func = llvm::dyn_cast<llvm::Function>(gv)) {
+        if (auto err = func->materialize()) {
+          fatal(context, "Unable to load function: " +
+                             llvm::toString(std::move(err)));
+        } else if (!func->isDeclaration()) {
+          worklist.push_back(func);
+        }
+      } else if (auto var = llvm::dyn_cast<llvm::GlobalVariable>(gv)) {
+        if (var->hasInitializer()) {
+          visit(var->getInitializer());
+        }
+      } else if (auto alias = llvm::dyn_cast<llvm::GlobalAlias>(gv)) {
+        visit(alias->getAliasee());
+      }
+    } else if (auto constant = llvm::dyn_cast<llvm::Constant>(value)) {
+      // constant expressions and aggregates, e.g. function pointer tables
+      if (visited.insert(constant).second) {
+        for (auto &&op : constant->operands()) {
+          visit(op.get());
+        }
+      }
+    }
+  };
+
+  for (auto root : roots) {
+    visit(root);
+  }
+  std::size_t count = 0;
+  while (!worklist.empty()) {
+    auto func = worklist.back();
+    worklist.pop_back();
+    ++count;
+    if (func->hasPersonalityFn()) {
+      visit(func->getPersonalityFn());
+    }
+    for (auto &&bb : *func) {
+      for (auto &&instr : bb) {
+        for (auto &&op : instr.operands()) {
+          visit(op.get());
+        }
+      }
+    }
+  }
+
+  std::vector<llvm::Function *> unreachableLocals;
+  for (auto &&module : modules) {
+    for (auto &&func : module->functions()) {
+      if (func.isMaterializable()) {
+        if (func.hasLocalLinkage()) {
+          unreachableLocals.push_back(&func);
+        }
+        func.deleteBody();
+        func.setComdat(nullptr);
+      }
+    }
+  }
+  // Only referenced by the dropped bodies.
+  for (auto func : unreachableLocals) {
+    if (func->use_empty()) {
+      func->eraseFromParent();
+    }
+  }
+  return count;
+}
+
+std::unique_ptr<llvm::Module> cloneModule(const llvm::Module &module) {
+#if LDC_LLVM_VER >= 700
+  return llvm::CloneModule(module);
+#else
+  return llvm::CloneModule(&module);
+#endif
+}
+
+/// Returns `ptr` as a constant of pointer type `type`.
+llvm::Constant *getPointerConstant(const llvm::DataLayout &layout,
+                                   const void *ptr, llvm::Type *type) {
+  auto intPtrType = layout.getIntPtrType(type->getContext());
+  return llvm::ConstantExpr::getIntToPtr(
+      llvm::ConstantInt::get(intPtrType, reinterpret_cast<std::uintptr_t>(ptr)),
+      type);
+}
+
+std::string getLazyStubName(llvm::StringRef name) {
+  return (name + ".jit_lazy_stub").str();
+}
+
+/// Compiles a function pending lazy compilation, together with all pending
+/// functions it references.
+void compileLazily(DynamicCompilerContext &jit, const std::string &name) {
+  auto &lazy = jit.getLazyState();
+  assert(lazy.module != nullptr);
+  // The handlers passed to compileDynamicCode() aren't available anymore.
+  Context context;
+  context.optLevel = lazy.settings.optLevel;
+  context.sizeLevel = lazy.settings.sizeLevel;
+
+  auto module = cloneModule(*lazy.module);
+  auto root = module->getFunction(name);
+  assert(root != nullptr);
+  const auto funcs =
+      collectReferencedFunctions(root, [&](llvm::Function &func) {
+        return isJitDefinition(func) && lazy.pending.count(func.getName()) != 0;
+      });
+
+  llvm::StringSet<> defined;
+  std::vector<std::string> definedSymbols;
+  for (auto &&func : module->functions()) {
+    if (!isJitDefinition(func)) {
+      continue;
+    }
+    if (funcs.count(&func) != 0) {
+      defined.insert(func.getName());
+      definedSymbols.push_back(func.getName().str());
+    } else {
+      func.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+      func.setComdat(nullptr);
+    }
+  }
+
+  optimizeModule(context, jit.getTargetMachine(), lazy.settings, *module);
+  verifyModule(context, *module);
+  if (auto err = jit.addModule(std::move(module), definedSymbols, nullptr)) {
+    fatal(context, "Can't codegen module: " + llvm::toString(std::move(err)));
+  }
+
+  auto &layout = jit.getDataLayout();
+  for (auto &&fun : lazy.functions) {
+    if (defined.count(fun.name) == 0) {
+      continue;
+    }
+    auto decorated = decorate(fun.name, layout);
+    auto symbol = jit.findSymbol(decorated);
+    auto addr = resolveSymbol(symbol);
+    if (nullptr == addr) {
+      fatal(context, "Symbol not found in jitted code: \"" + fun.name +
+                         "\" (\"" + decorated + "\")");
+    } else {
+      jit.setThunk(fun.thunkVar, addr);
+    }
+  }
+  for (auto &&sym : definedSymbols) {
+    lazy.pending.erase(sym);
+  }
+}
+
+/// Called by the compile-on-call stubs, returns the compiled function.
+void *compileOnCall(DynamicCompilerContext *jit, unsigned index,
+                    void **thunkVar) {
+  assert(jit != nullptr);
+  assert(thunkVar != nullptr);
+  std::lock_guard<std::mutex> lock(jit->getMutex());
+  auto &lazy = jit->getLazyState();
+  // The stub is outdated if the context has been reset meanwhile, then the
+  // thunk points to the current code.
+  if (index < lazy.functions.size() &&
+      lazy.functions[index].thunkVar == thunkVar &&
+      lazy.pending.count(lazy.functions[index].name) != 0) {
+    compileLazily(*jit, lazy.functions[index].name);
+  }
+  return *thunkVar;
+}
+
+/// Compiles the compile-on-call stubs of the functions with thunks, which have
+/// the signature of the function, compile it and call it.
+void createLazyStubs(const Context &context, DynamicCompilerContext &jit,
+                     const JitModuleInfo &moduleInfo,
+                     const llvm::Module &source) {
+  auto &lazy = jit.getLazyState();
+  assert(lazy.functions.empty());
+  auto &llctx = jit.getContext();
+  auto &layout = jit.getDataLayout();
+  std::unique_ptr<llvm::Module> module(
+      new llvm::Module("ldc.jit.lazy_stubs", llctx));
+  module->setDataLayout(layout);
+
+  auto voidPtrType = llvm::Type::getInt8PtrTy(llctx);
+  auto indexType = llvm::Type::getInt32Ty(llctx);
+  auto toPtr = [&](const void *ptr, llvm::Type *type) {
+    return getPointerConstant(layout, ptr, type);
+  };
+  llvm::Type *compileParams[] = {voidPtrType, indexType,
+                                 voidPtrType->getPointerTo()};
+  auto compileType =
+      llvm::FunctionType::get(voidPtrType, compileParams, false);
+  auto compileFunc = toPtr(reinterpret_cast<const void *>(&compileOnCall),
+                           compileType->getPointerTo());
+
+  std::vector<std::string> stubNames;
+  for (auto &&fun : moduleInfo.functions()) {
+    if (fun.thunkVar == nullptr) {
+      continue;
+    }
+    auto func = source.getFunction(fun.name);
+    if (func == nullptr) {
+      continue;
+    }
+    const auto index = static_cast<unsigned>(lazy.functions.size());
+    lazy.functions.push_back({fun.name.str(), fun.thunkVar, nullptr});
+
+    auto stub = llvm::Function::Create(func->getFunctionType(),
+                                       llvm::GlobalValue::ExternalLinkage,
+                                       getLazyStubName(fun.name), module.get());
+    stub->setCallingConv(func->getCallingConv());
+    stub->setAttributes(func->getAttributes());
+    stubNames.push_back(stub->getName().str());
+
+    llvm::IRBuilder<> builder(llvm::BasicBlock::Create(llctx, "", stub));
+    llvm::Value *compileArgs[] = {
+        toPtr(&jit, voidPtrType), llvm::ConstantInt::get(indexType, index),
+        toPtr(fun.thunkVar, voidPtrType->getPointerTo())};
+#if LDC_LLVM_VER >= 1100
+    auto addr = builder.CreateCall(
+        llvm::FunctionCallee(compileType, compileFunc), compileArgs);
+#else
+    auto addr = builder.CreateCall(compileFunc, compileArgs);
+#endif
+    auto target = builder.CreateBitCast(addr, func->getType());
+    llvm::SmallVector<llvm::Value *, 6> args;
+    for (auto &arg : stub->args()) {
+      args.push_back(&arg);
+    }
+#if LDC_LLVM_VER >= 1100
+    auto ret = builder.CreateCall(
+        llvm::FunctionCallee(func->getFunctionType(), target), args);
+#else
+    auto ret = builder.CreateCall(target, args);
+#endif
+    ret->setCallingConv(func->getCallingConv());
+    ret->setAttributes(func->getAttributes());
+    if (stub->getReturnType()->isVoidTy()) {
+      builder.CreateRetVoid();
+    } else {
+      builder.CreateRet(ret);
+    }
+  }
+  setFunctionsTarget(*module, jit.getTargetMachine());
+
+  if (auto err = jit.addModule(std::move(module), stubNames, nullptr)) {
+    fatal(context,
+          "Can't codegen lazy stubs: " + llvm::toString(std::move(err)));
+    return;
+  }
+  for (auto &&fun : lazy.functions) {
+    auto symbol = jit.findSymbol(decorate(getLazyStubName(fun.name), layout));
+    fun.stub = resolveSymbol(symbol);
+    if (fun.stub == nullptr) {
+      fatal(context, "Lazy stub not found in jitted code: " + fun.name);
+    }
+  }
+}
+
+using TierFunc = DynamicCompilerContext::TierState::Func;
+
+/// Returns the conditional branches of `func`, in a stable order to match
+/// them with their profiling counters.
+std::vector<llvm::BranchInst *> getConditionalBranches(llvm::Function &func) {
+  std::vector<llvm::BranchInst *> ret;
+  for (auto &&bb : func) {
+    auto br = llvm::dyn_cast_or_null<llvm::BranchInst>(bb.getTerminator());
+    if (br != nullptr && br->isConditional()) {
+      ret.push_back(br);
+    }
+  }
+  return ret;
+}
+
+void tierUp(DynamicCompilerContext &jit, const TierFunc *root);
+
+/// Called by the tier 0 code of a function once it becomes hot. `func` may
+/// be freed by a compilation on another thread, so it is only accessed by
+/// `tierUp()`, under the JIT mutex.
+void requestTierUp(DynamicCompilerContext *jit, TierFunc *func) {
+  assert(jit != nullptr);
+  assert(func != nullptr);
+  jit->runInBackground([jit, func]() { tierUp(*jit, func); });
+}
+
+/// Adds the tier 0 profiling counters to `func`, counting its calls and how
+/// often each conditional branch is taken. Entry points, i.e. the functions
+/// with thunks, request their recompilation once they are hot.
+void instrumentTier0(DynamicCompilerContext &jit, llvm::Function &func,
+                     TierFunc &state, bool isEntryPoint) {
+  auto &layout = jit.getDataLayout();
+  auto &llctx = func.getContext();
+  const auto branches = getConditionalBranches(func);
+  state.numBranches = branches.size();
+  state.counters.reset(new uint64_t[1 + 2 * branches.size()]());
+
+  auto counterType = llvm::Type::getInt64Ty(llctx);
+  auto counterPtrType = counterType->getPointerTo();
+  auto getCounter = [&](size_t index) {
+    return getPointerConstant(layout, &state.counters[index], counterPtrType);
+  };
+  // Not atomic, some counts may get lost if called concurrently.
+  auto increment = [&](llvm::IRBuilder<> &builder, llvm::Value *counter) {
+    auto value = builder.CreateLoad(counterType, counter, "jit_tier_counter");
+    auto newValue =
+        builder.CreateAdd(value, llvm::ConstantInt::get(counterType, 1));
+    builder.CreateStore(newValue, counter);
+    return newValue;
+  };
+
+  for (size_t i = 0; i < branches.size(); ++i) {
+    llvm::IRBuilder<> builder(branches[i]);
+    auto counter =
+        builder.CreateSelect(branches[i]->getCondition(),
+                             getCounter(1 + 2 * i), getCounter(2 + 2 * i));
+    increment(builder, counter);
+  }
+
+  // Keep the allocas in the entry block.
+  auto it = func.getEntryBlock().getFirstInsertionPt();
+  while (llvm::isa<llvm::AllocaInst>(*it)) {
+    ++it;
+  }
+  llvm::IRBuilder<> builder(&*it);
+  auto calls = increment(builder, getCounter(0));
+  if (!isEntryPoint) {
+    return;
+  }
+  auto isHot = builder.CreateICmpEQ(
+      calls, llvm::ConstantInt::get(counterType, tierUpThreshold));
+  builder.SetInsertPoint(llvm::SplitBlockAndInsertIfThen(isHot, &*it, false));
+  auto voidPtrType = llvm::Type::getInt8PtrTy(llctx);
+  llvm::Type *params[] = {voidPtrType, voidPtrType};
+  auto requestType =
+      llvm::FunctionType::get(llvm::Type::getVoidTy(llctx), params, false);
+  auto requestFunc =
+      getPointerConstant(layout, reinterpret_cast<const void *>(&requestTierUp),
+                         requestType->getPointerTo());
+  llvm::Value *args[] = {getPointerConstant(layout, &jit, voidPtrType),
+                         getPointerConstant(layout, &state, voidPtrType)};
+#if LDC_LLVM_VER >= 1100
+  builder.CreateCall(llvm::FunctionCallee(requestType, requestFunc), args);
+#else
+  builder.CreateCall(requestFunc, args);
+#endif
+}
+
+/// Attaches the profile collected by the tier 0 code of `func`.
+void setProfile(llvm::Function &func, const TierFunc &state) {
+  const auto branches = getConditionalBranches(func);
+  if (branches.size() != state.numBranches) {
+    return;
+  }
+  if (state.counters[0] != 0) {
+    func.setEntryCount(state.counters[0]);
+  }
+  llvm::MDBuilder builder(func.getContext());
+  for (size_t i = 0; i < branches.size(); ++i) {
+    const auto taken = state.counters[1 + 2 * i];
+    const auto notTaken = state.counters[2 + 2 * i];
+    if (taken == 0 && notTaken == 0) {
+      continue;
+    }
+    // Branch weights are 32 bit.
+    const uint64_t scale =
+        std::max(taken, notTaken) / std::numeric_limits<uint32_t>::max() + 1;
+    branches[i]->setMetadata(
+        llvm::LLVMContext::MD_prof,
+        builder.createBranchWeights(static_cast<uint32_t>(taken / scale),
+                                    static_cast<uint32_t>(notTaken / scale)));
+  }
+}
+
+/// Recompiles a hot function, together with all tier 0 functions it
+/// references, using their profiles and swaps in the new code. The tier 1
+/// code is added under separate names, as other tier 0 code may still call
+/// the tier 0 code.
+void tierUp(DynamicCompilerContext &jit, const TierFunc *root) {
+  std::lock_guard<std::mutex> lock(jit.getMutex());
+  auto &tier = jit.getTierState();
+  // The function may have been recompiled or the context reset meanwhile, so
+  // `root` is only dereferenced if it is still current.
+  auto rootIt = std::find_if(
+      tier.current.begin(), tier.current.end(),
+      [root](const llvm::StringMapEntry<TierFunc *> &it) {
+        return it.second == root;
+      });
+  if (tier.module == nullptr || tier.current.end() == rootIt ||
+      root->tieredUp) {
+    return;
+  }
+  const std::string name = root->name;
+
+  // There is no one to report errors to, the function just stays at tier 0.
+  bool failed = false;
+  Context context;
+  context.optLevel = tier.settings.optLevel;
+  context.sizeLevel = tier.settings.sizeLevel;
+  context.fatalHandler = [](void *data, const char *) {
+    *static_cast<bool *>(data) = true;
+  };
+  context.fatalHandlerData = &failed;
+
+  auto module = cloneModule(*tier.module);
+  auto rootFunc = module->getFunction(name);
+  if (rootFunc == nullptr) {
+    return;
+  }
+  auto getState = [&](llvm::StringRef funcName) -> TierFunc * {
+    auto it = tier.current.find(funcName);
+    return tier.current.end() != it ? it->second : nullptr;
+  };
+  const auto funcs =
+      collectReferencedFunctions(rootFunc, [&](llvm::Function &func) {
+        auto state = getState(func.getName());
+        return isJitDefinition(func) && state != nullptr && !state->tieredUp;
+      });
+
+  std::vector<TierFunc *> defined;
+  std::vector<std::string> definedSymbols;
+  for (auto &&func : module->functions()) {
+    if (!isJitDefinition(func)) {
+      continue;
+    }
+    // Also for the functions which are only available for inlining.
+    auto state = getState(func.getName());
+    if (state != nullptr) {
+      setProfile(func, *state);
+    }
+    const bool isDefined = funcs.count(&func) != 0;
+    if (isDefined || (state != nullptr && state->tieredUp)) {
+      func.setName(getTier1Name(state->name));
+    }
+    if (isDefined) {
+      defined.push_back(state);
+      definedSymbols.push_back(func.getName().str());
+    } else {
+      func.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+      func.setComdat(nullptr);
+    }
+  }
+
+  optimizeModule(context, jit.getTargetMachine(), tier.settings, *module);
+  verifyModule(context, *module);
+  if (failed) {
+    return;
+  }
+  if (tier.dumpModules) {
+    std::string str;
+    llvm::raw_string_ostream os(str);
+    module->print(os, nullptr, false, true);
+    tier.optimizedModules.push_back(std::move(os.str()));
+  }
+  if (auto err = jit.addModule(std::move(module), definedSymbols, nullptr)) {
+    llvm::consumeError(std::move(err));
+    return;
+  }
+
+  auto &layout = jit.getDataLayout();
+  auto getAddress = [&](const std::string &funcName) {
+    auto symbol = jit.findSymbol(decorate(funcName, layout));
+    return resolveSymbol(symbol);
+  };
+  for (auto state : defined) {
+    assert(state != nullptr);
+    state->tieredUp = true;
+    if (state->thunkVar != nullptr) {
+      if (auto addr = getAddress(getTier1Name(state->name))) {
+        jit.setThunk(state->thunkVar, addr);
+      }
+    }
+  }
+  for (auto &&bind : jit.getBindInstances()) {
+    auto funcName = getBindFuncName(bind.second.specialization);
+    auto state = getState(funcName);
+    if (state != nullptr && state->tieredUp) {
+      if (auto addr = getAddress(getTier1Name(funcName))) {
+        jit.setThunk(static_cast<void **>(bind.first), addr);
+      }
+    }
+  }
+}
+
+/// Keeps the code of the bind specializations without instances for reuse, as
+/// long as nothing they may call or have inlined is recompiled, and evicts the
+/// least recently used ones while the memory limit is exceeded.
+void retainUnusedBindSpecializations(
+    const Context &context, DynamicCompilerContext &jit,
+    const std::unordered_set<llvm::Function *> &affected,
+    llvm::StringSet<> &liveSymbols) {
+  auto &unused = jit.getUnusedBindSpecializations();
+  if (unused.empty()) {
+    return;
+  }
+  const bool changed = std::any_of(
+      affected.begin(), affected.end(),
+      [](llvm::Function *func) { return !isBindFunction(func->getName()); });
+  unused.erase(std::remove_if(unused.begin(), unused.end(),
+                              [&](const std::string &spec) {
+                                return changed || !jit.isSymbolCompiled(
+                                                      getBindFuncName(spec));
+                              }),
+               unused.end());
+
+  const auto limit = getJitMemoryLimit();
+  llvm::StringSet<> evicted;
+  size_t count = 0;
+  while (count < unused.size() &&
+         jit.getMemoryUsage() - jit.getReclaimableMemory(evicted) > limit) {
+    evicted.insert(getBindFuncName(unused[count]));
+    ++count;
+  }
+  unused.erase(unused.begin(), unused.begin() + count);
+  if (count != 0) {
+    interruptPoint(context, "Evict unused bind specializations",
+                   std::to_string(count).c_str());
+  }
+
+  for (auto &&spec : unused) {
+    liveSymbols.insert(getBindFuncName(spec));
+  }
+}
+
 struct JitFinaliser final {
   DynamicCompilerContext &jit;
   bool finalized = false;
@@ -321,15 +1120,39 @@ struct JitFinaliser final {
   void finalze() { finalized = true; }
 };
 
+// Forwards fatal errors to the user's handler and records them, so that the
+// compilation can be abandoned if the handler returns (e.g. for asynchronous
+// compilation).
+struct FatalErrorRecorder final {
+  const Context &userContext;
+  bool failed = false;
+
+  explicit FatalErrorRecorder(const Context &c) : userContext(c) {}
+
+  static void handler(void *data, const char *reason) {
+    auto self = static_cast<FatalErrorRecorder *>(data);
+    if (!self->failed) {
+      self->failed = true;
+      self->userContext.fatalHandler(self->userContext.fatalHandlerData,
+                                     reason);
+    }
+  }
+};
+
 void rtCompileProcessImplSoInternal(const RtCompileModuleList *modlist_head,
-                                    const Context &context) {
+                                    const Context &context,
+                                    const bool &failed) {
   if (nullptr == modlist_head) {
     // No jit modules to compile
     return;
   }
+  EventScope compileEvent(context, CompilerStage::Compile);
   interruptPoint(context, "Init");
   DynamicCompilerContext &myJit = getJit(context.compilerContext);
 
+  // Falls back to the statically compiled code on failure.
+  JitFinaliser jitFinalizer(myJit);
+
   JitModuleInfo moduleInfo(context, modlist_head);
   std::unique_ptr<llvm::Module> finalModule;
   myJit.clearSymMap();
@@ -337,85 +1160,347 @@ void rtCompileProcessImplSoInternal(const RtCompileModuleList *modlist_head,
   OptimizerSettings settings;
   settings.optLevel = context.optLevel;
   settings.sizeLevel = context.sizeLevel;
+
+  // Code compiled with other settings can't be reused.
+  const std::string settingsStr = std::to_string(settings.optLevel) + " " +
+                                  std::to_string(settings.sizeLevel) + " " +
+                                  getJitOptionsString().str();
+  if (myJit.getCompiledState().settings != settingsStr) {
+    myJit.reset();
+  }
+
+  DynamicCompilerContext::CompiledState newState;
+  newState.settings = settingsStr;
+
+  // With lazy loading, only the functions reachable from the entry points,
+  // bind instances and globals are read from the bitcode.
+  std::vector<std::unique_ptr<llvm::Module>> modules;
+  std::vector<const RtCompileModuleList *> moduleLists;
+  llvm::StringMap<llvm::GlobalValue *> definitions;
   enumModules(modlist_head, context, [&](const RtCompileModuleList &current) {
+    EventScope parseEvent(context, CompilerStage::Parse);
+    parseEvent.event.irBytes = static_cast<std::size_t>(current.irDataSize);
     interruptPoint(context, "load IR");
-    auto buff = llvm::MemoryBuffer::getMemBuffer(
+    const llvm::MemoryBufferRef buff(
         llvm::StringRef(current.irData,
                         static_cast<std::size_t>(current.irDataSize)),
-        "", false);
+        "");
     interruptPoint(context, "parse IR");
-    auto mod = llvm::parseBitcodeFile(*buff, myJit.getContext());
+    auto mod = lazyLoad ? llvm::getLazyBitcodeModule(buff, myJit.getContext(),
+                                                     /*lazy metadata*/ true)
+                        : llvm::parseBitcodeFile(buff, myJit.getContext());
     if (!mod) {
       fatal(context, "Unable to parse IR: " + llvm::toString(mod.takeError()));
-    } else {
-      llvm::Module &module = **mod;
-      const auto name = module.getName();
-      interruptPoint(context, "Verify module", name.data());
-      verifyModule(context, module);
+      return;
+    }
+    auto &module = **mod;
+    parseEvent.setModule(module.getName());
+    if (parseEvent.isEnabled()) {
+      parseEvent.event.irInstructions = getInstructionCount(module);
+    }
+    for (auto &&val : module.global_values()) {
+      if (!val.isDeclaration() && !val.hasLocalLinkage()) {
+        definitions.insert({val.getName(), &val});
+      }
+    }
+    modules.push_back(std::move(*mod));
+    moduleLists.push_back(&current);
+  });
+  if (failed) {
+    return;
+  }
+
+  if (lazyLoad) {
+    EventScope materializeEvent(context, CompilerStage::Materialize);
+    interruptPoint(context, "Load reachable functions");
+    const auto roots = getLoadRoots(myJit, moduleInfo, modules, definitions);
+    const auto count =
+        materializeReachableFunctions(context, modules, definitions, roots);
+    if (failed) {
+      return;
+    }
+    if (materializeEvent.isEnabled()) {
+      for (auto &&module : modules) {
+        materializeEvent.event.irInstructions += getInstructionCount(*module);
+      }
+    }
+    interruptPoint(context, "Loaded functions", std::to_string(count).c_str());
+  }
+  definitions.clear();
 
-      dumpModule(context, module, DumpStage::OriginalModule);
-      setFunctionsTarget(module, myJit.getTargetMachine());
+  for (std::size_t i = 0; i < modules.size() && !failed; ++i) {
+    const RtCompileModuleList &current = *moduleLists[i];
+    auto &module = *modules[i];
+    const auto name = module.getName();
+    EventScope linkEvent(context, CompilerStage::Link);
+    linkEvent.setModule(name);
+    if (auto err = module.materializeAll()) {
+      fatal(context,
+            "Unable to load module: " + llvm::toString(std::move(err)));
+      break;
+    }
+    interruptPoint(context, "Verify module", name.data());
+    verifyModule(context, module);
 
-      module.setDataLayout(myJit.getTargetMachine().createDataLayout());
+    dumpModule(context, module, DumpStage::OriginalModule);
+    setFunctionsTarget(module, myJit.getTargetMachine());
 
-      interruptPoint(context, "setRtCompileVars", name.data());
-      setRtCompileVars(context, module,
-                       toArray(current.varList,
-                               static_cast<std::size_t>(current.varListSize)));
+    module.setDataLayout(myJit.getTargetMachine().createDataLayout());
 
-      if (nullptr == finalModule) {
-        finalModule = std::move(*mod);
-      } else {
-        if (llvm::Linker::linkModules(*finalModule, std::move(*mod))) {
-          fatal(context, "Can't merge module");
-        }
-      }
+    interruptPoint(context, "setRtCompileVars", name.data());
+    const auto vars =
+        toArray(current.varList, static_cast<std::size_t>(current.varListSize));
+    collectRtCompileVarValues(module, vars, myJit.getCompiledState(),
+                              newState.varValues);
+    setRtCompileVars(context, module, vars);
 
-      for (auto &&sym : toArray(current.symList, static_cast<std::size_t>(
-                                                     current.symListSize))) {
-        myJit.addSymbol(decorate(sym.name, layout), sym.sym);
+    if (nullptr == finalModule) {
+      finalModule = std::move(modules[i]);
+    } else {
+      if (llvm::Linker::linkModules(*finalModule, std::move(modules[i]))) {
+        fatal(context, "Can't merge module");
       }
     }
-  });
+
+    for (auto &&sym : toArray(current.symList,
+                              static_cast<std::size_t>(current.symListSize))) {
+      myJit.addSymbol(decorate(sym.name, layout), sym.sym);
+    }
+  }
+  if (failed) {
+    return;
+  }
 
   assert(nullptr != finalModule);
 
-  interruptPoint(context, "Generate bind functions");
-  generateBind(context, myJit, moduleInfo, *finalModule);
+  if (nullptr != context.interruptPointHandler) {
+    const auto str =
+        std::to_string(myJit.getBindInstances().size()) + " instances, " +
+        std::to_string(myJit.getBindSpecializations().size()) +
+        " specializations";
+    interruptPoint(context, "Generate bind functions", str.c_str());
+  }
+  {
+    EventScope bindEvent(context, CompilerStage::Bind);
+    generateBind(context, myJit, moduleInfo, *finalModule);
+  }
+  if (failed) {
+    return;
+  }
   dumpModule(context, *finalModule, DumpStage::MergedModule);
-  interruptPoint(context, "Optimize final module");
-  optimizeModule(context, myJit.getTargetMachine(), settings, *finalModule);
 
-  interruptPoint(context, "Verify final module");
-  verifyModule(context, *finalModule);
+  // Only compile what has changed since the last compilation, the previously
+  // compiled definitions of the other functions are kept and referenced.
+  interruptPoint(context, "Find affected functions");
+  llvm::StringSet<> liveSymbols;
+  const auto affected = findAffectedFunctions(myJit, *finalModule);
 
-  dumpModule(context, *finalModule, DumpStage::OptimizedModule);
+  // With lazy compilation, only the affected bind functions (and the affected
+  // or pending functions they reference) are compiled now, the other affected
+  // functions on their first call.
+  const bool lazy = lazyCompile && myJit.isMainContext();
+  auto &lazyState = myJit.getLazyState();
+  std::unordered_set<llvm::Function *> toCompile;
+  if (lazy) {
+    std::vector<llvm::Function *> roots;
+    for (auto &&bind : moduleInfo.getBindHandles()) {
+      auto func = finalModule->getFunction(bind.name);
+      if (affected.count(func) != 0) {
+        roots.push_back(func);
+      }
+    }
+    toCompile = collectReferencedFunctions(roots, [&](llvm::Function &func) {
+      return affected.count(&func) != 0 ||
+             lazyState.pending.count(func.getName()) != 0;
+    });
+    lazyState.module = cloneModule(*finalModule);
+    lazyState.settings = settings;
+    for (auto &&fun : lazyState.functions) {
+      liveSymbols.insert(getLazyStubName(fun.name));
+    }
+  } else {
+    toCompile = affected;
+  }
 
-  interruptPoint(context, "Codegen final module");
-  if (nullptr != context.dumpHandler) {
-    auto callback = [&](const char *str, size_t len) {
-      context.dumpHandler(context.dumpHandlerData, DumpStage::FinalAsm, str,
-                          len);
-    };
+  // With tiered compilation, the affected functions are compiled quickly
+  // with profiling counters first and recompiled once hot, see `tierUp()`.
+  const bool tiered = tierUpThreshold != 0 && !lazy && myJit.isMainContext();
+  auto &tierState = myJit.getTierState();
+  if (tiered) {
+    tierState.module = cloneModule(*finalModule);
+    tierState.settings = settings;
+    tierState.settings.optLevel = 3;
+    tierState.dumpModules = nullptr != context.dumpHandler;
+    settings.optLevel = 0;
+    settings.sizeLevel = 0;
+  }
 
-    CallbackOstream os(callback);
-    if (auto err = myJit.addModule(std::move(finalModule), &os)) {
-      fatal(context, "Can't codegen module: " + llvm::toString(std::move(err)));
+  std::vector<std::string> definedSymbols;
+  for (auto &&func : finalModule->functions()) {
+    if (!isJitDefinition(func)) {
+      continue;
+    }
+    liveSymbols.insert(func.getName());
+    if (toCompile.count(&func) != 0) {
+      definedSymbols.push_back(func.getName().str());
+      lazyState.pending.erase(func.getName());
+    } else {
+      if (lazy && affected.count(&func) != 0) {
+        lazyState.pending.insert(func.getName());
+      }
+      if (getCurrentName(myJit, func.getName()) != func.getName()) {
+        liveSymbols.insert(getTier1Name(func.getName()));
+      }
+      // Still available for inlining.
+      func.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+      func.setComdat(nullptr);
+    }
+  }
+  retainUnusedBindSpecializations(context, myJit, affected, liveSymbols);
+  myJit.retainSymbols(liveSymbols);
+
+  if (tiered && !toCompile.empty()) {
+    interruptPoint(context, "Instrument tier 0 functions");
+    // The entry points, bind functions are resolved by their specialization.
+    llvm::StringMap<void **> thunkVars;
+    for (auto &&fun : moduleInfo.functions()) {
+      if (fun.thunkVar != nullptr) {
+        thunkVars.insert({fun.name, fun.thunkVar});
+      }
+    }
+    for (auto &&bind : moduleInfo.getBindHandles()) {
+      thunkVars.insert({bind.name, nullptr});
+    }
+    for (auto &&func : finalModule->functions()) {
+      if (!isJitDefinition(func) || toCompile.count(&func) == 0) {
+        continue;
+      }
+      std::unique_ptr<TierFunc> state(new TierFunc);
+      state->name = func.getName().str();
+      auto it = thunkVars.find(func.getName());
+      const bool isEntryPoint = thunkVars.end() != it;
+      if (isEntryPoint) {
+        state->thunkVar = it->second;
+      }
+      instrumentTier0(myJit, func, *state, isEntryPoint);
+      interruptPoint(context, "Tier 0", state->name.c_str());
+      myJit.setTier0Profile(std::move(state));
     }
+  }
+
+  if (toCompile.empty()) {
+    interruptPoint(context, "Nothing to recompile");
   } else {
-    if (auto err = myJit.addModule(std::move(finalModule), nullptr)) {
-      fatal(context, "Can't codegen module: " + llvm::toString(std::move(err)));
+    const unsigned partitions = getCodegenPartitions();
+    std::string cacheKey;
+    // Cached or parallel compiled object files.
+    std::vector<std::unique_ptr<llvm::MemoryBuffer>> objects;
+    // Tier 0 code references the profiling counters of this process.
+    if (JitObjectCache::isEnabled() && !tiered) {
+      interruptPoint(context, "Compute object cache key");
+      cacheKey = JitObjectCache::computeKey(*finalModule,
+                                            myJit.getTargetMachine(), settings);
+      auto &cache = getJitObjectCache();
+      if (partitions > 1) {
+        for (unsigned i = 0; i < partitions; ++i) {
+          auto object = cache.lookup(getPartitionCacheKey(cacheKey, i));
+          if (object == nullptr) {
+            objects.clear();
+            break;
+          }
+          objects.push_back(std::move(object));
+        }
+      } else if (auto object = cache.lookup(cacheKey)) {
+        objects.push_back(std::move(object));
+      }
+      if (!objects.empty()) {
+        interruptPoint(context, "Load cached object", cacheKey.c_str());
+      } else {
+        // The object file is stored under this key after codegen.
+        finalModule->setModuleIdentifier(cacheKey);
+      }
+    }
+
+    // Also covers loading cached object files.
+    EventScope codegenEvent(context, CompilerStage::Codegen);
+    codegenEvent.setModule(finalModule->getName());
+    if (objects.empty()) {
+      interruptPoint(context, "Optimize final module");
+      optimizeModule(context, myJit.getTargetMachine(), settings,
+                     *finalModule);
+
+      interruptPoint(context, "Verify final module");
+      verifyModule(context, *finalModule);
+      if (failed) {
+        return;
+      }
+
+      dumpModule(context, *finalModule, DumpStage::OptimizedModule);
+
+      interruptPoint(context, "Codegen final module");
+      codegenEvent.start();
+      if (partitions > 1) {
+        auto result = codegenParallel(std::move(finalModule),
+                                      myJit.getTargetMachine(), partitions,
+                                      cacheKey);
+        if (!result) {
+          fatal(context,
+                "Can't codegen module: " + llvm::toString(result.takeError()));
+          return;
+        }
+        objects = std::move(*result);
+      }
+    }
+
+    auto addToJit = [&](llvm::raw_ostream *asmListener) {
+      if (!objects.empty()) {
+        if (auto err = myJit.addObjects(std::move(objects), definedSymbols,
+                                        asmListener)) {
+          fatal(context,
+                "Can't load object files: " + llvm::toString(std::move(err)));
+        }
+      } else if (auto err = myJit.addModule(std::move(finalModule),
+                                            definedSymbols, asmListener)) {
+        fatal(context,
+              "Can't codegen module: " + llvm::toString(std::move(err)));
+      }
+    };
+    const auto memoryUsage = myJit.getMemoryUsage();
+    if (nullptr != context.dumpHandler) {
+      auto callback = [&](const char *str, size_t len) {
+        context.dumpHandler(context.dumpHandlerData, DumpStage::FinalAsm, str,
+                            len);
+      };
+
+      CallbackOstream os(callback);
+      addToJit(&os);
+    } else {
+      addToJit(nullptr);
+    }
+    codegenEvent.event.objectBytes = myJit.getMemoryUsage() - memoryUsage;
+    codegenEvent.finish();
+    if (failed) {
+      return;
     }
   }
 
-  JitFinaliser jitFinalizer(myJit);
+  if (lazy && lazyState.functions.empty()) {
+    interruptPoint(context, "Compile lazy stubs");
+    createLazyStubs(context, myJit, moduleInfo, *lazyState.module);
+    if (failed) {
+      return;
+    }
+  }
+
+  EventScope resolveEvent(context, CompilerStage::Resolve);
   if (myJit.isMainContext()) {
     interruptPoint(context, "Resolve functions");
     for (auto &&fun : moduleInfo.functions()) {
-      if (fun.thunkVar == nullptr) {
+      if (fun.thunkVar == nullptr ||
+          lazyState.pending.count(fun.name) != 0) {
         continue;
       }
-      auto decorated = decorate(fun.name, layout);
+      auto decorated = decorate(getCurrentName(myJit, fun.name), layout);
       auto symbol = myJit.findSymbol(decorated);
       auto addr = resolveSymbol(symbol);
       if (nullptr == addr) {
@@ -423,7 +1508,7 @@ void rtCompileProcessImplSoInternal(const RtCompileModuleList *modlist_head,
                            fun.name.data() + "\" (\"" + decorated + "\")";
         fatal(context, desc);
       } else {
-        *fun.thunkVar = addr;
+        myJit.setThunk(fun.thunkVar, addr);
       }
 
       if (nullptr != context.interruptPointHandler) {
@@ -433,9 +1518,34 @@ void rtCompileProcessImplSoInternal(const RtCompileModuleList *modlist_head,
         interruptPoint(context, "Resolved", str.c_str());
       }
     }
+    for (auto &&fun : lazyState.functions) {
+      if (lazyState.pending.count(fun.name) != 0) {
+        myJit.setThunk(fun.thunkVar, fun.stub);
+        interruptPoint(context, "Compile on call", fun.name.c_str());
+      }
+    }
+    if (nullptr != context.dumpHandler) {
+      for (auto &&str : tierState.optimizedModules) {
+        context.dumpHandler(context.dumpHandlerData, DumpStage::OptimizedModule,
+                            str.data(), str.size());
+      }
+    }
+    tierState.optimizedModules.clear();
+    if (nullptr != context.interruptPointHandler) {
+      for (auto &&func : tierState.current) {
+        if (func.second->tieredUp) {
+          interruptPoint(context, "Tier 1", func.second->name.c_str());
+        }
+      }
+    }
   }
   interruptPoint(context, "Update bind handles");
   applyBind(context, myJit, moduleInfo);
+  resolveEvent.finish();
+  if (failed) {
+    return;
+  }
+  myJit.getCompiledState() = std::move(newState);
   jitFinalizer.finalze();
 }
 
@@ -446,8 +1556,17 @@ EXTERNAL void JIT_API_ENTRYPOINT(const void *modlist_head,
                                  const Context *context, size_t contextSize) {
   assert(nullptr != context);
   assert(sizeof(*context) == contextSize);
+  Context ctx = *context;
+  FatalErrorRecorder errors(*context);
+  if (nullptr != ctx.fatalHandler) {
+    ctx.fatalHandler = &FatalErrorRecorder::handler;
+    ctx.fatalHandlerData = &errors;
+  }
+  DynamicCompilerContext &myJit = getJit(ctx.compilerContext);
+  std::lock_guard<std::mutex> lock(myJit.getMutex());
   rtCompileProcessImplSoInternal(
-      static_cast<const RtCompileModuleList *>(modlist_head), *context);
+      static_cast<const RtCompileModuleList *>(modlist_head), ctx,
+      errors.failed);
 }
 
 EXTERNAL void JIT_REG_BIND_PAYLOAD(class DynamicCompilerContext *context,
@@ -458,6 +1577,7 @@ EXTERNAL void JIT_REG_BIND_PAYLOAD(class DynamicCompilerContext *context,
   assert(originalFunc != nullptr);
   assert(exampleFunc != nullptr);
   DynamicCompilerContext &myJit = getJit(context);
+  std::lock_guard<std::mutex> lock(myJit.getMutex());
   myJit.registerBind(handle, originalFunc, exampleFunc,
                      toArray(params, paramsSize));
 }
@@ -466,6 +1586,7 @@ EXTERNAL void JIT_UNREG_BIND_PAYLOAD(class DynamicCompilerContext *context,
                                      void *handle) {
   assert(handle != nullptr);
   DynamicCompilerContext &myJit = getJit(context);
+  std::lock_guard<std::mutex> lock(myJit.getMutex());
   myJit.unregisterBind(handle);
 }
 
@@ -478,10 +1599,25 @@ EXTERNAL void JIT_DESTROY_COMPILER_CONTEXT(DynamicCompilerContext *context) {
   delete context;
 }
 
+EXTERNAL void JIT_GET_STATS(class DynamicCompilerContext *context,
+                            CompilerStats *stats, size_t statsSize) {
+  assert(stats != nullptr);
+  assert(sizeof(*stats) == statsSize);
+  DynamicCompilerContext &myJit = getJit(context);
+  std::lock_guard<std::mutex> lock(myJit.getMutex());
+  myJit.getStats(*stats);
+}
+
 EXTERNAL bool JIT_SET_OPTS(const Slice<Slice<const char>> *args,
                            void (*errs)(void *, const char *, size_t),
                            void *errsContext) {
   assert(args != nullptr);
   return parseOptions(*args, errs, errsContext);
 }
+
+EXTERNAL void JIT_RECLAIM(class DynamicCompilerContext *context) {
+  DynamicCompilerContext &myJit = getJit(context);
+  std::lock_guard<std::mutex> lock(myJit.getMutex());
+  myJit.removeRetiredModules();
+}
 }
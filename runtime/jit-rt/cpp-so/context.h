@@ -49,6 +49,8 @@ enum { ApiVersion = LDC_DYNAMIC_COMPILE_API_VERSION };
 #define JIT_DESTROY_COMPILER_CONTEXT                                           \
   MAKE_JIT_API_CALL(destroyDynamicCompilerContextSo)
 #define JIT_SET_OPTS MAKE_JIT_API_CALL(setDynamicCompilerOptsImpl)
+#define JIT_GET_STATS MAKE_JIT_API_CALL(getDynamicCompilerStatsSo)
+#define JIT_RECLAIM MAKE_JIT_API_CALL(reclaimDynamicCodeSo)
 
 typedef void (*InterruptPointHandlerT)(void *, const char *action,
                                        const char *object);
@@ -56,6 +58,34 @@ typedef void (*FatalHandlerT)(void *, const char *reason);
 typedef void (*DumpHandlerT)(void *, DumpStage stage, const char *str,
                              std::size_t len);
 
+// Must be kept in sync with CompilerStage in dynamic_compile.d.
+enum class CompilerStage : int {
+  Compile = 0,
+  Parse = 1,
+  Link = 2,
+  Bind = 3,
+  Optimize = 4,
+  OptimizeFunction = 5,
+  Codegen = 6,
+  Resolve = 7,
+  Materialize = 8
+};
+
+// Must be kept in sync with CompilerEvent in dynamic_compile.d.
+struct CompilerEvent final {
+  CompilerStage stage = CompilerStage::Compile;
+  // Nanoseconds of a monotonic clock.
+  uint64_t startTime = 0;
+  uint64_t endTime = 0;
+  const char *moduleName = nullptr;
+  const char *functionName = nullptr;
+  std::size_t irBytes = 0;
+  std::size_t irInstructions = 0;
+  std::size_t objectBytes = 0;
+};
+
+typedef void (*EventHandlerT)(void *, const CompilerEvent *event);
+
 class DynamicCompilerContext;
 
 struct Context final {
@@ -68,4 +98,17 @@ struct Context final {
   DumpHandlerT dumpHandler = nullptr;
   void *dumpHandlerData = nullptr;
   DynamicCompilerContext *compilerContext = nullptr;
+  EventHandlerT eventHandler = nullptr;
+  void *eventHandlerData = nullptr;
+};
+
+// Must be kept in sync with DynamicCompilerStats in dynamic_compile.d.
+struct CompilerStats final {
+  std::size_t codeBytes = 0;
+  std::size_t dataBytes = 0;
+  std::size_t modules = 0;
+  std::size_t retiredModules = 0;
+  std::size_t bindInstances = 0;
+  std::size_t bindSpecializations = 0;
+  std::size_t unusedBindSpecializations = 0;
 };
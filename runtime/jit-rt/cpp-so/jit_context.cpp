@@ -14,18 +14,25 @@
 
 #include "jit_context.h"
 
+#include <algorithm>
 #include <cassert>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/ExecutionEngine/RuntimeDyld.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/MD5.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 
+#include "object_cache.h"
+
 namespace {
 
 llvm::SmallVector<std::string, 4> getHostAttrs() {
@@ -54,6 +61,15 @@ StaticInitHelper &staticInit() {
   return obj;
 }
 
+void storeThunk(void **thunk, void *addr) {
+  // Other threads may be calling through the thunk.
+#ifdef _MSC_VER
+  _InterlockedExchangePointer(thunk, addr);
+#else
+  __atomic_store_n(thunk, addr, __ATOMIC_RELEASE);
+#endif
+}
+
 std::unique_ptr<llvm::TargetMachine> createTargetMachine() {
   staticInit();
 
@@ -103,29 +119,38 @@ DynamicCompilerContext::DynamicCompilerContext(bool isMainContext)
       execSession(stringPool), resolver(createResolver()),
       objectLayer(execSession,
                   [this](llvm::orc::VModuleKey) {
-                    return ObjectLayerT::Resources{
-                        std::make_shared<llvm::SectionMemoryManager>(),
-                        resolver};
+                    return ObjectLayerT::Resources{createMemoryManager(),
+                                                   resolver};
                   }),
 #else
-      objectLayer(
-          []() { return std::make_shared<llvm::SectionMemoryManager>(); }),
+      objectLayer([this]() { return createMemoryManager(); }),
 #endif
       listenerlayer(objectLayer, ModuleListener(*targetmachine)),
-      compileLayer(listenerlayer, llvm::orc::SimpleCompiler(*targetmachine)),
+      compileLayer(listenerlayer, llvm::orc::SimpleCompiler(
+                                      *targetmachine, &getJitObjectCache())),
       mainContext(isMainContext) {
   llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
 }
 
-DynamicCompilerContext::~DynamicCompilerContext() {}
+DynamicCompilerContext::~DynamicCompilerContext() {
+  {
+    std::lock_guard<std::mutex> lock(backgroundMutex);
+    stopBackground = true;
+  }
+  backgroundCondition.notify_one();
+  if (backgroundThread.joinable()) {
+    backgroundThread.join();
+  }
+}
 
 llvm::Error
 DynamicCompilerContext::addModule(std::unique_ptr<llvm::Module> module,
+                                  llvm::ArrayRef<std::string> definedSymbols,
                                   llvm::raw_ostream *asmListener) {
   assert(nullptr != module);
-  reset();
 
   ListenerCleaner cleaner(*this, asmListener);
+  newMemoryManagers.clear();
   // Add the set to the JIT with the resolver we created above
 #if LDC_LLVM_VER >= 700
   auto handle = execSession.allocateVModule();
@@ -138,21 +163,180 @@ DynamicCompilerContext::addModule(std::unique_ptr<llvm::Module> module,
     execSession.releaseVModule(handle);
     return err;
   }
-  moduleHandle = handle;
+  addGeneration(handle, definedSymbols);
 #else
   auto result = compileLayer.addModule(std::move(module), createResolver());
   if (!result) {
     return llvm::make_error<llvm::StringError>("addModule failed",
                                                llvm::inconvertibleErrorCode());
   }
-  moduleHandle = result.get();
+  addGeneration(result.get(), definedSymbols);
+#endif
+  return llvm::Error::success();
+}
+
+llvm::Error DynamicCompilerContext::addObjects(
+    std::vector<std::unique_ptr<llvm::MemoryBuffer>> objects,
+    llvm::ArrayRef<std::string> definedSymbols,
+    llvm::raw_ostream *asmListener) {
+  assert(!objects.empty());
+
+  ListenerCleaner cleaner(*this, asmListener);
+  newMemoryManagers.clear();
+  llvm::SmallVector<ModuleHandleT, 1> handles;
+#if LDC_LLVM_VER >= 700
+  auto releaseHandles = [&]() {
+    for (auto &&handle : handles) {
+      removeModule(handle);
+    }
+  };
+  for (auto &&object : objects) {
+    assert(nullptr != object);
+    auto handle = execSession.allocateVModule();
+    if (auto err = listenerlayer.addObject(handle, std::move(object))) {
+      execSession.releaseVModule(handle);
+      releaseHandles();
+      return err;
+    }
+    handles.push_back(handle);
+  }
+  // All objects must be known before resolving their symbols.
+  addGeneration(handles, definedSymbols);
+  for (auto &&handle : handles) {
+    if (auto err = listenerlayer.emitAndFinalize(handle)) {
+      return err;
+    }
+  }
+#else
+  for (auto &&object : objects) {
+    assert(nullptr != object);
+    auto objFile =
+        llvm::object::ObjectFile::createObjectFile(object->getMemBufferRef());
+    if (!objFile) {
+      for (auto &&handle : handles) {
+        removeModule(handle);
+      }
+      return objFile.takeError();
+    }
+    auto owningObj = std::make_shared<
+        llvm::object::OwningBinary<llvm::object::ObjectFile>>(
+        std::move(*objFile), std::move(object));
+    auto result =
+        listenerlayer.addObject(std::move(owningObj), createResolver());
+    if (!result) {
+      for (auto &&handle : handles) {
+        removeModule(handle);
+      }
+      return result.takeError();
+    }
+    handles.push_back(result.get());
+  }
+  addGeneration(handles, definedSymbols);
 #endif
-  compiled = true;
   return llvm::Error::success();
 }
 
+void DynamicCompilerContext::addGeneration(
+    llvm::ArrayRef<ModuleHandleT> handles,
+    llvm::ArrayRef<std::string> definedSymbols) {
+  const unsigned id = nextGeneration++;
+  auto &generation = generations[id];
+  generation.handles.append(handles.begin(), handles.end());
+  generation.memoryManagers = std::move(newMemoryManagers);
+  newMemoryManagers.clear();
+  for (auto &&name : definedSymbols) {
+    auto it = symbolGenerations.find(name);
+    if (symbolGenerations.end() != it) {
+      const unsigned previous = it->second;
+      it->second = id;
+      releaseSymbol(previous);
+    } else {
+      symbolGenerations.insert({name, id});
+    }
+    ++generation.liveSymbols;
+  }
+}
+
+void DynamicCompilerContext::releaseSymbol(unsigned generation) {
+  auto it = generations.find(generation);
+  assert(generations.end() != it);
+  assert(it->second.liveSymbols > 0);
+  if (--it->second.liveSymbols == 0) {
+    // Not removed yet: the thunks and bind handles still point to this code
+    // until the caller has swapped them, and other threads may be executing
+    // it. See removeRetiredModules().
+    retiredModules.insert(retiredModules.end(), it->second.handles.begin(),
+                          it->second.handles.end());
+    generations.erase(it);
+  }
+}
+
+bool DynamicCompilerContext::isSymbolCompiled(llvm::StringRef name) const {
+  return symbolGenerations.count(name) != 0;
+}
+
+void DynamicCompilerContext::retainSymbols(
+    const llvm::StringSet<> &liveSymbols) {
+  llvm::SmallVector<llvm::StringRef, 8> dead;
+  for (auto &&it : symbolGenerations) {
+    if (liveSymbols.count(it.first()) == 0) {
+      dead.push_back(it.first());
+    }
+  }
+  for (auto name : dead) {
+    auto it = symbolGenerations.find(name);
+    const unsigned generation = it->second;
+    symbolGenerations.erase(it);
+    releaseSymbol(generation);
+  }
+}
+
+std::size_t DynamicCompilerContext::getReclaimableMemory(
+    const llvm::StringSet<> &symbols) const {
+  llvm::DenseMap<unsigned, unsigned> dropped;
+  for (auto &&it : symbols) {
+    auto gen = symbolGenerations.find(it.first());
+    if (symbolGenerations.end() != gen) {
+      ++dropped[gen->second];
+    }
+  }
+  std::size_t ret = 0;
+  for (auto &&it : dropped) {
+    auto &generation = generations.find(it.first)->second;
+    if (generation.liveSymbols == it.second) {
+      for (auto &&manager : generation.memoryManagers) {
+        ret += manager->getCodeBytes() + manager->getDataBytes();
+      }
+    }
+  }
+  return ret;
+}
+
+void DynamicCompilerContext::getStats(CompilerStats &stats) const {
+  stats.codeBytes = memoryUsage.codeBytes;
+  stats.dataBytes = memoryUsage.dataBytes;
+  stats.modules = 0;
+  for (auto &&it : generations) {
+    stats.modules += it.second.handles.size();
+  }
+  stats.retiredModules = retiredModules.size();
+  stats.bindInstances = bindInstances.size();
+  stats.bindSpecializations = bindSpecializations.size();
+  stats.unusedBindSpecializations = unusedBindSpecializations.size();
+}
+
 llvm::JITSymbol DynamicCompilerContext::findSymbol(const std::string &name) {
-  return compileLayer.findSymbol(name, false);
+  // The newest definition wins.
+  for (auto it = generations.rbegin(); it != generations.rend(); ++it) {
+    for (auto &&handle : it->second.handles) {
+      if (auto sym = compileLayer.findSymbolIn(handle, name, false)) {
+        return sym;
+      } else if (auto err = sym.takeError()) {
+        return std::move(err);
+      }
+    }
+  }
+  return nullptr;
 }
 
 void DynamicCompilerContext::clearSymMap() { symMap.clear(); }
@@ -162,11 +346,63 @@ void DynamicCompilerContext::addSymbol(std::string &&name, void *value) {
 }
 
 void DynamicCompilerContext::reset() {
-  if (compiled) {
-    removeModule(moduleHandle);
-    moduleHandle = {};
-    compiled = false;
+  restoreThunks();
+  for (auto &&it : generations) {
+    retiredModules.insert(retiredModules.end(), it.second.handles.begin(),
+                          it.second.handles.end());
+  }
+  generations.clear();
+  symbolGenerations.clear();
+  compiledState = CompiledState();
+  lazyState = LazyState();
+  unusedBindSpecializations.clear();
+  // The retired code may still update its profile.
+  for (auto &&func : tierState.functions) {
+    retiredProfiles.push_back(std::move(func));
+  }
+  tierState = TierState();
+}
+
+void DynamicCompilerContext::setTier0Profile(
+    std::unique_ptr<TierState::Func> func) {
+  auto &current = tierState.current[func->name];
+  if (current != nullptr) {
+    auto it = std::find_if(
+        tierState.functions.begin(), tierState.functions.end(),
+        [&](const std::unique_ptr<TierState::Func> &f) {
+          return f.get() == current;
+        });
+    assert(tierState.functions.end() != it);
+    retiredProfiles.push_back(std::move(*it));
+    tierState.functions.erase(it);
+  }
+  current = func.get();
+  tierState.functions.push_back(std::move(func));
+}
+
+void DynamicCompilerContext::runInBackground(std::function<void()> task) {
+  assert(task);
+  std::lock_guard<std::mutex> lock(backgroundMutex);
+  backgroundTasks.push_back(std::move(task));
+  if (!backgroundThread.joinable()) {
+    backgroundThread = std::thread([this]() {
+      std::unique_lock<std::mutex> lock(backgroundMutex);
+      while (true) {
+        backgroundCondition.wait(lock, [this]() {
+          return stopBackground || !backgroundTasks.empty();
+        });
+        if (stopBackground) {
+          return;
+        }
+        auto current = std::move(backgroundTasks.front());
+        backgroundTasks.pop_front();
+        lock.unlock();
+        current();
+        lock.lock();
+      }
+    });
   }
+  backgroundCondition.notify_one();
 }
 
 void DynamicCompilerContext::registerBind(
@@ -174,12 +410,78 @@ void DynamicCompilerContext::registerBind(
     const llvm::ArrayRef<ParamSlice> &params) {
   assert(bindInstances.count(handle) == 0);
   BindDesc::ParamsVec vec(params.begin(), params.end());
-  bindInstances.insert({handle, {originalFunc, exampleFunc, std::move(vec)}});
+  auto key = getBindSpecializationKey(originalFunc, exampleFunc, params);
+  if (++bindSpecializations[key] == 1) {
+    // Reuses the kept code, if any.
+    auto unused = std::find(unusedBindSpecializations.begin(),
+                            unusedBindSpecializations.end(), key);
+    if (unusedBindSpecializations.end() != unused) {
+      unusedBindSpecializations.erase(unused);
+    }
+  }
+  bindInstances.insert(
+      {handle, {originalFunc, exampleFunc, std::move(vec), std::move(key)}});
 }
 
 void DynamicCompilerContext::unregisterBind(void *handle) {
-  assert(bindInstances.count(handle) == 1);
-  bindInstances.erase(handle);
+  auto it = bindInstances.find(handle);
+  assert(bindInstances.end() != it);
+  // The code of unused specializations is dropped by the next compilation,
+  // unless kept for reuse.
+  auto spec = bindSpecializations.find(it->second.specialization);
+  assert(bindSpecializations.end() != spec);
+  if (--spec->second == 0) {
+    if (getJitMemoryLimit() != 0) {
+      unusedBindSpecializations.push_back(spec->first().str());
+    }
+    bindSpecializations.erase(spec);
+  }
+  bindInstances.erase(it);
+  thunkFallbacks.erase(static_cast<void **>(handle));
+}
+
+void DynamicCompilerContext::setThunk(void **thunk, void *addr) {
+  assert(thunk != nullptr);
+  thunkFallbacks.insert({thunk, *thunk});
+  storeThunk(thunk, addr);
+}
+
+void DynamicCompilerContext::restoreThunks() {
+  for (auto &&it : thunkFallbacks) {
+    storeThunk(it.first, it.second);
+  }
+  thunkFallbacks.clear();
+}
+
+void DynamicCompilerContext::removeRetiredModules() {
+  for (auto &&handle : retiredModules) {
+    removeModule(handle);
+  }
+  retiredModules.clear();
+  retiredProfiles.clear();
+}
+
+std::string DynamicCompilerContext::getBindSpecializationKey(
+    void *originalFunc, void *exampleFunc, llvm::ArrayRef<ParamSlice> params) {
+  // The bound values are immutable.
+  llvm::MD5 hash;
+  auto add = [&hash](const void *data, size_t size) {
+    hash.update(llvm::ArrayRef<uint8_t>(static_cast<const uint8_t *>(data),
+                                        size));
+  };
+  add(&originalFunc, sizeof(originalFunc));
+  add(&exampleFunc, sizeof(exampleFunc));
+  for (auto &&param : params) {
+    // Placeholders have no data.
+    const uint64_t size = param.data != nullptr ? param.size : ~uint64_t(0);
+    add(&size, sizeof(size));
+    if (param.data != nullptr) {
+      add(param.data, param.size);
+    }
+  }
+  llvm::MD5::MD5Result result;
+  hash.final(result);
+  return result.digest().str().str();
 }
 
 bool DynamicCompilerContext::hasBindFunction(const void *handle) const {
@@ -190,6 +492,13 @@ bool DynamicCompilerContext::hasBindFunction(const void *handle) const {
 
 bool DynamicCompilerContext::isMainContext() const { return mainContext; }
 
+std::shared_ptr<JitMemoryManager>
+DynamicCompilerContext::createMemoryManager() {
+  auto ret = std::make_shared<JitMemoryManager>(memoryUsage);
+  newMemoryManagers.push_back(ret);
+  return ret;
+}
+
 void DynamicCompilerContext::removeModule(const ModuleHandleT &handle) {
   cantFail(compileLayer.removeModule(handle));
 #if LDC_LLVM_VER >= 700
@@ -208,7 +517,7 @@ DynamicCompilerContext::createResolver() {
 #else
       [this](const std::string &name) -> llvm::JITSymbol {
 #endif
-        if (auto Sym = compileLayer.findSymbol(name, false)) {
+        if (auto Sym = findSymbol(name)) {
           return Sym;
         } else if (auto Err = Sym.takeError()) {
           return std::move(Err);
@@ -237,7 +546,7 @@ DynamicCompilerContext::createResolver() {
   // Lambda 2: Search for external symbols in the host process.
   return llvm::orc::createLambdaResolver(
       [this](const std::string &name) {
-        if (auto Sym = compileLayer.findSymbol(name, false)) {
+        if (auto Sym = findSymbol(name)) {
           return Sym;
         }
         return llvm::JITSymbol(nullptr);
@@ -14,11 +14,21 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <utility>
+#include <vector>
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
@@ -34,8 +44,11 @@
 
 #include "context.h"
 #include "disassembler.h"
+#include "memory_manager.h"
+#include "optimizer.h"
 
 namespace llvm {
+class MemoryBuffer;
 class raw_ostream;
 class TargetMachine;
 } // namespace llvm
@@ -66,6 +79,8 @@ private:
   };
   std::unique_ptr<llvm::TargetMachine> targetmachine;
   const llvm::DataLayout dataLayout;
+  // Must outlive the memory managers of the object layer.
+  JitMemoryUsage memoryUsage;
 #if LDC_LLVM_VER >= 800
   using ObjectLayerT = llvm::orc::LegacyRTDyldObjectLinkingLayer;
   using ListenerLayerT =
@@ -92,17 +107,54 @@ private:
   ListenerLayerT listenerlayer;
   CompileLayerT compileLayer;
   llvm::LLVMContext context;
-  bool compiled = false;
-  ModuleHandleT moduleHandle;
   SymMap symMap;
 
+  // Each compilation adds a module with new definitions of the affected
+  // functions, which shadow the ones of previous modules. Modules are retired
+  // once all their definitions are shadowed, and only removed on request (see
+  // `reclaimDynamicCode()`) or with the context, as other threads may still be
+  // executing their code.
+  struct Generation final {
+    // Multiple object files for parallel code generation.
+    llvm::SmallVector<ModuleHandleT, 1> handles;
+    std::vector<std::shared_ptr<JitMemoryManager>> memoryManagers;
+    unsigned liveSymbols = 0;
+  };
+  std::map<unsigned, Generation> generations;
+  unsigned nextGeneration = 0;
+  llvm::StringMap<unsigned> symbolGenerations;
+  std::vector<ModuleHandleT> retiredModules;
+  // The memory managers created for the modules being added.
+  std::vector<std::shared_ptr<JitMemoryManager>> newMemoryManagers;
+
+  // The initial values of the thunk variables and bind handles, i.e. the
+  // statically compiled functions, which are restored on reset().
+  llvm::DenseMap<void **, void *> thunkFallbacks;
+
+  std::mutex mutex;
+
+  // Runs the tasks of `runInBackground()`.
+  std::thread backgroundThread;
+  std::mutex backgroundMutex;
+  std::condition_variable backgroundCondition;
+  std::deque<std::function<void()>> backgroundTasks;
+  bool stopBackground = false;
+
   struct BindDesc final {
     void *originalFunc;
     void *exampleFunc;
     using ParamsVec = llvm::SmallVector<ParamSlice, 5>;
     ParamsVec params;
+    /// Identifies the specialization, see `getBindSpecializationKey()`.
+    std::string specialization;
   };
   llvm::MapVector<void *, BindDesc> bindInstances;
+  // The number of registered bind instances of each specialization, which
+  // share their code.
+  llvm::StringMap<unsigned> bindSpecializations;
+  // The specializations without instances, whose code is kept for reuse
+  // (see `-jit-memory-limit`), least recently used first.
+  std::vector<std::string> unusedBindSpecializations;
   const bool mainContext = false;
 
   struct ListenerCleaner final {
@@ -118,9 +170,119 @@ public:
   llvm::TargetMachine &getTargetMachine() { return *targetmachine; }
   const llvm::DataLayout &getDataLayout() const { return dataLayout; }
 
+  /// Compiles and adds a module, which defines the (non-local) functions
+  /// `definedSymbols`. These definitions take precedence over the ones in
+  /// previously added modules.
   llvm::Error addModule(std::unique_ptr<llvm::Module> module,
+                        llvm::ArrayRef<std::string> definedSymbols,
                         llvm::raw_ostream *asmListener);
 
+  /// Adds previously compiled object files, e.g. from the object cache or
+  /// parallel code generation, like `addModule()`. The objects may reference
+  /// each other's symbols.
+  llvm::Error
+  addObjects(std::vector<std::unique_ptr<llvm::MemoryBuffer>> objects,
+             llvm::ArrayRef<std::string> definedSymbols,
+             llvm::raw_ostream *asmListener);
+
+  /// Whether any code has been compiled since the last `reset()`.
+  bool hasCompiledCode() const { return !generations.empty(); }
+
+  /// Whether a definition of this function has been compiled.
+  bool isSymbolCompiled(llvm::StringRef name) const;
+
+  /// Drops the compiled definitions of all functions not in `liveSymbols`,
+  /// e.g. of unregistered bind instances.
+  void retainSymbols(const llvm::StringSet<> &liveSymbols);
+
+  /// The memory used by the code of this context, including the retired
+  /// modules.
+  std::size_t getMemoryUsage() const {
+    return memoryUsage.codeBytes + memoryUsage.dataBytes;
+  }
+
+  /// Returns the memory which would be reclaimed by dropping the compiled
+  /// definitions of `symbols`.
+  std::size_t getReclaimableMemory(const llvm::StringSet<> &symbols) const;
+
+  void getStats(CompilerStats &stats) const;
+
+  /// The inputs of the currently compiled code, to determine what needs to be
+  /// recompiled.
+  struct CompiledState final {
+    /// Optimization settings and jit options.
+    std::string settings;
+    /// The values of the @dynamicCompileConst variables.
+    llvm::StringMap<std::string> varValues;
+  };
+  CompiledState &getCompiledState() { return compiledState; }
+
+  /// Lazy compilation state, see `-jit-lazy-compile`.
+  struct LazyState final {
+    /// The merged, unoptimized module, which the functions are compiled from.
+    std::unique_ptr<llvm::Module> module;
+    OptimizerSettings settings;
+    /// The functions which need to be (re)compiled.
+    llvm::StringSet<> pending;
+    /// The functions with thunks, indexed by their compile-on-call stubs.
+    struct Func final {
+      std::string name;
+      void **thunkVar;
+      void *stub;
+    };
+    std::vector<Func> functions;
+  };
+  LazyState &getLazyState() { return lazyState; }
+
+  /// Tiered compilation state, see `-jit-tier-up-threshold`.
+  struct TierState final {
+    /// The merged, unoptimized module, which hot functions are recompiled
+    /// from.
+    std::unique_ptr<llvm::Module> module;
+    /// The settings of the recompilation.
+    OptimizerSettings settings;
+    /// Whether to keep the optimized tier 1 modules for the dump handler.
+    bool dumpModules = false;
+    /// The optimized tier 1 modules, passed to the dump handler of the next
+    /// compilation (the recompilations have no one to report to).
+    std::vector<std::string> optimizedModules;
+    /// The profile collected by the tier 0 code of a function.
+    struct Func final {
+      std::string name;
+      void **thunkVar = nullptr;
+      /// The number of calls, followed by the number of times each conditional
+      /// branch has been taken and not taken.
+      std::unique_ptr<uint64_t[]> counters;
+      size_t numBranches = 0;
+      bool tieredUp = false;
+    };
+    /// The profiles of the current tier 0 code, see `setTier0Profile()`.
+    std::vector<std::unique_ptr<Func>> functions;
+    /// The profile of the current tier 0 code of each function.
+    llvm::StringMap<Func *> current;
+  };
+  TierState &getTierState() { return tierState; }
+
+  /// Makes `func` the profile of the current tier 0 code of its function. The
+  /// previous profile is retired, as the replaced code may still update it.
+  void setTier0Profile(std::unique_ptr<TierState::Func> func);
+
+  /// Runs `task` on the background thread of this context. Tasks are run in
+  /// order, the ones still queued on destruction are dropped.
+  void runInBackground(std::function<void()> task);
+
+  /// Atomically sets a thunk variable or bind handle to `addr`, other threads
+  /// may be calling through it.
+  void setThunk(void **thunk, void *addr);
+
+  /// Removes the retired modules. Their code must not be executing anymore,
+  /// which only the user can tell.
+  void removeRetiredModules();
+
+  /// Guards the compilation and the bind instances, which may be compiled on
+  /// another thread than the one creating them.
+  std::mutex &getMutex() { return mutex; }
+
   llvm::JITSymbol findSymbol(const std::string &name);
 
   llvm::LLVMContext &getContext() { return context; }
@@ -142,10 +304,40 @@ public:
     return bindInstances;
   }
 
+  /// Returns the specializations of the registered bind instances, with their
+  /// number of instances.
+  const llvm::StringMap<unsigned> &getBindSpecializations() const {
+    return bindSpecializations;
+  }
+
+  /// Returns the specializations without instances whose code is kept, least
+  /// recently used first.
+  std::vector<std::string> &getUnusedBindSpecializations() {
+    return unusedBindSpecializations;
+  }
+
+  /// Returns the key of a bind specialization, which is the same for all bind
+  /// instances of the same function with the same bound parameter values.
+  static std::string
+  getBindSpecializationKey(void *originalFunc, void *exampleFunc,
+                           llvm::ArrayRef<ParamSlice> params);
+
   bool isMainContext() const;
 
 private:
+  CompiledState compiledState;
+  LazyState lazyState;
+  TierState tierState;
+  std::vector<std::unique_ptr<TierState::Func>> retiredProfiles;
+
+  void addGeneration(llvm::ArrayRef<ModuleHandleT> handles,
+                     llvm::ArrayRef<std::string> definedSymbols);
+  /// Drops a definition of `generation`, retiring the generation's modules if
+  /// it was the last one. Never removes any code.
+  void releaseSymbol(unsigned generation);
   void removeModule(const ModuleHandleT &handle);
+  std::shared_ptr<JitMemoryManager> createMemoryManager();
+  void restoreThunks();
 
 #if LDC_LLVM_VER >= 700
   std::shared_ptr<llvm::orc::SymbolResolver> createResolver();
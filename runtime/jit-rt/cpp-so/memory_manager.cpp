@@ -0,0 +1,204 @@
+//===-- memory_manager.cpp ------------------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "memory_manager.h"
+
+#include <cassert>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace {
+namespace cl = llvm::cl;
+cl::opt<unsigned> memoryLimit(
+    "jit-memory-limit", cl::ZeroOrMore, cl::init(0), cl::value_desc("MiB"),
+    cl::desc("Keep the code of bind specializations without instances for "
+             "reuse while the jitted code of a context uses less memory, "
+             "evicting the least recently used ones first (0 = don't keep "
+             "them)"));
+
+using Purpose = llvm::SectionMemoryManager::AllocationPurpose;
+
+/// Hands out page granular blocks of memory from 2 MiB aligned regions, with
+/// separate regions for code and data. The code of all contexts is packed
+/// densely (and into transparent huge pages where supported), and the blocks
+/// of removed modules are reused. The regions are never unmapped.
+class JitMemoryPool final : public llvm::SectionMemoryManager::MemoryMapper {
+public:
+  JitMemoryPool() {
+#if LDC_LLVM_VER >= 900
+    pageSize = llvm::sys::Process::getPageSizeEstimate();
+#else
+    pageSize = llvm::sys::Process::getPageSize();
+#endif
+  }
+
+  llvm::sys::MemoryBlock
+  allocateMappedMemory(Purpose purpose, size_t numBytes,
+                       const llvm::sys::MemoryBlock *const /*nearBlock*/,
+                       unsigned flags, std::error_code &ec) override {
+    const size_t size = llvm::alignTo(numBytes, pageSize);
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &arena = arenas[static_cast<unsigned>(purpose)];
+
+    char *addr = nullptr;
+    auto it = arena.freeBlocks.lower_bound(size);
+    if (arena.freeBlocks.end() != it) {
+      addr = it->second;
+      const size_t remaining = it->first - size;
+      arena.freeBlocks.erase(it);
+      if (remaining != 0) {
+        arena.freeBlocks.insert({remaining, addr + size});
+      }
+    } else {
+      if (static_cast<size_t>(arena.end - arena.current) < size &&
+          !addRegion(arena, purpose, size, ec)) {
+        return llvm::sys::MemoryBlock();
+      }
+      addr = arena.current;
+      arena.current += size;
+    }
+    blocks[addr] = {size, purpose};
+
+    llvm::sys::MemoryBlock block(addr, size);
+    ec = llvm::sys::Memory::protectMappedMemory(block, flags);
+    return block;
+  }
+
+  std::error_code protectMappedMemory(const llvm::sys::MemoryBlock &block,
+                                      unsigned flags) override {
+    return llvm::sys::Memory::protectMappedMemory(block, flags);
+  }
+
+  std::error_code releaseMappedMemory(llvm::sys::MemoryBlock &block) override {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto addr = static_cast<char *>(block.base());
+    auto it = blocks.find(addr);
+    assert(blocks.end() != it);
+    const auto size = it->second.first;
+    auto &arena = arenas[static_cast<unsigned>(it->second.second)];
+    blocks.erase(it);
+    block = llvm::sys::MemoryBlock();
+
+#if defined(__linux__)
+    // Return the physical memory to the system until reused.
+    madvise(addr, size, MADV_DONTNEED);
+#endif
+    arena.freeBlocks.insert({size, addr});
+    return llvm::sys::Memory::protectMappedMemory(
+        llvm::sys::MemoryBlock(addr, size),
+        llvm::sys::Memory::MF_READ | llvm::sys::Memory::MF_WRITE);
+  }
+
+private:
+  static constexpr size_t regionSize = 2 * 1024 * 1024;
+
+  struct Arena final {
+    char *current = nullptr;
+    char *end = nullptr;
+    // Released blocks by size.
+    std::multimap<size_t, char *> freeBlocks;
+  };
+
+  std::mutex mutex;
+  size_t pageSize = 0;
+  Arena arenas[3]; // code, read-only data, read-write data
+  llvm::DenseMap<char *, std::pair<size_t, Purpose>> blocks;
+  std::vector<llvm::sys::MemoryBlock> regions;
+
+  bool addRegion(Arena &arena, Purpose purpose, size_t minSize,
+                 std::error_code &ec) {
+    const size_t size = llvm::alignTo(minSize, regionSize);
+    // Over-allocate to align the region, the unused pages are never touched.
+    auto region = llvm::sys::Memory::allocateMappedMemory(
+        size + regionSize, nullptr,
+        llvm::sys::Memory::MF_READ | llvm::sys::Memory::MF_WRITE, ec);
+    if (ec) {
+      return false;
+    }
+    regions.push_back(region);
+    const auto base = reinterpret_cast<uintptr_t>(region.base());
+    auto begin =
+        reinterpret_cast<char *>(llvm::alignTo(base, uint64_t(regionSize)));
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (Purpose::Code == purpose) {
+      madvise(begin, size, MADV_HUGEPAGE);
+    }
+#else
+    (void)purpose;
+#endif
+
+    if (arena.current != arena.end) {
+      arena.freeBlocks.insert(
+          {static_cast<size_t>(arena.end - arena.current), arena.current});
+    }
+    arena.current = begin;
+    arena.end = begin + size;
+    return true;
+  }
+};
+
+JitMemoryPool &getJitMemoryPool() {
+  // Never destroyed, as memory managers may outlive static destructors.
+  static auto pool = new JitMemoryPool;
+  return *pool;
+}
+
+} // anon namespace
+
+std::size_t getJitMemoryLimit() {
+  return static_cast<std::size_t>(memoryLimit) * 1024 * 1024;
+}
+
+JitMemoryManager::JitMemoryManager(JitMemoryUsage &u)
+    : llvm::SectionMemoryManager(&getJitMemoryPool()), usage(u) {}
+
+JitMemoryManager::~JitMemoryManager() {
+  assert(usage.codeBytes >= codeBytes);
+  assert(usage.dataBytes >= dataBytes);
+  usage.codeBytes -= codeBytes;
+  usage.dataBytes -= dataBytes;
+}
+
+uint8_t *JitMemoryManager::allocateCodeSection(uintptr_t size,
+                                               unsigned alignment,
+                                               unsigned sectionID,
+                                               llvm::StringRef sectionName) {
+  auto ret = llvm::SectionMemoryManager::allocateCodeSection(
+      size, alignment, sectionID, sectionName);
+  if (ret != nullptr) {
+    codeBytes += size;
+    usage.codeBytes += size;
+  }
+  return ret;
+}
+
+uint8_t *JitMemoryManager::allocateDataSection(uintptr_t size,
+                                               unsigned alignment,
+                                               unsigned sectionID,
+                                               llvm::StringRef sectionName,
+                                               bool isReadOnly) {
+  auto ret = llvm::SectionMemoryManager::allocateDataSection(
+      size, alignment, sectionID, sectionName, isReadOnly);
+  if (ret != nullptr) {
+    dataBytes += size;
+    usage.dataBytes += size;
+  }
+  return ret;
+}
@@ -0,0 +1,54 @@
+//===-- memory_manager.h - jit support --------------------------*- C++ -*-===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Jit runtime - memory management of the jitted code.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+
+/// Returns the limit of the memory used by the jitted code of a context in
+/// bytes, as specified by the `-jit-memory-limit` jit option. 0 means no limit
+/// (the default).
+std::size_t getJitMemoryLimit();
+
+/// The memory used by the jitted code of a context.
+struct JitMemoryUsage final {
+  std::size_t codeBytes = 0;
+  std::size_t dataBytes = 0;
+};
+
+/// Memory manager of a jitted module. Allocates the sections from the memory
+/// pool shared by all contexts, and accounts them to the context's `usage`.
+class JitMemoryManager final : public llvm::SectionMemoryManager {
+public:
+  explicit JitMemoryManager(JitMemoryUsage &usage);
+  ~JitMemoryManager() override;
+
+  std::size_t getCodeBytes() const { return codeBytes; }
+  std::size_t getDataBytes() const { return dataBytes; }
+
+  uint8_t *allocateCodeSection(uintptr_t size, unsigned alignment,
+                               unsigned sectionID,
+                               llvm::StringRef sectionName) override;
+
+  uint8_t *allocateDataSection(uintptr_t size, unsigned alignment,
+                               unsigned sectionID, llvm::StringRef sectionName,
+                               bool isReadOnly) override;
+
+private:
+  JitMemoryUsage &usage;
+  std::size_t codeBytes = 0;
+  std::size_t dataBytes = 0;
+};
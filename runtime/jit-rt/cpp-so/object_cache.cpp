@@ -0,0 +1,139 @@
+//===-- object_cache.cpp --------------------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "object_cache.h"
+
+#include "optimizer.h"
+#include "options.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "context.h"
+
+namespace {
+namespace cl = llvm::cl;
+cl::opt<std::string> objectCacheDir(
+    "jit-object-cache-dir", cl::ZeroOrMore, cl::value_desc("directory"),
+    cl::desc("Cache the jitted object files in this directory and reuse them "
+             "if the code, target and settings are unchanged"));
+
+const char *const keyPrefix = "ldc-jit-";
+
+llvm::SmallString<128> getCachePath(llvm::StringRef key) {
+  llvm::SmallString<128> path(objectCacheDir);
+  llvm::sys::path::append(path, key + ".o");
+  return path;
+}
+} // anon namespace
+
+bool JitObjectCache::isEnabled() { return !objectCacheDir.empty(); }
+
+std::string JitObjectCache::computeKey(const llvm::Module &module,
+                                       const llvm::TargetMachine &targetMachine,
+                                       const OptimizerSettings &settings) {
+  llvm::SmallVector<char, 0> bitcode;
+  llvm::raw_svector_ostream os(bitcode);
+#if LDC_LLVM_VER >= 700
+  llvm::WriteBitcodeToFile(module, os);
+#else
+  llvm::WriteBitcodeToFile(&module, os);
+#endif
+
+  llvm::MD5 hash;
+  auto add = [&hash](llvm::StringRef str) {
+    hash.update(str);
+    hash.update(llvm::StringRef("\0", 1)); // separator
+  };
+  add(llvm::StringRef(bitcode.data(), bitcode.size()));
+  add(targetMachine.getTargetTriple().str());
+  add(targetMachine.getTargetCPU());
+  add(targetMachine.getTargetFeatureString());
+  add(std::to_string(settings.optLevel));
+  add(std::to_string(settings.sizeLevel));
+  add(getJitOptionsString());
+  add(LLVM_VERSION_STRING);
+  add(std::to_string(ApiVersion));
+
+  llvm::MD5::MD5Result result;
+  hash.final(result);
+  return keyPrefix + result.digest().str().str();
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+JitObjectCache::lookup(const std::string &key) {
+  if (!isEnabled()) {
+    return nullptr;
+  }
+  auto buffer = llvm::MemoryBuffer::getFile(getCachePath(key), -1,
+                                            /*RequiresNullTerminator*/ false);
+  if (!buffer) {
+    return nullptr;
+  }
+  return std::move(*buffer);
+}
+
+void JitObjectCache::notifyObjectCompiled(const llvm::Module *module,
+                                          llvm::MemoryBufferRef object) {
+  assert(module != nullptr);
+  const auto &key = module->getModuleIdentifier();
+  if (!isEnabled() || !llvm::StringRef(key).startswith(keyPrefix)) {
+    return;
+  }
+
+  // Errors are ignored, the object file just isn't cached then.
+  if (llvm::sys::fs::create_directories(objectCacheDir)) {
+    return;
+  }
+
+  // Write to a temporary file first, so that concurrent processes never see
+  // partially written object files.
+  const auto path = getCachePath(key);
+  int fd;
+  llvm::SmallString<128> tempPath;
+  if (llvm::sys::fs::createUniqueFile(path + ".tmp-%%%%%%%%", fd, tempPath)) {
+    return;
+  }
+  {
+    llvm::raw_fd_ostream os(fd, /*shouldClose*/ true);
+    os << object.getBuffer();
+    os.close();
+    if (os.has_error()) {
+      os.clear_error();
+      llvm::sys::fs::remove(tempPath);
+      return;
+    }
+  }
+  if (llvm::sys::fs::rename(tempPath, path)) {
+    llvm::sys::fs::remove(tempPath);
+  }
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+JitObjectCache::getObject(const llvm::Module *module) {
+  assert(module != nullptr);
+  // The cache is explicitly checked before optimizing the module, see
+  // rtCompileProcessImplSoInternal().
+  (void)module;
+  return nullptr;
+}
+
+JitObjectCache &getJitObjectCache() {
+  static JitObjectCache cache;
+  return cache;
+}
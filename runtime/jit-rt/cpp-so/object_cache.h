@@ -0,0 +1,55 @@
+//===-- object_cache.h - jit support ----------------------------*- C++ -*-===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Jit runtime - persistent on-disk cache of jitted object files.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "llvm/ExecutionEngine/ObjectCache.h"
+
+namespace llvm {
+class MemoryBuffer;
+class Module;
+class TargetMachine;
+} // namespace llvm
+
+struct OptimizerSettings;
+
+/// Caches the object files produced by the jit in the directory specified by
+/// the `-jit-object-cache-dir` jit option (disabled by default).
+///
+/// Modules are identified by a key computed by `computeKey()`, which must be
+/// set as module identifier before codegen for the object file to be stored.
+class JitObjectCache final : public llvm::ObjectCache {
+public:
+  static bool isEnabled();
+
+  /// Computes the cache key of a (merged, unoptimized) module, including
+  /// everything else affecting the generated code: target, host CPU and
+  /// features, optimization settings and jit options.
+  static std::string computeKey(const llvm::Module &module,
+                                const llvm::TargetMachine &targetMachine,
+                                const OptimizerSettings &settings);
+
+  /// Returns the cached object file for `key`, or null.
+  std::unique_ptr<llvm::MemoryBuffer> lookup(const std::string &key);
+
+  void notifyObjectCompiled(const llvm::Module *module,
+                            llvm::MemoryBufferRef object) override;
+
+  std::unique_ptr<llvm::MemoryBuffer>
+  getObject(const llvm::Module *module) override;
+};
+
+JitObjectCache &getJitObjectCache();
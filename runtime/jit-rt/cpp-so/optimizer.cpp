@@ -223,6 +223,8 @@ void optimizeModule(const Context &context, llvm::TargetMachine &targetMachine,
   llvm::legacy::PassManager mpm;
   llvm::legacy::FunctionPassManager fpm(&module);
   const auto name = module.getName();
+  EventScope moduleEvent(context, CompilerStage::Optimize);
+  moduleEvent.setModule(name);
   interruptPoint(context, "Setup passes for module", name.data());
   setupPasses(targetMachine, settings, mpm, fpm);
 
@@ -232,17 +234,28 @@ void optimizeModule(const Context &context, llvm::TargetMachine &targetMachine,
     for (auto &fun : module) {
       if (fun.isDeclaration()) {
         interruptPoint(context, "Func decl", fun.getName().data());
-      } else {
-        interruptPoint(context, "Run passes for function",
-                       fun.getName().data());
+        fpm.run(fun);
+        continue;
       }
+      interruptPoint(context, "Run passes for function", fun.getName().data());
+      EventScope functionEvent(context, CompilerStage::OptimizeFunction);
+      functionEvent.setModule(name);
+      functionEvent.setFunction(fun.getName());
       fpm.run(fun);
+      if (functionEvent.isEnabled()) {
+        for (auto &&bb : fun) {
+          functionEvent.event.irInstructions += bb.size();
+        }
+      }
     }
   }
 
   // Run per-module passes.
   interruptPoint(context, "Run passes for module", name.data());
   mpm.run(module);
+  if (moduleEvent.isEnabled()) {
+    moduleEvent.event.irInstructions = getInstructionCount(module);
+  }
 }
 
 void setRtCompileVar(const Context &context, llvm::Module &module,
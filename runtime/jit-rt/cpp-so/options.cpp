@@ -12,8 +12,13 @@
 #include "callback_ostream.h"
 
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/Support/CommandLine.h"
 
+namespace {
+std::string jitOptionsString;
+}
+
 bool parseOptions(Slice<Slice<const char>> args,
                   void (*errs)(void *, const char *, size_t),
                   void *errsContext) {
@@ -43,5 +48,10 @@ bool parseOptions(Slice<Slice<const char>> args,
   auto res = llvm::cl::ParseCommandLineOptions(
       static_cast<int>(tempOpts.size()), tempOpts.data(), "", &os);
   os.flush();
+  if (res) {
+    jitOptionsString = llvm::join(tempStrs.begin(), tempStrs.end(), " ");
+  }
   return res;
 }
+
+llvm::StringRef getJitOptionsString() { return jitOptionsString; }
@@ -16,8 +16,13 @@
 
 #include "slice.h"
 
+#include "llvm/ADT/StringRef.h"
+
 bool parseOptions(Slice<Slice<const char>> args,
                   void (*errs)(void *, const char *, size_t),
                   void *errsContext);
 
+/// Returns the last successfully parsed jit options, separated by spaces.
+llvm::StringRef getJitOptionsString();
+
 #endif // OPTIONS_HPP
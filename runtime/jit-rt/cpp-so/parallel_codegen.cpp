@@ -0,0 +1,153 @@
+//===-- parallel_codegen.cpp ----------------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "parallel_codegen.h"
+
+#include <algorithm>
+#include <cassert>
+#include <thread>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+
+#include "object_cache.h"
+
+namespace {
+namespace cl = llvm::cl;
+cl::opt<unsigned> codegenThreads(
+    "jit-codegen-threads", cl::ZeroOrMore, cl::init(1),
+    cl::value_desc("N"),
+    cl::desc("Split the jitted code into N partitions and generate their code "
+             "in parallel (0 = number of hardware threads)"));
+
+// Target machines must not be shared between threads.
+std::unique_ptr<llvm::TargetMachine>
+cloneTargetMachine(const llvm::TargetMachine &tm) {
+  std::unique_ptr<llvm::TargetMachine> ret(
+      tm.getTarget().createTargetMachine(
+          tm.getTargetTriple().str(), tm.getTargetCPU(),
+          tm.getTargetFeatureString(), tm.Options, tm.getRelocationModel(),
+          tm.getCodeModel(), tm.getOptLevel(), /*jit*/ true));
+  assert(ret != nullptr);
+  return ret;
+}
+
+struct Partition final {
+  llvm::SmallString<0> bitcode;
+  std::string name;
+  std::unique_ptr<llvm::TargetMachine> targetMachine;
+  std::unique_ptr<llvm::MemoryBuffer> object;
+  std::string error;
+
+  void codegen(bool useCache) {
+    // Modules of the same LLVMContext can't be processed concurrently.
+    llvm::LLVMContext context;
+    auto module = llvm::parseBitcodeFile(
+        llvm::MemoryBufferRef(bitcode, name), context);
+    if (!module) {
+      error = llvm::toString(module.takeError());
+      return;
+    }
+
+    llvm::orc::SimpleCompiler compiler(
+        *targetMachine, useCache ? &getJitObjectCache() : nullptr);
+#if LDC_LLVM_VER >= 1100
+    auto result = compiler(**module);
+    if (!result) {
+      error = llvm::toString(result.takeError());
+      return;
+    }
+    object = std::move(*result);
+#elif LDC_LLVM_VER >= 700
+    object = compiler(**module);
+#else
+    object = compiler(**module).takeBinary().second;
+#endif
+    if (object == nullptr) {
+      error = "Codegen failed for " + name;
+    }
+  }
+};
+} // anon namespace
+
+unsigned getCodegenPartitions() {
+  if (codegenThreads == 0) {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+  return codegenThreads;
+}
+
+std::string getPartitionCacheKey(const std::string &key, unsigned partition) {
+  return key + "-" + std::to_string(partition);
+}
+
+llvm::Expected<std::vector<std::unique_ptr<llvm::MemoryBuffer>>>
+codegenParallel(std::unique_ptr<llvm::Module> module,
+                const llvm::TargetMachine &targetMachine, unsigned partitions,
+                const std::string &cacheKey) {
+  assert(module != nullptr);
+  assert(partitions > 1);
+
+  // Each partition is handed to its thread as bitcode, to be loaded into its
+  // own LLVMContext (like llvm::splitCodeGen()).
+  std::vector<Partition> parts;
+  parts.reserve(partitions);
+  llvm::SplitModule(
+      std::move(module), partitions,
+      [&](std::unique_ptr<llvm::Module> part) {
+        parts.emplace_back();
+        auto &p = parts.back();
+        llvm::raw_svector_ostream os(p.bitcode);
+#if LDC_LLVM_VER >= 700
+        llvm::WriteBitcodeToFile(*part, os);
+#else
+        llvm::WriteBitcodeToFile(part.get(), os);
+#endif
+      },
+      /*PreserveLocals*/ false);
+
+  for (unsigned i = 0; i < parts.size(); ++i) {
+    auto &p = parts[i];
+    // The module identifier is the object cache key.
+    p.name = cacheKey.empty() ? "partition-" + std::to_string(i)
+                              : getPartitionCacheKey(cacheKey, i);
+    p.targetMachine = cloneTargetMachine(targetMachine);
+  }
+
+  const bool useCache = !cacheKey.empty();
+  std::vector<std::thread> threads;
+  threads.reserve(parts.size());
+  for (auto &&p : parts) {
+    threads.emplace_back([&p, useCache]() { p.codegen(useCache); });
+  }
+  for (auto &&thread : threads) {
+    thread.join();
+  }
+
+  std::vector<std::unique_ptr<llvm::MemoryBuffer>> objects;
+  objects.reserve(parts.size());
+  for (auto &&p : parts) {
+    if (!p.error.empty()) {
+      return llvm::make_error<llvm::StringError>(
+          p.error, llvm::inconvertibleErrorCode());
+    }
+    objects.push_back(std::move(p.object));
+  }
+  return std::move(objects);
+}
@@ -0,0 +1,43 @@
+//===-- parallel_codegen.h - jit support ------------------------*- C++ -*-===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Jit runtime - parallel code generation.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/Support/Error.h"
+
+namespace llvm {
+class MemoryBuffer;
+class Module;
+class TargetMachine;
+} // namespace llvm
+
+/// Returns the number of partitions the code is split into for parallel code
+/// generation, as specified by the `-jit-codegen-threads` jit option. 1 means
+/// no splitting (the default).
+unsigned getCodegenPartitions();
+
+/// Returns the object cache key of partition `partition` of the module with
+/// cache key `key`.
+std::string getPartitionCacheKey(const std::string &key, unsigned partition);
+
+/// Splits `module` into `partitions` modules and generates their object files
+/// in parallel, each on its own thread. If `cacheKey` is not empty, the object
+/// files are stored in the object cache under the partition keys.
+llvm::Expected<std::vector<std::unique_ptr<llvm::MemoryBuffer>>>
+codegenParallel(std::unique_ptr<llvm::Module> module,
+                const llvm::TargetMachine &targetMachine, unsigned partitions,
+                const std::string &cacheKey);
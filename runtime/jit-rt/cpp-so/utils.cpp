@@ -10,6 +10,7 @@
 #include "utils.h"
 
 #include <cassert>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 
@@ -46,3 +47,58 @@ void verifyModule(const Context &context, llvm::Module &module) {
     fatal(context, desc);
   }
 }
+
+namespace {
+uint64_t getTimestamp() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+} // anon namespace
+
+EventScope::EventScope(const Context &c, CompilerStage stage) : context(c) {
+  event.stage = stage;
+  start();
+}
+
+EventScope::~EventScope() { finish(); }
+
+void EventScope::finish() {
+  if (isEnabled() && !finished) {
+    finished = true;
+    event.endTime = getTimestamp();
+    event.moduleName = moduleName.empty() ? nullptr : moduleName.c_str();
+    event.functionName =
+        functionName.empty() ? nullptr : functionName.c_str();
+    context.eventHandler(context.eventHandlerData, &event);
+  }
+}
+
+void EventScope::start() {
+  if (isEnabled()) {
+    event.startTime = getTimestamp();
+  }
+}
+
+void EventScope::setModule(llvm::StringRef name) {
+  if (isEnabled()) {
+    moduleName = name.str();
+  }
+}
+
+void EventScope::setFunction(llvm::StringRef name) {
+  if (isEnabled()) {
+    functionName = name.str();
+  }
+}
+
+std::size_t getInstructionCount(const llvm::Module &module) {
+  std::size_t ret = 0;
+  for (auto &&func : module) {
+    for (auto &&bb : func) {
+      ret += bb.size();
+    }
+  }
+  return ret;
+}
@@ -13,9 +13,13 @@
 
 #pragma once
 
+#include <cstddef>
 #include <string>
 
-struct Context;
+#include "context.h"
+
+#include "llvm/ADT/StringRef.h"
+
 namespace llvm {
 class Module;
 }
@@ -24,3 +28,31 @@ void fatal(const Context &context, const std::string &reason);
 void interruptPoint(const Context &context, const char *desc,
                     const char *object = "");
 void verifyModule(const Context &context, llvm::Module &module);
+
+/// Reports a structured event to the event handler of the context on
+/// destruction, timed from construction (or the last `start()`).
+class EventScope final {
+public:
+  EventScope(const Context &context, CompilerStage stage);
+  ~EventScope();
+
+  EventScope(const EventScope &) = delete;
+  EventScope &operator=(const EventScope &) = delete;
+
+  bool isEnabled() const { return nullptr != context.eventHandler; }
+  void start();
+  /// Reports the event now instead of on destruction.
+  void finish();
+  void setModule(llvm::StringRef name);
+  void setFunction(llvm::StringRef name);
+
+  CompilerEvent event;
+
+private:
+  const Context &context;
+  bool finished = false;
+  std::string moduleName;
+  std::string functionName;
+};
+
+std::size_t getInstructionCount(const llvm::Module &module);
@@ -14,6 +14,7 @@
 
 #include <cstddef> // size_t
 
+struct CompilerStats;
 struct Context;
 struct ParamSlice;
 
@@ -42,6 +43,8 @@ template <typename T> struct Slice final {
 #define JIT_DESTROY_COMPILER_CONTEXT                                           \
   MAKE_JIT_API_CALL(destroyDynamicCompilerContextSo)
 #define JIT_SET_OPTS MAKE_JIT_API_CALL(setDynamicCompilerOptsImpl)
+#define JIT_GET_STATS MAKE_JIT_API_CALL(getDynamicCompilerStatsSo)
+#define JIT_RECLAIM MAKE_JIT_API_CALL(reclaimDynamicCodeSo)
 
 struct DynamicCompilerContext;
 
@@ -71,6 +74,11 @@ EXTERNAL bool JIT_SET_OPTS(const Slice<Slice<const char>> *args,
                            void (*errs)(void *, const char *, size_t),
                            void *errsContext);
 
+EXTERNAL void JIT_GET_STATS(DynamicCompilerContext *context,
+                            CompilerStats *stats, std::size_t statsSize);
+
+EXTERNAL void JIT_RECLAIM(DynamicCompilerContext *context);
+
 void rtCompileProcessImpl(const Context *context, std::size_t contextSize) {
   JIT_API_ENTRYPOINT(dynamiccompile_modules_head, context, contextSize);
 }
@@ -97,4 +105,13 @@ bool setDynamicCompilerOpts(const Slice<Slice<const char>> *args,
                             void *errsContext) {
   return JIT_SET_OPTS(args, errs, errsContext);
 }
+
+void getDynamicCompilerStatsImpl(DynamicCompilerContext *context,
+                                 CompilerStats *stats, std::size_t statsSize) {
+  JIT_GET_STATS(context, stats, statsSize);
+}
+
+void reclaimDynamicCodeImpl(DynamicCompilerContext *context) {
+  JIT_RECLAIM(context);
+}
 }
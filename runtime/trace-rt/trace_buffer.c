@@ -0,0 +1,407 @@
+//===-- trace_buffer.c ----------------------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Runtime support for `-finstrument=trace-buffer`.
+//
+// Instrumented functions append entry and exit events to a thread-local ring
+// buffer inline (see gen/functions.cpp). The runtime is only called at the
+// first event of a thread, to register the buffer, and whenever the buffer is
+// full. Full buffers are copied to a queue, from which a writer thread writes
+// the events to a Chrome trace event file (viewable in chrome://tracing or
+// Perfetto): `trace.json`, or the path in the `LDC_TRACE_FILE` environment
+// variable.
+//
+//===----------------------------------------------------------------------===//
+
+#if !defined(_WIN32)
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Must match the compiler (gen/functions.cpp).
+#define TRACE_BUFFER_SIZE 4096
+#define TRACE_EXIT_FLAG (1ULL << 63)
+
+typedef struct {
+  uint64_t timestamp; // top bit set for function exits
+  const char *func;
+} TraceEvent;
+
+typedef struct {
+  uint64_t pos;     // number of events recorded so far
+  uint64_t flushed; // number of events handed to the writer so far
+  TraceEvent events[TRACE_BUFFER_SIZE];
+} TraceBuffer;
+
+typedef struct TraceChunk {
+  struct TraceChunk *next;
+  uint32_t tid;
+  size_t count;
+  TraceEvent events[];
+} TraceChunk;
+
+// Each shared library with instrumented code has its own buffers. Further ones
+// are only flushed when full, out of order with the thread's other events.
+#define MAX_BUFFERS_PER_THREAD 8
+
+typedef struct TraceThread {
+  struct TraceThread *next, *prev; // see liveThreads
+  uint32_t tid;
+  unsigned numBuffers;
+  TraceBuffer *buffers[MAX_BUFFERS_PER_THREAD];
+} TraceThread;
+
+static __thread TraceThread *traceThread;
+
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t threadKey;
+static pthread_mutex_t queueMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+static TraceChunk *queueHead, *queueTail;
+static int shuttingDown;
+static uint32_t nextTid;
+// The threads with registered buffers, flushed at exit.
+static TraceThread *liveThreads;
+// The buffers exceeding MAX_BUFFERS_PER_THREAD, reported at exit.
+static unsigned unregisteredBuffers;
+static pthread_t writerThread;
+static FILE *output;
+
+static uint64_t startTicks, startNanos;
+
+static uint64_t monotonicNanos(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// The timestamps of targets without cycle counter support in the compiler.
+uint64_t _d_trace_buffer_clock(void) { return monotonicNanos(); }
+
+static uint64_t readTicks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t lo, hi;
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+  uint64_t ticks;
+  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+  return ticks;
+#else
+  return monotonicNanos();
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Writer thread
+
+static void writeEscaped(const char *s) {
+  for (; *s; ++s) {
+    const unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\')
+      fprintf(output, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(output, "\\u%04x", c);
+    else
+      fputc(c, output);
+  }
+}
+
+// The open function calls of each thread, to close the ones left by exception
+// unwinding (which doesn't record exit events).
+typedef struct {
+  const char **funcs;
+  size_t size, capacity;
+} CallStack;
+
+static CallStack *callStacks;
+static size_t numCallStacks;
+static int firstEvent = 1;
+
+static void writeEvent(const char *func, char phase, double micros,
+                       uint32_t tid) {
+  fprintf(output, "%s{\"name\":\"", firstEvent ? "" : ",\n");
+  firstEvent = 0;
+  writeEscaped(func);
+  fprintf(output, "\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u}", phase,
+          micros, (int)getpid(), tid);
+}
+
+static void writeChunk(const TraceChunk *chunk, double ticksPerMicro) {
+  if (chunk->tid >= numCallStacks) {
+    const size_t n = chunk->tid + 16;
+    CallStack *grown = realloc(callStacks, n * sizeof(CallStack));
+    if (!grown)
+      return;
+    memset(grown + numCallStacks, 0, (n - numCallStacks) * sizeof(CallStack));
+    callStacks = grown;
+    numCallStacks = n;
+  }
+  CallStack *stack = &callStacks[chunk->tid];
+
+  for (size_t i = 0; i < chunk->count; ++i) {
+    const TraceEvent *e = &chunk->events[i];
+    const uint64_t ticks = e->timestamp & ~TRACE_EXIT_FLAG;
+    const double micros =
+        ticks > startTicks ? (double)(ticks - startTicks) / ticksPerMicro : 0;
+
+    if (!(e->timestamp & TRACE_EXIT_FLAG)) {
+      if (stack->size == stack->capacity) {
+        const size_t n = stack->capacity ? 2 * stack->capacity : 64;
+        const char **grown = realloc(stack->funcs, n * sizeof(const char *));
+        if (!grown)
+          continue;
+        stack->funcs = grown;
+        stack->capacity = n;
+      }
+      stack->funcs[stack->size++] = e->func;
+      writeEvent(e->func, 'B', micros, chunk->tid);
+      continue;
+    }
+
+    // Ignore exits without matching entry.
+    size_t depth = stack->size;
+    while (depth && stack->funcs[depth - 1] != e->func)
+      --depth;
+    if (!depth)
+      continue;
+    while (stack->size >= depth)
+      writeEvent(stack->funcs[--stack->size], 'E', micros, chunk->tid);
+  }
+}
+
+static void *writerMain(void *arg) {
+  (void)arg;
+  double ticksPerMicro = 1000.0 / 1000.0; // nanosecond timestamps
+  int calibrated = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&queueMutex);
+    while (!queueHead && !shuttingDown)
+      pthread_cond_wait(&queueCond, &queueMutex);
+    TraceChunk *chunks = queueHead;
+    queueHead = queueTail = NULL;
+    const int done = shuttingDown;
+    pthread_mutex_unlock(&queueMutex);
+
+    // Calibrate the cycle counter against the monotonic clock, over the time
+    // since initialization.
+    if (!calibrated && chunks) {
+      const uint64_t nanos = monotonicNanos() - startNanos;
+      const uint64_t ticks = readTicks() - startTicks;
+      if (nanos > 0 && ticks > 0)
+        ticksPerMicro = (double)ticks * 1000.0 / (double)nanos;
+      calibrated = nanos > 100000000; // 100 ms
+    }
+
+    while (chunks) {
+      TraceChunk *next = chunks->next;
+      writeChunk(chunks, ticksPerMicro);
+      free(chunks);
+      chunks = next;
+    }
+
+    if (done)
+      return NULL;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Buffer management
+
+// Copies the pending events of a thread's buffers to a chunk, merged by
+// timestamp (the events of each buffer are in order). Returns NULL if there
+// are none, or without writer thread (no trace file), dropping them.
+static TraceChunk *takeEvents(TraceBuffer *const *buffers, unsigned numBuffers,
+                              uint32_t tid) {
+  uint64_t pos[MAX_BUFFERS_PER_THREAD], next[MAX_BUFFERS_PER_THREAD];
+  size_t count = 0;
+  for (unsigned i = 0; i < numBuffers; ++i) {
+    pos[i] = __atomic_load_n(&buffers[i]->pos, __ATOMIC_ACQUIRE);
+    next[i] = buffers[i]->flushed;
+    count += (size_t)(pos[i] - next[i]);
+  }
+  if (!count)
+    return NULL;
+
+  TraceChunk *chunk =
+      output ? malloc(sizeof(TraceChunk) + count * sizeof(TraceEvent)) : NULL;
+  if (chunk) {
+    chunk->next = NULL;
+    chunk->tid = tid;
+    chunk->count = count;
+    for (size_t n = 0; n < count; ++n) {
+      unsigned oldest = numBuffers;
+      uint64_t oldestTicks = 0;
+      for (unsigned i = 0; i < numBuffers; ++i) {
+        if (next[i] == pos[i])
+          continue;
+        const uint64_t ticks =
+            buffers[i]->events[next[i] & (TRACE_BUFFER_SIZE - 1)].timestamp &
+            ~TRACE_EXIT_FLAG;
+        if (oldest == numBuffers || ticks < oldestTicks) {
+          oldest = i;
+          oldestTicks = ticks;
+        }
+      }
+      chunk->events[n] =
+          buffers[oldest]->events[next[oldest]++ & (TRACE_BUFFER_SIZE - 1)];
+    }
+  }
+  for (unsigned i = 0; i < numBuffers; ++i)
+    buffers[i]->flushed = pos[i];
+  return chunk;
+}
+
+// Appends a chunk to the queue. queueMutex must be locked.
+static void pushChunk(TraceChunk *chunk) {
+  if (!chunk)
+    return;
+  if (shuttingDown) {
+    free(chunk);
+    return;
+  }
+  if (queueTail)
+    queueTail->next = chunk;
+  else
+    queueHead = chunk;
+  queueTail = chunk;
+  pthread_cond_signal(&queueCond);
+}
+
+static void enqueue(TraceBuffer *const *buffers, unsigned numBuffers,
+                    uint32_t tid) {
+  TraceChunk *chunk = takeEvents(buffers, numBuffers, tid);
+  if (!chunk)
+    return;
+  pthread_mutex_lock(&queueMutex);
+  pushChunk(chunk);
+  pthread_mutex_unlock(&queueMutex);
+}
+
+// All buffers of a thread are flushed together, so that the chunks of a thread
+// are in order, even for calls across shared libraries.
+static void flushThread(TraceThread *thread) {
+  enqueue(thread->buffers, thread->numBuffers, thread->tid);
+}
+
+static void onThreadExit(void *p) {
+  TraceThread *thread = (TraceThread *)p;
+  flushThread(thread);
+  pthread_mutex_lock(&queueMutex);
+  if (thread->prev)
+    thread->prev->next = thread->next;
+  else
+    liveThreads = thread->next;
+  if (thread->next)
+    thread->next->prev = thread->prev;
+  pthread_mutex_unlock(&queueMutex);
+  free(thread);
+  // Instrumented TLS destructors running later register a new one.
+  traceThread = NULL;
+}
+
+static void onProcessExit(void) {
+  // Flush the buffers of all threads still running (e.g., detached ones), not
+  // just the ones of this thread. The other threads may still be recording
+  // events, which are then missing (or, if their buffer is flushed
+  // concurrently, duplicated).
+  pthread_mutex_lock(&queueMutex);
+  for (TraceThread *thread = liveThreads; thread; thread = thread->next)
+    pushChunk(takeEvents(thread->buffers, thread->numBuffers, thread->tid));
+  shuttingDown = 1;
+  const unsigned unregistered = unregisteredBuffers;
+  pthread_cond_signal(&queueCond);
+  pthread_mutex_unlock(&queueMutex);
+
+  pthread_join(writerThread, NULL);
+  fputs("\n]}\n", output);
+  fclose(output);
+
+  if (unregistered) {
+    fprintf(stderr,
+            "Trace buffer: %u buffer(s) of threads with instrumented code in "
+            "more than %d shared libraries were only written when full; "
+            "events may be missing or out of order.\n",
+            unregistered, MAX_BUFFERS_PER_THREAD);
+  }
+}
+
+static void initialize(void) {
+  startNanos = monotonicNanos();
+  startTicks = readTicks();
+
+  const char *path = getenv("LDC_TRACE_FILE");
+  output = fopen(path && *path ? path : "trace.json", "w");
+  if (!output) {
+    perror("Cannot open trace file");
+    return;
+  }
+  fputs("{\"traceEvents\":[\n", output);
+
+  pthread_key_create(&threadKey, &onThreadExit);
+  if (pthread_create(&writerThread, NULL, &writerMain, NULL) != 0) {
+    fclose(output);
+    output = NULL;
+    return;
+  }
+  atexit(&onProcessExit);
+}
+
+// Called by instrumented code before recording an event if the thread's trace
+// buffer is empty (first event) or full.
+void _d_trace_buffer_flush(void *p) {
+  TraceBuffer *buffer = (TraceBuffer *)p;
+
+  if (buffer->pos != 0) {
+    if (traceThread) {
+      for (unsigned i = 0; i < traceThread->numBuffers; ++i) {
+        if (traceThread->buffers[i] == buffer) {
+          flushThread(traceThread);
+          return;
+        }
+      }
+    }
+    enqueue(&buffer, 1, traceThread ? traceThread->tid : 0);
+    return;
+  }
+
+  pthread_once(&initOnce, &initialize);
+  if (!output)
+    return;
+
+  if (!traceThread) {
+    traceThread = calloc(1, sizeof(TraceThread));
+    if (!traceThread)
+      return;
+    pthread_mutex_lock(&queueMutex);
+    traceThread->tid = nextTid++;
+    traceThread->next = liveThreads;
+    if (liveThreads)
+      liveThreads->prev = traceThread;
+    liveThreads = traceThread;
+    pthread_mutex_unlock(&queueMutex);
+    pthread_setspecific(threadKey, traceThread);
+  }
+
+  // The buffers may be flushed by onProcessExit() on another thread.
+  pthread_mutex_lock(&queueMutex);
+  if (traceThread->numBuffers < MAX_BUFFERS_PER_THREAD)
+    traceThread->buffers[traceThread->numBuffers++] = buffer;
+  else
+    ++unregisteredBuffers;
+  pthread_mutex_unlock(&queueMutex);
+}
+
+#endif // !_WIN32